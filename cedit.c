@@ -7,14 +7,26 @@
 /*** INCLUDES ***/
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -27,6 +39,33 @@
 #define ctrl(key) ((key)&0x1f)
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define CEDIT_BRACKETS "([{)]}"
+#define CEDIT_BRACKET_KINDS 3
+#define CEDIT_MAX_WATCHES 8
+#define CEDIT_SAVE_CHUNK (1 << 20)
+#define CEDIT_DIFF_LIMIT 1024
+#define CEDIT_STREAM_CHUNK (1 << 16)
+#define CEDIT_STREAM_BUDGET (1 << 22)
+#define CEDIT_COLD_BLOCK_ROWS 256
+#define CEDIT_LZ_HASH_BITS 12
+#define CEDIT_LZ_MIN_MATCH 4
+#define CEDIT_DEFAULT_MEMORY_BUDGET (256LL << 20)
+#define CEDIT_LONG_ROW (1 << 16)
+#define CEDIT_CHUNK_SIZE 4096
+#define CEDIT_INDEX_MAGIC "CEDITIX2"
+#define CEDIT_SEARCH_MAX_WORKERS 16
+#define CEDIT_SEARCH_MAX_RESULTS 100000
+#define CEDIT_SEARCH_SNIFF 4096
+#define CEDIT_SEARCH_LINE 256
+#define CEDIT_DEFAULT_FPS 60
+#define CEDIT_FRAME_DELAY_LIMIT 50000000LL
+#define CEDIT_TRACE_MAGIC "CEDITTR1"
+#define CEDIT_TRACE_SIZE(rows, columns) ((int32_t)(0x80000000u | (uint32_t)(rows) << 16 | (columns)))
+#define CEDIT_ATTR_INVERSE 0x80
+#define CEDIT_TRANSFORM_MAX_WORKERS 16
+#define CEDIT_TRANSFORM_SLICE (1 << 16)
+#define CEDIT_SERVER_DOCUMENTS 8
+#define CEDIT_HEX_WIDTH 16
 
 /*** GLOBAL DECLARATIONS ***/
 
@@ -53,7 +92,15 @@ enum ceditSyntaxHighlight
   HL_KEYWORD2,
   HL_STRING,
   HL_NUMBER,
-  HL_MATCH
+  HL_MATCH,
+  HL_BRACKET
+};
+
+enum ceditSyncPolicy
+{
+  SYNC_NONE = 0,
+  SYNC_DATA,
+  SYNC_FULL
 };
 
 struct bufferContainer
@@ -73,18 +120,470 @@ struct ceditSyntax
   int flags;
 };
 
+struct ceditKeyword
+{
+  char *text;
+  int length;
+  unsigned char hl;
+};
+
+// An HLDB entry as the highlighter reads it, with keywords bucketed by first byte
+struct ceditSyntaxTable
+{
+  struct ceditKeyword *keywords;
+  int start[257];
+  int scsLength;
+  int mcsLength;
+  int mceLength;
+};
+
+struct bracketSummary
+{
+  int open[CEDIT_BRACKET_KINDS];
+  int close[CEDIT_BRACKET_KINDS];
+};
+
+struct ceditBracketNode
+{
+  int left, right, parent; // -1 for none
+  int count;               // rows in the subtree
+  unsigned int priority;
+  struct bracketSummary own; // the row's summary
+  struct bracketSummary sum; // the subtree's, rows in order
+};
+
+struct ceditSpan
+{
+  uint16_t length;
+  unsigned char hl;
+};
+
+struct ceditHighlightState
+{
+  int inComment;
+  int inString;
+  int prevSep;
+  int lineComment;
+  int previous;
+};
+
+struct ceditChunk
+{
+  int start;
+  int size;
+  int renderStart;
+  int rSize;
+  int tabs;
+  char *characters;
+  char *render;
+  struct ceditSpan *spans;
+  int spanNum;
+  struct ceditHighlightState entry;
+  struct ceditHighlightState exit;
+  struct bracketSummary brackets;
+};
+
+struct ceditFold
+{
+  int first;
+  int last;
+};
+
+struct ceditFoldRun
+{
+  int start;
+  int end;
+  int hiddenBefore;
+};
+
+struct ceditFoldMap
+{
+  struct ceditFold *folds;
+  int foldNum;
+  struct ceditFoldRun *runs;
+  int runNum;
+  int dirty;
+};
+
+struct ceditWatch
+{
+  int fd;
+  void (*handler)(int fd);
+};
+
+struct ceditSaveProgress
+{
+  long long written;
+  int done;
+  int error;
+};
+
+struct ceditInterned
+{
+  int refs;
+  int size;
+  int rSize;
+  int inComment;
+  int hlOpenComment;
+  int footprint;
+  uint64_t hash;
+  char *characters;
+  char *render;
+  struct ceditSpan *spans;
+  int spanNum;
+  struct bracketSummary brackets;
+  struct ceditConfig *owner; // whose memory budget counts it, if anyone's
+  int listed;                // in the owner's table, where ceditInternFind looks
+  struct ceditInterned *next;
+};
+
+struct ceditInternTable
+{
+  int enabled;
+  struct ceditInterned **buckets;
+  int bucketNum;
+  int count;
+  int rows;
+  long long bytes;
+  long long uniqueBytes;
+};
+
+struct ceditDiskState
+{
+  int rowNum;
+  int cleanRows;
+  int canonical;
+  uint64_t *hashes;
+  int *sizes;
+};
+
+struct ceditColdSource
+{
+  int refs;
+  char *text;
+};
+
+struct ceditColdBlock
+{
+  int refs;
+  int rowCount;
+  int rawSize;
+  int packedSize;
+  unsigned char *packed;
+  struct ceditColdSource *source;
+  char *text;
+  int *starts;
+};
+
+struct ceditIndexKey
+{
+  char magic[8];
+  uint64_t size;
+  int64_t mtimeSec;
+  int64_t mtimeNsec;
+  uint64_t inode;
+  uint64_t syntax;
+  uint64_t content;
+};
+
+struct ceditIndexHeader
+{
+  struct ceditIndexKey key;
+  uint32_t rowNum;
+  uint32_t bracketNum;
+  uint32_t lastRowOpen;
+  uint32_t reserved;
+};
+
+struct ceditIndexRow
+{
+  uint32_t size;
+  uint32_t flags;
+};
+
+struct ceditIndexBracket
+{
+  uint32_t row;
+  struct bracketSummary brackets;
+};
+
+struct ceditColdStore
+{
+  long long budget;
+  long long resident;
+  unsigned int clock;
+  unsigned int *tick;
+  int tickCapacity;
+  struct ceditColdBlock *scratchBlock;
+  char *scratch;
+  int scratchCapacity;
+  int offsets[CEDIT_COLD_BLOCK_ROWS];
+  int blocks;
+  long long rawBytes;
+  long long packedBytes;
+  long long unpacks;
+  long long unpackNanos;
+  long long unpackMaxNanos;
+  long long sheds;
+  long long rebuilds;
+};
+
+struct ceditFrameStats
+{
+  long long interval;
+  long long last;
+  long long pending;
+  long long frames;
+  long long latencyNanos;
+  long long latencyMaxNanos;
+};
+
+struct ceditCell
+{
+  char character; // '\0' where what the terminal shows is not known
+  unsigned char attr; // SGR foreground (0 = default) | CEDIT_ATTR_INVERSE
+};
+
+struct ceditOutput
+{
+  struct ceditCell *cells; // the terminal as last drawn, row after row
+  struct ceditCell *scratch;
+  int row, column; // cursor, -1 when not known
+  int attr;        // current SGR, -1 when not known
+  int rep;
+  long long bytes;
+  long long saved; // against whole lines at absolute positions
+};
+
+enum ceditTransformOperation
+{
+  TRANSFORM_SORT = 0,
+  TRANSFORM_UNIQ,
+  TRANSFORM_KEEP,
+  TRANSFORM_DROP,
+  TRANSFORM_INDENT
+};
+
+struct ceditTransform
+{
+  int operation;
+  int first, last; // rows, last excluded; -1 for the whole document
+  int numeric;
+  int reverse;
+  int field;      // sort on the Nth field instead of the whole line
+  char separator; // between fields, or 0 for runs of blanks
+  char *text;     // keep and drop
+  int length;
+  int amount;     // indent
+};
+
+struct ceditSortKey
+{
+  union
+  {
+    uint64_t prefix; // first eight bytes, big-endian, for lexical keys
+    double number;
+  } key;
+  char *text;
+  int length;
+  int row;
+};
+
+struct ceditTraceEvent
+{
+  uint32_t delta; // microseconds since the previous event
+  int32_t key;    // negative for a terminal size, see CEDIT_TRACE_SIZE
+};
+
+struct ceditTrace
+{
+  FILE *fp;
+  int replaying;
+  int fast;
+  int rows;
+  int columns;
+  int report; // the real stdout while a replay draws into /dev/null
+  long long last;
+  long long waited;
+  long long start;
+  long long startup;
+  long long *process;
+  long long *render;
+  int *keys;
+  int eventNum;
+  int eventCapacity;
+};
+
+struct ceditServerRequest
+{
+  char directory[PATH_MAX];
+  char fileName[PATH_MAX];
+  char term[64];
+  int follow;
+};
+
+struct ceditServer
+{
+  int listenFd;
+  struct sockaddr_un address;
+  int rep;
+  struct ceditConfig *documents[CEDIT_SERVER_DOCUMENTS];
+  long long used[CEDIT_SERVER_DOCUMENTS];
+  long long clock;
+  int documentNum;
+};
+
+struct ceditClipboard
+{
+  struct ceditInterned **lines; // joined by newlines, the last one without
+  int lineNum;
+  struct ceditSyntax *syntax;   // what the shared lines were highlighted with
+};
+
+struct ceditBuffer
+{
+  char *fileName;               // as it was asked for, until first shown
+  struct ceditConfig *document; // NULL until then
+};
+
+struct ceditBufferList
+{
+  struct ceditBuffer *buffers;
+  int bufferNum;
+  int current;
+  int previous;
+};
+
+struct ceditHexEdit
+{
+  off_t offset;
+  unsigned char original; // the byte as it is on disk
+};
+
+struct ceditHexView
+{
+  unsigned char *map;          // the whole file, mapped privately; NULL for text
+  off_t size;
+  off_t cursor;
+  off_t top;                   // offset of the first line shown
+  int nibble;                  // 1 once the high half of the byte was typed
+  int ascii;                   // typing into the text column, not the hex one
+  struct ceditHexEdit *edits;  // in offset order
+  int editNum, editCapacity;
+  off_t matchOffset;
+  int matchLength;
+  int stale;                   // the file shrank under the mapping; it is not read again
+};
+
+struct ceditSearchResult
+{
+  char *path; // the matching line is kept after the path, in the same block
+  char *text;
+  int length;
+  int line;
+  int column;
+};
+
+struct ceditSearchQueue
+{
+  pthread_mutex_t lock;
+  char **paths;
+  int head;
+  int tail;
+  int capacity;
+  struct ceditProjectSearch *search;
+};
+
+struct ceditProjectSearch
+{
+  int active;
+  int running;
+  char *query;
+  int queryLength;
+  pthread_t *workers;
+  struct ceditSearchQueue *queues;
+  int workerNum;
+  int notify[2];
+  int selected;
+  int top;
+  struct timespec started;
+  double elapsed;
+  // Shared with the workers, under lock
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  int pending;
+  int idle;
+  int pushes;
+  int cancel;
+  int notified;
+  struct ceditSearchResult *results;
+  int resultNum;
+  int resultCapacity;
+  long long matches;
+  int matchedFiles;
+  int files;
+  int binaryFiles;
+  long long bytes;
+};
+
+struct ceditSaveJob
+{
+  pthread_t thread;
+  char *fileName;
+  int rowNum;
+  char **characters;
+  struct ceditColdBlock **blocks;
+  struct ceditInterned **interned;
+  int *slots;
+  int *sizes;
+  unsigned char *owned;
+  int sync;
+  int pipe[2];
+  int modifiedAtStart;
+  int *ranges;
+  off_t *offsets;
+  int rangeNum;
+  long long size;
+  long long total;
+  long long written;
+};
+
 typedef struct editorRow
 {
   int index;
   int size;
   int rSize;
   int hlOpenComment;
+  int saveSlot;
+  int footprint;
   char *characters;
   char *render;
-  unsigned char *hl;
+  struct ceditSpan *spans;
+  int spanNum;
+  struct bracketSummary brackets;
+  int bracketNode;
+  struct ceditColdBlock *cold;
+  int coldSlot;
+  struct ceditChunk *chunks;
+  int chunkNum;
+  struct ceditInterned *interned;
+  int diskRow;
+  uint64_t hash;
+  unsigned char changed;
+  unsigned char clean;
 
 } editorRow;
 
+struct ceditTransformJob
+{
+  struct ceditTransform *transform;
+  editorRow *rows;
+  struct ceditSortKey *keys;
+  struct ceditSortKey *scratch;
+  unsigned char *dropped;
+  int from, middle, to;
+};
+
 struct ceditConfig
 {
   int cursorX, cursorY;
@@ -96,12 +595,116 @@ struct ceditConfig
   int rowNum;
   int modified;
   char *fileName;
-  char statusMessage[80];
+  char statusMessage[128];
   time_t statusMessageTime;
   struct ceditSyntax *syntax;
   struct termios terminalDefault;
   editorRow *row;
-} Cedit;
+  struct ceditBracketNode *bracketNodes;
+  int bracketNodeNum, bracketNodeCapacity;
+  int bracketFree; // removed nodes, chained through left
+  int bracketRoot;
+  unsigned int bracketSeed;
+  int bracketTreeDirty;
+  int bracketRow, bracketColumn;
+  int bracketMatchRow, bracketMatchColumn;
+  int matchRow, matchColumn, matchLength;
+  struct ceditWatch watch[CEDIT_MAX_WATCHES];
+  int watchNum;
+  int saving;
+  int saveSync;
+  struct ceditSaveJob save;
+  int inotifyFd;
+  int inotifyWatch;
+  int diskChanged;
+  struct stat diskStat;
+  int syntaxDeferred;
+  int *syntaxPending;
+  int syntaxPendingNum;
+  uint64_t *screenHash;
+  char *chunkScratch; // a chunked row joined for reading, see ceditChunkJoin
+  int chunkScratchCapacity;
+  int screenRowOff;
+  int screenColumnOff;
+  struct ceditOutput output;
+  int rowCapacity;
+  int streamFd;
+  long long streamBytes;
+  long long streamTotal;
+  int lastRowOpen;
+  int pendingReturn; // the '\r's that ended the last read, held back from the open row
+  int follow;
+  off_t fileOffset;
+  struct ceditColdStore cold;
+  int indexCache;
+  struct ceditInternTable intern;
+  struct ceditProjectSearch project;
+  struct ceditDiskState disk;
+  struct ceditFrameStats frame;
+  struct ceditFoldMap fold;
+  int markRow, markColumn;
+  struct ceditHexView hex;
+} ceditMain;
+
+/*
+  Every function works on the document that Cedit names. The editor starts
+  on ceditMain and moves to the document of whichever buffer is shown;
+  batch workers point their own thread at a document of their own, so
+  several files can be edited at once without locking.
+*/
+__thread struct ceditConfig *ceditContext = &ceditMain;
+#define Cedit (*ceditContext)
+
+int ceditHeadless = 0;
+
+// Recording and replay cover the whole session, not a single document
+struct ceditTrace ceditTrace = {NULL, 0, 0, 0, 0, -1, 0, 0, 0, 0, NULL, NULL, NULL, 0, 0};
+
+// The warm documents of --server, shared by every client it forks
+struct ceditServer ceditServer;
+
+// The files named on the command line or opened with ctrl+W
+struct ceditBufferList ceditBuffers;
+
+// Cut and copied text, which can be pasted into any buffer
+struct ceditClipboard ceditClipboard;
+
+// Where a read of a hex view's mapping goes if the file shrank under it
+sigjmp_buf ceditHexFault;
+volatile sig_atomic_t ceditHexGuarded = 0;
+
+enum ceditBatchOperation
+{
+  BATCH_GOTO = 0,
+  BATCH_FIND,
+  BATCH_REPLACE,
+  BATCH_INSERT,
+  BATCH_APPEND,
+  BATCH_DELETE,
+  BATCH_TRANSFORM
+};
+
+struct ceditBatchStep
+{
+  int operation;
+  int line;
+  int count;
+  char *text;
+  int length;
+  char *replacement;
+  int replacementLength;
+};
+
+struct ceditBatch
+{
+  struct ceditBatchStep *steps;
+  int stepNum;
+  char **files;
+  int fileNum;
+  int next;
+  int failed;
+  pthread_mutex_t lock;
+};
 
 /*** SYNTAX DEFINITIONS ***/
 char *extensionC[] = {".character", ".h", ".cpp", NULL};
@@ -121,17 +724,87 @@ struct ceditSyntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// Compiled from HLDB on first use; every document and thread reads the same ones
+struct ceditSyntaxTable ceditSyntaxTables[HLDB_ENTRIES];
+pthread_once_t ceditSyntaxOnce = PTHREAD_ONCE_INIT;
+
 /*** FUNCTION PROTOTYPES ***/
 
 void startCedit();
+void ceditStartTerminal();
+void ceditInitDocument();
+void ceditEditLoop();
+void ceditCloseDocument();
+void ceditClearRows();
 void terminateProgram(const char *errorMessage);
 void rawModeOff();
 void rawModeOn();
 void ceditUpdateSyntax(editorRow *row);
 void ceditHighlightSyntax();
+void ceditSyntaxCompile();
+void ceditSyntaxFlush();
+void ceditSyntaxPropagate(editorRow *row, int inComment);
 void ceditUpdateRow(editorRow *row);
+void ceditBracketSummarize(editorRow *row);
+void ceditBracketStore(editorRow *row);
+void ceditBracketCombine(struct bracketSummary *out, struct bracketSummary *left, struct bracketSummary *right);
+void ceditBracketBuild();
+void ceditBracketPull(int node);
+void ceditBracketSplit(int node, int count, int *left, int *right);
+void ceditBracketRemove(int at);
+void ceditBracketHighlight();
+void ceditJumpToBracket();
+void ceditEnclosingBlock();
+void ceditFoldRebuild();
+void ceditFoldAdd(int first, int last);
+void ceditFoldRemove(int k);
+void ceditFoldShift(int at, int delta);
+void ceditFoldSplice(int first, int last, int delta);
+void ceditFoldReveal(int row);
+void ceditFoldToggle();
+void ceditFoldToLine();
 void ceditInsertRow(int at, char *s, size_t length);
 void ceditFreeRow(editorRow *row);
+void ceditRowDetach(editorRow *row);
+void ceditRowSetCharacters(editorRow *row, char *characters, int size);
+void ceditRowWarm(editorRow *row);
+void ceditRowLayout(editorRow *row);
+void ceditRowRebuild(editorRow *row);
+void ceditColdGrow(int range);
+void ceditColdTouch(int at);
+void ceditColdShed(int first, int count);
+void ceditColdCompress(int first, int count);
+void ceditColdCompact();
+void ceditColdRelease(struct ceditColdBlock *block);
+void ceditColdUnpack(struct ceditColdBlock *block, char *raw, int *offsets);
+void ceditShowStats();
+void ceditInternAdd(editorRow *row, uint64_t hash, int inComment);
+void ceditInternAttach(editorRow *row, struct ceditInterned *entry);
+void ceditInternDetach(editorRow *row);
+void ceditInternRelease(struct ceditInterned *entry);
+void ceditRowUnshare(editorRow *row);
+void ceditRowSplice(int at, struct ceditInterned **lines, int count, struct ceditSyntax *syntax);
+void ceditClipboardClear();
+void ceditClipboardCut();
+void ceditClipboardPaste();
+void ceditDeleteRange(int firstRow, int firstColumn, int lastRow, int lastColumn);
+void ceditToggleMark();
+void ceditRowChunk(editorRow *row);
+void ceditRowFlatten(editorRow *row);
+void ceditChunkFree(editorRow *row);
+void ceditChunkRender(struct ceditChunk *chunk, int renderStart);
+void ceditChunkLayout(editorRow *row);
+void ceditChunkSplit(editorRow *row, int k);
+void ceditChunkInsert(editorRow *row, int at, char *s, int length);
+void ceditChunkDelete(editorRow *row, int at);
+void ceditChunkMerge(editorRow *row, int k);
+void ceditChunkSyntax(editorRow *row, struct ceditHighlightState *state);
+int ceditChunkWindow(editorRow *row, int from, int length, char *render, struct ceditSpan *spans);
+void ceditHighlightSpan(char *render, int length, struct ceditHighlightState *state,
+                        struct ceditSpan **spans, int *spanNum);
+void ceditSpanPush(struct ceditSpan **spans, int *spanNum, int hl, int count);
+void ceditSpanShrink(struct ceditSpan **spans, int spanNum);
+void ceditBracketCount(struct bracketSummary *summary, char *render, struct ceditSpan *spans, int spanNum);
 void ceditDeleteRow(int at);
 void ceditRowInsertCharacter(editorRow *row, int at, int character);
 void ceditRowAppendString(editorRow *row, char *s, size_t length);
@@ -140,12 +813,62 @@ void ceditInsertCharacter(int character);
 void ceditInsertNewline();
 void ceditDeleteCharacter();
 void ceditOpen(char *fileName);
+void ceditIndexKey(struct ceditIndexKey *key, const char *text, struct stat *st);
+void ceditIndexWrite(int fd, struct stat *opened, int *gaps);
+void ceditIndexUnmap(char *data, struct stat *st);
+void ceditStreamOpen(int fd);
+void ceditStreamHandler(int fd);
+void ceditAppendText(char *text, int length);
+void ceditDiskTouch(editorRow *row);
+void ceditDiskCheck(editorRow *row);
+void ceditDiskReset(int canonical);
+void ceditDiskAppend(int first, int grown);
 void ceditSave();
+void ceditSavePlan(struct ceditSaveJob *job, int partial);
+void *ceditSaveWorker(void *argument);
+void ceditSaveProgressHandler(int fd);
+void ceditSaveWait();
+void ceditWatchFile();
+void ceditFileEventHandler(int fd);
+void ceditReload();
+void ceditFollowUpdate();
+void ceditToggleFollow();
+void ceditApplyDiff(char **lines, int *lengths, int lineNum);
 void ceditFindCallback(char *query, int key);
 void ceditFind();
+void ceditReplaceAll();
+void ceditTransformPrompt();
+void ceditTransformCommit(int first, int count, int *order, int kept);
+void ceditParallel(void *(*worker)(void *), struct ceditTransformJob *jobs, int jobNum);
+void ceditSortSlice(struct ceditTransform *transform, struct ceditSortKey *keys, struct ceditSortKey *scratch, int count);
+void ceditSortMerge(struct ceditTransform *transform, struct ceditSortKey *left, int leftNum,
+                    struct ceditSortKey *right, int rightNum, struct ceditSortKey *out);
+void *ceditSortWorker(void *argument);
+void *ceditMergeWorker(void *argument);
+void *ceditFilterWorker(void *argument);
+void *ceditBatchWorker(void *argument);
+void ceditQueuePush(struct ceditSearchQueue *queue, char *path);
+void ceditProjectStart(char *query);
+void ceditProjectStop();
+void *ceditProjectWorker(void *argument);
+void ceditProjectHandler(int fd);
+void ceditProjectSearch();
+void ceditProjectOpen();
+void ceditProjectScroll();
+void ceditProjectPrintResults(struct bufferContainer *bc);
+void ceditProjectStatus(char *status, int *length, char *rStatus, int *rLength);
 void appendBuffer(struct bufferContainer *bc, const char *s, int length);
 void freeBuffer(struct bufferContainer *bc);
 void ceditScroll();
+void ceditScrollTerminal(struct bufferContainer *bc);
+void ceditOutputReset();
+void ceditOutputDetect(int rep);
+void ceditOutputAttr(struct bufferContainer *bc, int attr);
+void ceditOutputMove(struct bufferContainer *bc, int row, int column);
+void ceditOutputReach(struct bufferContainer *bc, int row, int column);
+void ceditOutputPut(struct bufferContainer *bc, int row, int column, struct ceditCell cell);
+void ceditOutputLine(struct bufferContainer *bc, int y, struct bufferContainer *line);
+void ceditEmitLine(struct bufferContainer *bc, int y, struct bufferContainer *line);
 void ceditPrintRows(struct bufferContainer *bc);
 void ceditDrawStatusBar(struct bufferContainer *bc);
 void ceditDrawMessageBar(struct bufferContainer *bc);
@@ -153,20 +876,163 @@ void ceditRefreshTerminal();
 void ceditSetStatusMessage(const char *fmt, ...);
 void ceditMoveCursor(int key);
 void ceditProcessKeypress();
+void ceditWatchFd(int fd, void (*handler)(int fd));
+void ceditUnwatchFd(int fd);
+void ceditWaitForInput();
+void ceditDrainInput();
+void ceditTraceWrite(int32_t key);
+void ceditTraceResize(int32_t key);
+void ceditTraceReport();
+void ceditTraceSummary(char *name, long long *times, int count);
+void ceditReplay();
+void ceditServerDrop(int k);
+void ceditServerHangup(int fd);
+void ceditServerStop(int signalNumber);
+void ceditServerStart(int connection, struct ceditServerRequest *request, int *fds);
+void ceditServerSession(int connection, struct ceditConfig *document, struct ceditServerRequest *request, int *fds);
+void ceditInheritOptions(struct ceditConfig *from);
+void ceditBufferHandOver(struct ceditConfig *from, struct ceditConfig *to);
+void ceditBufferPrompt();
+void ceditHexClose();
+void ceditHexScroll();
+void ceditHexPrintRows(struct bufferContainer *bc);
+void ceditHexByte(struct bufferContainer *line, off_t offset, unsigned char byte, int ascii);
+void ceditHexFaultHandler(int signalNumber);
+void ceditHexCheck();
+void ceditHexStale();
+void ceditHexCursor(int *row, int *column);
+void ceditHexWrite(off_t offset, unsigned char value);
+void ceditHexMove(off_t offset);
+void ceditHexFindCallback(char *query, int key);
+void ceditHexFind();
+void ceditHexGoto();
+void ceditHexSave();
+void ceditHexReload();
 int ceditReadCharacter();
+int ceditReadTerminal();
+int ceditTraceNext();
+int ceditTraceTimeout();
+int ceditTraceCompare(const void *a, const void *b);
+int ceditTraceRecord(char *traceName);
+int ceditTraceReplay(char *traceName, int fast);
+int ceditInputPending(int timeout);
 int getCursorPosition(int *rows, int *columns);
 int ceditRowCursorTransformCxtoRx(editorRow *row, int cursorX);
 int ceditRowCursorTransformRxToCx(editorRow *row, int rowX);
+int ceditBracketAt(editorRow *row, int rowX, int *isOpen);
+int ceditBracketScanRow(editorRow *row, int from, int direction, int kind, int *depth);
+int ceditFoldRun(int row);
+int ceditFoldAt(int row);
+int ceditFoldHidden(int row);
+int ceditFoldVisible(int row);
+int ceditFoldRow(int line);
+int ceditFoldStep(int row, int direction);
+int ceditFoldIndent(int row);
+int ceditFoldRegion(int row, int *first, int *last);
+int ceditBracketSearchForward(int node, int low, int from, int kind, int *depth);
+int ceditBracketSearchBackward(int node, int low, int to, int kind, int *depth);
+int ceditBracketMerge(int left, int right);
+int ceditBracketInsert(int at);
+unsigned int ceditBracketPriority();
+int ceditBracketMatch(int fileRow, int rowX, int *matchRow, int *matchRowX);
+int ceditBracketEnclosing(int fileRow, int rowX, int *openRow, int *openRowX);
+int ceditReplaceInRow(editorRow *row, char *query, int queryLength, char *replacement, int replacementLength);
+int ceditReplaceRows(char *query, int queryLength, char *replacement, int replacementLength, int *rows);
+int ceditTransformParse(char *command, struct ceditTransform *transform);
+int ceditTransformRun(struct ceditTransform *transform);
+int ceditTransformWorkers(int count);
+int ceditTransformSort(struct ceditTransform *transform, int first, int count);
+int ceditTransformFilter(struct ceditTransform *transform, int first, int count);
+int ceditTransformIndent(struct ceditTransform *transform, int first, int count);
+int ceditSortCompare(struct ceditTransform *transform, struct ceditSortKey *a, struct ceditSortKey *b);
+double ceditSortNumber(char *s, int length);
+int ceditBatchParse(char *scriptName, struct ceditBatch *batch);
+int ceditBatchReplaceStep(char *argument, struct ceditBatchStep *step);
+int ceditBatchApply(struct ceditBatch *batch);
+int ceditBatchFind(char *text, int length);
+int ceditBatchWrite(char *fileName);
+int ceditBatchRun(char *scriptName, char **files, int fileNum, int jobs);
+int ceditProjectVisit(struct ceditProjectSearch *search, int self, char *path);
+int ceditProjectList(struct ceditProjectSearch *search, int self, char *path, int fd);
+int ceditProjectScan(struct ceditProjectSearch *search, char *path, int fd, off_t size,
+                     struct ceditSearchResult **found, int *foundNum, long long *matches);
+int ceditProjectKeypress(int character);
+double ceditProjectElapsed();
+long long ceditNanos();
+int ceditLzCompress(const unsigned char *in, int length, unsigned char *out);
+int ceditLzDecompress(const unsigned char *in, int length, unsigned char *out);
+int ceditColdCompare(const void *a, const void *b);
+struct ceditInterned *ceditInternFind(char *s, int length, int inComment, uint64_t hash);
+struct ceditInterned *ceditInternShare(editorRow *row);
+struct ceditInterned *ceditClipboardText(char *s, int length);
+int ceditSelection(int *firstRow, int *firstColumn, int *lastRow, int *lastColumn);
+int ceditClipboardCopy(int firstRow, int firstColumn, int lastRow, int lastColumn);
+int ceditChunkFind(editorRow *row, int at, int column);
+int ceditChunkSafe(int character);
+int ceditChunkCut(char *characters, int size);
+int ceditIndexLoad(char *fileName);
+int ceditIndexApply(struct ceditIndexHeader *header, const char *data, struct stat *st);
+int ceditChunkScan(editorRow *row, int from, int direction, int kind, int *depth);
+int ceditBracketKind(char *render, struct ceditSpan *spans, int spanNum, int at, int *isOpen);
+int ceditSpanClass(struct ceditSpan *spans, int spanNum, int at);
+int ceditSpanSlice(struct ceditSpan *spans, int spanNum, int from, int length, struct ceditSpan *out);
+int ceditRowFootprint(editorRow *row);
 int getTerminalSize(int *rows, int *columns);
+int ceditOutputParse(struct bufferContainer *line, struct ceditCell *cells);
+int ceditAttrSequence(int from, int attr, char *out);
+int ceditMoveSequence(int row, int column, char *out);
+int ceditMoveAlong(int from, int to, char *out);
+int ceditRedirectInput();
 int isSeparator(int character);
 int ceditSyntaxColoring(int hl);
+int ceditReadLines(char *fileName, char ***lines, int **lengths);
+int ceditDiskStatChanged(struct stat *st);
+int ceditModified();
+uint64_t ceditHash(const char *s, int length);
+uint64_t ceditHashContent(const char *s, size_t length);
 char *ceditPrompt(char *prompt, void (*callback)(char *, int));
+char *ceditPromptInput(char *prompt, void (*callback)(char *, int), int empty);
 char *ceditRowToString(int *bufferLength);
+char *ceditSearch(char *text, int length, char *query, int queryLength);
+char *ceditQueueTake(struct ceditProjectSearch *search, int self);
+char *ceditRowText(editorRow *row);
+char *ceditChunkJoin(editorRow *row, int render);
+char *ceditIndexPath(char *fileName, int create);
+char *ceditIndexMap(int fd, struct stat *st);
+struct ceditConfig *ceditServerDocument(char *path);
+int ceditServerAddress(struct sockaddr_un *address);
+int ceditServerListen();
+int ceditServerReceive(int connection, struct ceditServerRequest *request, int *fds);
+int ceditServerRun();
+int ceditClient(char *fileName, int follow);
+int ceditBufferAdd(char *fileName);
+int ceditBufferFind(char *name);
+int ceditBufferShow(int k);
+int ceditHexOpen(char *fileName);
+int ceditHexDigits();
+int ceditHexColumn(int width, int at, int ascii);
+int ceditHexWidth();
+int ceditHexEditFind(off_t offset);
+int ceditHexCopy(void *to, const void *from, size_t length);
+int ceditHexPattern(char *query, unsigned char *pattern);
+int ceditHexKeypress(int character);
+off_t ceditHexBackward(unsigned char *pattern, int length, off_t high, off_t low);
+off_t ceditHexScan(unsigned char *pattern, int length, off_t from, int direction);
+off_t ceditHexSearch(unsigned char *pattern, int length, off_t from, int direction);
+int ceditBufferModified();
+char *ceditBufferName(int k);
 
 /*** TERMINAL MANIPULATION ***/
 
 void terminateProgram(const char *errorMessage)
 {
+  // Batch runs never take over the terminal, so there is no screen to clear
+  if (ceditHeadless)
+  {
+    perror(errorMessage);
+    exit(1);
+  }
+
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
   perror(errorMessage);
@@ -176,7 +1042,25 @@ void terminateProgram(const char *errorMessage)
 
 void usageProgram()
 {
-  char msg[] = "Cedit Usage:\n\rOpen new file:\t\t./cedit\n\rEdit existing file:\t./cedit filename\n\r";
+  char msg[] = "Cedit Usage:\n\rOpen new file:\t\t./cedit [options]\n\rEdit existing files:\t./cedit [options] filename...\n\r"
+               "Read from a pipe:\t./cedit [options] -\n\r"
+               "Batch edit files:\t./cedit --batch script [--jobs=N] file...\n\r"
+               "Keep files loaded:\t./cedit --server [options]\n\r"
+               "Open through a server:\t./cedit --client [--follow] [filename]\n\r"
+               "Options:\n\r  --sync=none|fdatasync|fsync\tflush policy for saves\n\r"
+               "  --follow\t\t\tappend lines written to the file (tail -f)\n\r"
+               "  --memory-budget=MB\t\tcompress rows not in use beyond this (0 = never)\n\r"
+               "  --index-cache\t\t\tkeep a line index to reopen large files quickly\n\r"
+               "  --intern\t\t\tshare memory between identical lines\n\r"
+               "  --fps=N\t\t\tredraw at most N times a second (0 = after every key)\n\r"
+               "  --record=FILE\t\t\twrite the keys typed, and when, to FILE\n\r"
+               "  --replay=FILE\t\t\ttype the keys in FILE again and time each one\n\r"
+               "  --replay-speed=original|fast\tas they were typed, or back to back\n\r"
+               "  --rep\t\t\t\tsend REP for repeated characters (if the terminal has it)\n\r"
+               "  --jobs=N\t\t\tfiles edited at once in batch mode (default: one per CPU)\n\r"
+               "Batch script commands, one per line:\n\r"
+               "  goto N | find TEXT | replace /OLD/NEW/ | insert TEXT | append TEXT | delete [N]\n\r"
+               "  [N,M] sort [-n] [-r] [-k N] [-t C] | uniq | keep TEXT | drop TEXT | indent N\n\r";
   write(STDOUT_FILENO, msg, sizeof(msg));
   exit(1);
 }
@@ -241,10 +1125,122 @@ void rawModeOn()
     terminateProgram("Tcsetattr Error!");
 }
 
+/*
+  Background work (saves, file watchers, ...) registers its descriptors
+  here. While the editor waits for a key, ready descriptors are handed to
+  their handlers and the screen is refreshed, so progress shows up even in
+  the middle of a prompt.
+*/
+
+void ceditWatchFd(int fd, void (*handler)(int fd))
+{
+  if (Cedit.watchNum == CEDIT_MAX_WATCHES)
+    terminateProgram("Watch Error!");
+  Cedit.watch[Cedit.watchNum].fd = fd;
+  Cedit.watch[Cedit.watchNum].handler = handler;
+  Cedit.watchNum++;
+}
+
+void ceditUnwatchFd(int fd)
+{
+  int j;
+  for (j = 0; j < Cedit.watchNum; j++)
+  {
+    if (Cedit.watch[j].fd == fd)
+    {
+      Cedit.watch[j] = Cedit.watch[--Cedit.watchNum];
+      return;
+    }
+  }
+}
+
+void ceditWaitForInput()
+{
+  struct pollfd fds[CEDIT_MAX_WATCHES + 1];
+
+  while (1)
+  {
+    int count = Cedit.watchNum;
+    int j;
+    // A replay has no keyboard; it only waits for the next key to fall due
+    fds[0].fd = ceditTrace.replaying ? -1 : STDIN_FILENO;
+    fds[0].events = POLLIN;
+    for (j = 0; j < count; j++)
+    {
+      fds[j + 1].fd = Cedit.watch[j].fd;
+      fds[j + 1].events = POLLIN;
+    }
+
+    int ready = poll(fds, count + 1, ceditTraceTimeout());
+    if (ready == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      terminateProgram("Poll Error!");
+    }
+    // Only a server's child outlives its terminal: it is not in the
+    // terminal's session, so no SIGHUP comes and reads would see EOF forever
+    if (fds[0].revents & POLLHUP)
+    {
+      ceditSaveWait();
+      _exit(1);
+    }
+    if (ready == 0 || fds[0].revents)
+      return;
+
+    int handled = 0;
+    for (j = 1; j <= count; j++)
+    {
+      if (!fds[j].revents)
+        continue;
+      int k;
+      for (k = 0; k < Cedit.watchNum; k++)
+      {
+        if (Cedit.watch[k].fd == fds[j].fd)
+        {
+          Cedit.watch[k].handler(fds[j].fd);
+          handled = 1;
+          break;
+        }
+      }
+    }
+    if (handled)
+      ceditRefreshTerminal();
+  }
+}
+
+int ceditInputPending(int timeout)
+{
+  struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&fd, 1, timeout) > 0;
+}
+
+long long ceditNanos()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
 int ceditReadCharacter()
+{
+  if (ceditTrace.replaying)
+    return ceditTraceNext();
+
+  int key = ceditReadTerminal();
+  if (ceditTrace.fp)
+    ceditTraceWrite(key);
+  return key;
+}
+
+int ceditReadTerminal()
 {
   int readReturn;
   char character;
+  ceditWaitForInput();
+  // Latency is measured from the oldest key the screen does not show yet
+  if (!Cedit.frame.pending)
+    Cedit.frame.pending = ceditNanos();
   while ((readReturn = read(STDIN_FILENO, &character, 1)) != 1)
   {
     if (readReturn == -1 && errno != EAGAIN)
@@ -378,37 +1374,165 @@ int isSeparator(int character)
 
 void ceditUpdateSyntax(editorRow *row)
 {
-  row->hl = realloc(row->hl, row->rSize);
-  memset(row->hl, HL_NORMAL, row->rSize);
+  if (row->cold)
+  {
+    // Warming re-highlights the whole block against its neighbours
+    ceditRowWarm(row);
+    return;
+  }
+  ceditRowUnshare(row);
+  if (row->render == NULL && row->chunks == NULL)
+    ceditRowLayout(row);
+
+  struct ceditHighlightState state = {
+      row->index > 0 && Cedit.row[row->index - 1].hlOpenComment, 0, 1, 0, HL_NORMAL};
+  if (row->chunks)
+    ceditChunkSyntax(row, &state);
+  else
+  {
+    row->spanNum = 0;
+    ceditHighlightSpan(row->render, row->rSize, &state, &row->spans, &row->spanNum);
+    ceditSpanShrink(&row->spans, row->spanNum);
+  }
+  int footprint = ceditRowFootprint(row);
+  Cedit.cold.resident += footprint - row->footprint;
+  row->footprint = footprint;
+  ceditBracketSummarize(row);
+  if (Cedit.syntax == NULL)
+    return;
+  ceditSyntaxPropagate(row, state.inComment);
+}
+
+void ceditSyntaxPropagate(editorRow *row, int inComment)
+{
+  int changed = (row->hlOpenComment != inComment);
+  row->hlOpenComment = inComment;
+  if (!changed || row->index + 1 >= Cedit.rowNum)
+    return;
+
+  if (Cedit.syntaxDeferred)
+  {
+    Cedit.syntaxPending = realloc(Cedit.syntaxPending, sizeof(int) * (Cedit.syntaxPendingNum + 1));
+    Cedit.syntaxPending[Cedit.syntaxPendingNum++] = row->index + 1;
+    return;
+  }
+  ceditUpdateSyntax(&Cedit.row[row->index + 1]);
+}
+
+/*
+  Highlight classes are stored as runs: a span gives a class and how many
+  rendered characters it covers, and the spans of a row (or chunk) cover
+  all of its render. Most text is long stretches of one class, so this is
+  a few bytes per row instead of one per character. Lists are always built
+  from empty, growing at powers of two, and trimmed once complete.
+*/
+
+void ceditSpanPush(struct ceditSpan **spans, int *spanNum, int hl, int count)
+{
+  while (count > 0)
+  {
+    struct ceditSpan *last = *spanNum ? &(*spans)[*spanNum - 1] : NULL;
+    if (last == NULL || last->hl != hl || last->length == UINT16_MAX)
+    {
+      if ((*spanNum & (*spanNum - 1)) == 0)
+        *spans = realloc(*spans, sizeof(struct ceditSpan) * (*spanNum ? *spanNum * 2 : 1));
+      last = &(*spans)[(*spanNum)++];
+      last->length = 0;
+      last->hl = hl;
+    }
+    int take = UINT16_MAX - last->length < count ? UINT16_MAX - last->length : count;
+    last->length += take;
+    count -= take;
+  }
+}
+
+void ceditSpanShrink(struct ceditSpan **spans, int spanNum)
+{
+  if (spanNum == 0)
+  {
+    free(*spans);
+    *spans = NULL;
+  }
+  else
+    *spans = realloc(*spans, sizeof(struct ceditSpan) * spanNum);
+}
+
+int ceditSpanClass(struct ceditSpan *spans, int spanNum, int at)
+{
+  int k;
+  for (k = 0; k < spanNum; k++)
+  {
+    if (at < spans[k].length)
+      return spans[k].hl;
+    at -= spans[k].length;
+  }
+  return HL_NORMAL;
+}
+
+// The spans covering [from, from + length), clipped to it; returns their count
+int ceditSpanSlice(struct ceditSpan *spans, int spanNum, int from, int length, struct ceditSpan *out)
+{
+  int count = 0, start = 0;
+  int k;
+  for (k = 0; k < spanNum && start < from + length; start += spans[k++].length)
+  {
+    int first = start > from ? start : from;
+    int last = start + spans[k].length < from + length ? start + spans[k].length : from + length;
+    if (first >= last)
+      continue;
+    out[count].length = last - first;
+    out[count].hl = spans[k].hl;
+    count++;
+  }
+  return count;
+}
 
+/*
+  Highlights one run of rendered text, appending its spans. The state
+  carries what is still open at its end, so a long row can be highlighted
+  a chunk at a time.
+*/
+void ceditHighlightSpan(char *render, int length, struct ceditHighlightState *state,
+                        struct ceditSpan **spans, int *spanNum)
+{
+  int first = *spanNum;
   if (Cedit.syntax == NULL)
+  {
+    ceditSpanPush(spans, spanNum, HL_NORMAL, length);
     return;
+  }
+  if (state->lineComment)
+  {
+    ceditSpanPush(spans, spanNum, HL_COMMENT, length);
+    return;
+  }
 
-  char **keywords = Cedit.syntax->keywords;
+  struct ceditSyntaxTable *table = &ceditSyntaxTables[Cedit.syntax - HLDB];
 
   char *scs = Cedit.syntax->singleLineCommentStart;
   char *mcs = Cedit.syntax->multiLineCommentStart;
   char *mce = Cedit.syntax->multiLineCommentEnd;
 
-  int scsLength = scs ? strlen(scs) : 0;
-  int mcsLength = mcs ? strlen(mcs) : 0;
-  int mceLength = mce ? strlen(mce) : 0;
+  int scsLength = table->scsLength;
+  int mcsLength = table->mcsLength;
+  int mceLength = table->mceLength;
 
-  int prevSep = 1;
-  int inString = 0;
-  int inComment = (row->index > 0 && Cedit.row[row->index - 1].hlOpenComment);
+  int prevSep = state->prevSep;
+  int inString = state->inString;
+  int inComment = state->inComment;
 
   int i = 0;
-  while (i < row->rSize)
+  while (i < length)
   {
-    char character = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    char character = render[i];
+    unsigned char prev_hl = (*spanNum > first) ? (*spans)[*spanNum - 1].hl : state->previous;
 
     if (scsLength && !inString && !inComment)
     {
-      if (!strncmp(&row->render[i], scs, scsLength))
+      if (!strncmp(&render[i], scs, scsLength))
       {
-        memset(&row->hl[i], HL_COMMENT, row->rSize - i);
+        ceditSpanPush(spans, spanNum, HL_COMMENT, length - i);
+        state->lineComment = 1;
         break;
       }
     }
@@ -417,10 +1541,9 @@ void ceditUpdateSyntax(editorRow *row)
     {
       if (inComment)
       {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mceLength))
+        if (!strncmp(&render[i], mce, mceLength))
         {
-          memset(&row->hl[i], HL_MLCOMMENT, mceLength);
+          ceditSpanPush(spans, spanNum, HL_MLCOMMENT, mceLength);
           i += mceLength;
           inComment = 0;
           prevSep = 1;
@@ -428,13 +1551,14 @@ void ceditUpdateSyntax(editorRow *row)
         }
         else
         {
+          ceditSpanPush(spans, spanNum, HL_MLCOMMENT, 1);
           i++;
           continue;
         }
       }
-      else if (!strncmp(&row->render[i], mcs, mcsLength))
+      else if (!strncmp(&render[i], mcs, mcsLength))
       {
-        memset(&row->hl[i], HL_MLCOMMENT, mcsLength);
+        ceditSpanPush(spans, spanNum, HL_MLCOMMENT, mcsLength);
         i += mcsLength;
         inComment = 1;
         continue;
@@ -445,13 +1569,13 @@ void ceditUpdateSyntax(editorRow *row)
     {
       if (inString)
       {
-        row->hl[i] = HL_STRING;
-        if (character == '\\' && i + 1 < row->rSize)
+        if (character == '\\' && i + 1 < length)
         {
-          row->hl[i + 1] = HL_STRING;
+          ceditSpanPush(spans, spanNum, HL_STRING, 2);
           i += 2;
           continue;
         }
+        ceditSpanPush(spans, spanNum, HL_STRING, 1);
         if (character == inString)
           inString = 0;
         i++;
@@ -463,7 +1587,7 @@ void ceditUpdateSyntax(editorRow *row)
         if (character == '"' || character == '\'')
         {
           inString = character;
-          row->hl[i] = HL_STRING;
+          ceditSpanPush(spans, spanNum, HL_STRING, 1);
           i++;
           continue;
         }
@@ -475,7 +1599,7 @@ void ceditUpdateSyntax(editorRow *row)
       if ((isdigit(character) && (prevSep || prev_hl == HL_NUMBER)) ||
           (character == '.' && prev_hl == HL_NUMBER))
       {
-        row->hl[i] = HL_NUMBER;
+        ceditSpanPush(spans, spanNum, HL_NUMBER, 1);
         i++;
         prevSep = 0;
         continue;
@@ -484,37 +1608,56 @@ void ceditUpdateSyntax(editorRow *row)
 
     if (prevSep)
     {
+      // Only the keywords that start with this character can match here
+      unsigned char first = character;
       int j;
-      for (j = 0; keywords[j]; j++)
+      for (j = table->start[first]; j < table->start[first + 1]; j++)
       {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
-
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            isSeparator(row->render[i + klen]))
+        struct ceditKeyword *keyword = &table->keywords[j];
+        if (!strncmp(&render[i], keyword->text, keyword->length) &&
+            isSeparator(render[i + keyword->length]))
         {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
+          ceditSpanPush(spans, spanNum, keyword->hl, keyword->length);
+          i += keyword->length;
           break;
         }
       }
-      if (keywords[j] != NULL)
+      if (j < table->start[first + 1])
       {
         prevSep = 0;
         continue;
       }
     }
 
+    ceditSpanPush(spans, spanNum, HL_NORMAL, 1);
     prevSep = isSeparator(character);
     i++;
   }
 
-  int changed = (row->hlOpenComment != inComment);
-  row->hlOpenComment = inComment;
-  if (changed && row->index + 1 < Cedit.rowNum)
-    ceditUpdateSyntax(&Cedit.row[row->index + 1]);
+  state->prevSep = prevSep;
+  state->inString = inString;
+  state->inComment = inComment;
+  if (*spanNum > first)
+    state->previous = (*spans)[*spanNum - 1].hl;
+}
+
+/*
+  Bulk edits set syntaxDeferred while they update rows top-down, so a row
+  whose comment state changes only records where propagation has to start.
+  The flush then carries the new state downwards once per recorded row.
+*/
+void ceditSyntaxFlush()
+{
+  int j;
+  Cedit.syntaxDeferred = 0;
+  for (j = 0; j < Cedit.syntaxPendingNum; j++)
+  {
+    if (Cedit.syntaxPending[j] < Cedit.rowNum)
+      ceditUpdateSyntax(&Cedit.row[Cedit.syntaxPending[j]]);
+  }
+  free(Cedit.syntaxPending);
+  Cedit.syntaxPending = NULL;
+  Cedit.syntaxPendingNum = 0;
 }
 
 int ceditSyntaxColoring(int hl)
@@ -534,16 +1677,70 @@ int ceditSyntaxColoring(int hl)
     return 31;
   case HL_MATCH:
     return 34;
+  case HL_BRACKET:
+    return 96;
   default:
     return 37;
   }
 }
 
+/*
+  Turns each HLDB entry into the form ceditHighlightSpan wants: keyword
+  lengths and kinds worked out once rather than for every character, and
+  the keywords grouped by their first byte (in their original order, so
+  the first match still wins), so a position is only compared with the
+  few keywords that could start there. Done once for the whole process.
+*/
+void ceditSyntaxCompile()
+{
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES; j++)
+  {
+    struct ceditSyntax *s = &HLDB[j];
+    struct ceditSyntaxTable *table = &ceditSyntaxTables[j];
+    int count = 0, k;
+    while (s->keywords[count])
+      count++;
+
+    table->keywords = malloc(sizeof(struct ceditKeyword) * (count ? count : 1));
+    if (table->keywords == NULL)
+      terminateProgram("Memory Error!");
+    memset(table->start, 0, sizeof(table->start));
+    for (k = 0; k < count; k++)
+      table->start[(unsigned char)s->keywords[k][0] + 1]++;
+    for (k = 0; k < 256; k++)
+      table->start[k + 1] += table->start[k];
+
+    int next[256];
+    memcpy(next, table->start, sizeof(next));
+    for (k = 0; k < count; k++)
+    {
+      char *text = s->keywords[k];
+      int length = strlen(text);
+      struct ceditKeyword *keyword = &table->keywords[next[(unsigned char)text[0]]++];
+      keyword->text = text;
+      keyword->hl = HL_KEYWORD1;
+      if (length && text[length - 1] == '|')
+      {
+        length--;
+        keyword->hl = HL_KEYWORD2;
+      }
+      keyword->length = length;
+    }
+
+    table->scsLength = s->singleLineCommentStart ? strlen(s->singleLineCommentStart) : 0;
+    table->mcsLength = s->multiLineCommentStart ? strlen(s->multiLineCommentStart) : 0;
+    table->mceLength = s->multiLineCommentEnd ? strlen(s->multiLineCommentEnd) : 0;
+  }
+}
+
 void ceditHighlightSyntax()
 {
+  // Nothing is displayed in batch mode, so the highlighting would be wasted
   Cedit.syntax = NULL;
-  if (Cedit.fileName == NULL)
+  if (Cedit.fileName == NULL || ceditHeadless)
     return;
+  pthread_once(&ceditSyntaxOnce, ceditSyntaxCompile);
 
   char *ext = strrchr(Cedit.fileName, '.');
 
@@ -562,6 +1759,9 @@ void ceditHighlightSyntax()
         int fileRow;
         for (fileRow = 0; fileRow < Cedit.rowNum; fileRow++)
         {
+          int k;
+          for (k = 0; k < Cedit.row[fileRow].chunkNum; k++)
+            Cedit.row[fileRow].chunks[k].entry.inComment = -1;
           ceditUpdateSyntax(&Cedit.row[fileRow]);
         }
 
@@ -578,9 +1778,17 @@ int ceditRowCursorTransformCxtoRx(editorRow *row, int cursorX)
 {
   int rowX = 0;
   int j;
+  char *characters = row->characters;
+  if (row->chunks)
+  {
+    struct ceditChunk *chunk = &row->chunks[ceditChunkFind(row, cursorX, 0)];
+    characters = chunk->characters;
+    rowX = chunk->renderStart;
+    cursorX -= chunk->start;
+  }
   for (j = 0; j < cursorX; j++)
   {
-    if (row->characters[j] == '\t')
+    if (characters[j] == '\t')
       rowX += (CEDIT_TAB_STOP - 1) - (rowX % CEDIT_TAB_STOP);
     rowX++;
   }
@@ -591,19 +1799,36 @@ int ceditRowCursorTransformRxToCx(editorRow *row, int rowX)
 {
   int currentRx = 0;
   int cursorX;
-  for (cursorX = 0; cursorX < row->size; cursorX++)
+  char *characters = row->characters;
+  int size = row->size;
+  int base = 0;
+  if (row->chunks)
   {
-    if (row->characters[cursorX] == '\t')
+    struct ceditChunk *chunk = &row->chunks[ceditChunkFind(row, rowX, 1)];
+    characters = chunk->characters;
+    size = chunk->size;
+    base = chunk->start;
+    currentRx = chunk->renderStart;
+  }
+  for (cursorX = 0; cursorX < size; cursorX++)
+  {
+    if (characters[cursorX] == '\t')
       currentRx += (CEDIT_TAB_STOP - 1) - (currentRx % CEDIT_TAB_STOP);
     currentRx++;
 
     if (currentRx > rowX)
-      return cursorX;
+      return base + cursorX;
   }
-  return cursorX;
+  return base + cursorX;
 }
 
-void ceditUpdateRow(editorRow *row)
+int ceditRowFootprint(editorRow *row)
+{
+  // A shed row keeps rSize for the cursor maths but no longer holds the render
+  return row->size + 1 + (row->render ? row->rSize + 1 : 0) + row->spanNum * sizeof(struct ceditSpan);
+}
+
+void ceditRowLayout(editorRow *row)
 {
   int tabs = 0;
   int j;
@@ -630,6 +1855,28 @@ void ceditUpdateRow(editorRow *row)
   }
   row->render[index] = '\0';
   row->rSize = index;
+}
+
+void ceditUpdateRow(editorRow *row)
+{
+  ceditRowUnshare(row);
+  if (row->chunks == NULL && row->size >= CEDIT_LONG_ROW)
+    ceditRowChunk(row);
+  else if (row->chunks && row->size < CEDIT_LONG_ROW / 2)
+  {
+    ceditChunkLayout(row);
+    ceditRowFlatten(row);
+  }
+
+  if (row->chunks)
+    ceditChunkLayout(row);
+  else
+    ceditRowLayout(row);
+
+  // Chunked rows would need the whole line hashed per keystroke; they stay dirty
+  if (row->changed)
+    row->hash = row->chunks ? 0 : ceditHash(row->characters, row->size) | 1;
+  ceditDiskCheck(row);
 
   ceditUpdateSyntax(row);
 }
@@ -639,44 +1886,153 @@ void ceditInsertRow(int at, char *s, size_t length)
   if (at < 0 || at > Cedit.rowNum)
     return;
 
-  Cedit.row = realloc(Cedit.row, sizeof(editorRow) * (Cedit.rowNum + 1));
+  // A compressed block must stay contiguous, so it is not split in two
+  if (at > 0 && at < Cedit.rowNum && Cedit.row[at].cold && Cedit.row[at].cold == Cedit.row[at - 1].cold)
+    ceditRowWarm(&Cedit.row[at]);
+
+  if (Cedit.rowNum == Cedit.rowCapacity)
+  {
+    Cedit.rowCapacity = Cedit.rowCapacity ? Cedit.rowCapacity * 2 : 64;
+    Cedit.row = realloc(Cedit.row, sizeof(editorRow) * Cedit.rowCapacity);
+  }
   memmove(&Cedit.row[at + 1], &Cedit.row[at], sizeof(editorRow) * (Cedit.rowNum - at));
+  ceditFoldShift(at, 1);
   for (int j = at + 1; j <= Cedit.rowNum; j++)
+  {
     Cedit.row[j].index++;
+    ceditDiskCheck(&Cedit.row[j]);
+  }
 
   Cedit.row[at].index = at;
 
-  Cedit.row[at].size = length;
-  Cedit.row[at].characters = malloc(length + 1);
-  memcpy(Cedit.row[at].characters, s, length);
-  Cedit.row[at].characters[length] = '\0';
+  // Identical short rows that start in the same comment state share buffers
+  struct ceditInterned *entry = NULL;
+  int inComment = at > 0 && Cedit.row[at - 1].hlOpenComment;
+  uint64_t hash = 0;
+  if (Cedit.intern.enabled && length < CEDIT_LONG_ROW)
+  {
+    hash = ceditHash(s, length) ^ inComment;
+    entry = ceditInternFind(s, length, inComment, hash);
+  }
 
+  Cedit.row[at].size = length;
+  Cedit.row[at].characters = NULL;
   Cedit.row[at].rSize = 0;
   Cedit.row[at].render = NULL;
-  Cedit.row[at].hl = NULL;
+  Cedit.row[at].spans = NULL;
+  Cedit.row[at].spanNum = 0;
   Cedit.row[at].hlOpenComment = 0;
-  ceditUpdateRow(&Cedit.row[at]);
+  Cedit.row[at].saveSlot = -1;
+  Cedit.row[at].footprint = 0;
+  Cedit.row[at].cold = NULL;
+  Cedit.row[at].coldSlot = 0;
+  Cedit.row[at].chunks = NULL;
+  Cedit.row[at].chunkNum = 0;
+  Cedit.row[at].interned = NULL;
+  Cedit.row[at].diskRow = -1;
+  Cedit.row[at].hash = 0;
+  Cedit.row[at].changed = 0;
+  Cedit.row[at].clean = 0;
+  memset(&Cedit.row[at].brackets, 0, sizeof(struct bracketSummary));
+  Cedit.row[at].bracketNode = Cedit.bracketTreeDirty ? -1 : ceditBracketInsert(at);
+
+  if (entry)
+  {
+    ceditInternAttach(&Cedit.row[at], entry);
+    ceditBracketStore(&Cedit.row[at]);
+    ceditSyntaxPropagate(&Cedit.row[at], entry->hlOpenComment);
+  }
+  else
+  {
+    Cedit.row[at].characters = malloc(length + 1);
+    memcpy(Cedit.row[at].characters, s, length);
+    Cedit.row[at].characters[length] = '\0';
+    ceditUpdateRow(&Cedit.row[at]);
+    if (Cedit.intern.enabled && length < CEDIT_LONG_ROW)
+      ceditInternAdd(&Cedit.row[at], hash, inComment);
+  }
 
+  // Not hashed until it is edited, which keeps loading files cheap
+  Cedit.row[at].changed = 1;
   Cedit.rowNum++;
   Cedit.modified++;
 }
 
 void ceditFreeRow(editorRow *row)
 {
+  Cedit.cold.resident -= row->footprint;
+  if (row->interned)
+  {
+    ceditInternDetach(row);
+    return;
+  }
+  ceditChunkFree(row);
   free(row->render);
-  free(row->characters);
-  free(row->hl);
+  if (row->saveSlot != -1)
+    Cedit.save.owned[row->saveSlot] = 1;
+  else
+    free(row->characters);
+  free(row->spans);
+}
+
+void ceditRowSetCharacters(editorRow *row, char *characters, int size)
+{
+  ceditRowWarm(row);
+  ceditRowUnshare(row);
+  ceditDiskTouch(row);
+  ceditChunkFree(row);
+  if (row->saveSlot != -1)
+    Cedit.save.owned[row->saveSlot] = 1;
+  else
+    free(row->characters);
+  row->saveSlot = -1;
+  row->characters = characters;
+  row->size = size;
+}
+
+void ceditRowDetach(editorRow *row)
+{
+  ceditRowWarm(row);
+  ceditRowUnshare(row);
+  ceditColdTouch(row->index);
+
+  // The running save still reads this buffer, so hand it over and edit a copy
+  if (row->saveSlot == -1)
+    return;
+  Cedit.save.owned[row->saveSlot] = 1;
+  char *copy = malloc(row->size + 1);
+  memcpy(copy, row->characters, row->size + 1);
+  row->characters = copy;
+  row->saveSlot = -1;
 }
 
 void ceditDeleteRow(int at)
 {
   if (at < 0 || at >= Cedit.rowNum)
     return;
-  ceditFreeRow(&Cedit.row[at]);
+  if (!Cedit.bracketTreeDirty)
+    ceditBracketRemove(at);
+  editorRow *row = &Cedit.row[at];
+  ceditRowWarm(row);
+
+  // The disk line this row held may come back in another row (a line
+  // split and joined again), so its hash is kept before the text goes
+  int diskRow = row->changed ? -1 : row->diskRow;
+  if (diskRow >= 0 && !Cedit.disk.hashes[diskRow] && !row->chunks)
+    Cedit.disk.hashes[diskRow] = ceditHash(ceditRowText(row), row->size) | 1;
+  Cedit.disk.cleanRows -= row->clean;
+
+  ceditFreeRow(row);
   memmove(&Cedit.row[at], &Cedit.row[at + 1], sizeof(editorRow) * (Cedit.rowNum - at - 1));
+  ceditFoldShift(at, -1);
   for (int j = at; j < Cedit.rowNum - 1; j++)
+  {
     Cedit.row[j].index--;
+    ceditDiskCheck(&Cedit.row[j]);
+  }
   Cedit.rowNum--;
+  if (diskRow >= 0 && diskRow < Cedit.rowNum)
+    ceditDiskCheck(&Cedit.row[diskRow]);
   Cedit.modified++;
 }
 
@@ -684,20 +2040,37 @@ void ceditRowInsertCharacter(editorRow *row, int at, int character)
 {
   if (at < 0 || at > row->size)
     at = row->size;
-  row->characters = realloc(row->characters, row->size + 2);
-  memmove(&row->characters[at + 1], &row->characters[at], row->size - at + 1);
-  row->size++;
-  row->characters[at] = character;
+  ceditRowDetach(row);
+  ceditDiskTouch(row);
+  if (row->chunks)
+  {
+    char c = character;
+    ceditChunkInsert(row, at, &c, 1);
+  }
+  else
+  {
+    row->characters = realloc(row->characters, row->size + 2);
+    memmove(&row->characters[at + 1], &row->characters[at], row->size - at + 1);
+    row->size++;
+    row->characters[at] = character;
+  }
   ceditUpdateRow(row);
   Cedit.modified++;
 }
 
 void ceditRowAppendString(editorRow *row, char *s, size_t length)
 {
-  row->characters = realloc(row->characters, row->size + length + 1);
-  memcpy(&row->characters[row->size], s, length);
-  row->size += length;
-  row->characters[row->size] = '\0';
+  ceditRowDetach(row);
+  ceditDiskTouch(row);
+  if (row->chunks)
+    ceditChunkInsert(row, row->size, s, length);
+  else
+  {
+    row->characters = realloc(row->characters, row->size + length + 1);
+    memcpy(&row->characters[row->size], s, length);
+    row->size += length;
+    row->characters[row->size] = '\0';
+  }
   ceditUpdateRow(row);
   Cedit.modified++;
 }
@@ -706,647 +2079,7520 @@ void ceditRowDeleteCharacter(editorRow *row, int at)
 {
   if (at < 0 || at >= row->size)
     return;
-  memmove(&row->characters[at], &row->characters[at + 1], row->size - at);
-  row->size--;
+  ceditRowDetach(row);
+  ceditDiskTouch(row);
+  if (row->chunks)
+    ceditChunkDelete(row, at);
+  else
+  {
+    memmove(&row->characters[at], &row->characters[at + 1], row->size - at);
+    row->size--;
+  }
   ceditUpdateRow(row);
   Cedit.modified++;
 }
 
-/*** CEDIT OPERATIONS ***/
+/*** LINE INTERNING ***/
 
-void ceditInsertCharacter(int character)
+/*
+  With --intern, rows are looked up in a hash table as they are inserted.
+  Rows with the same text that start in the same comment state highlight
+  the same way, so they point at one shared, read-only set of characters,
+  render and spans instead of allocating and highlighting their own.
+  Anything that is about to change a row calls ceditRowUnshare first,
+  which gives it private copies.
+
+  The clipboard shares rows the same way, with entries that are not in
+  any table. Either kind may end up in another buffer's rows, so an entry
+  remembers the document that counts its memory and holds its table.
+*/
+
+struct ceditInterned *ceditInternFind(char *s, int length, int inComment, uint64_t hash)
 {
-  if (Cedit.cursorY == Cedit.rowNum)
+  if (Cedit.intern.bucketNum == 0)
+    return NULL;
+
+  struct ceditInterned *entry = Cedit.intern.buckets[hash & (Cedit.intern.bucketNum - 1)];
+  for (; entry; entry = entry->next)
+    if (entry->hash == hash && entry->size == length && entry->inComment == inComment &&
+        !memcmp(entry->characters, s, length))
+      return entry;
+  return NULL;
+}
+
+void ceditInternAdd(editorRow *row, uint64_t hash, int inComment)
+{
+  if (Cedit.intern.count >= Cedit.intern.bucketNum)
   {
-    ceditInsertRow(Cedit.rowNum, "", 0);
+    int bucketNum = Cedit.intern.bucketNum ? Cedit.intern.bucketNum * 2 : 1024;
+    struct ceditInterned **buckets = calloc(bucketNum, sizeof(struct ceditInterned *));
+    int j;
+    for (j = 0; j < Cedit.intern.bucketNum; j++)
+    {
+      struct ceditInterned *entry = Cedit.intern.buckets[j];
+      while (entry)
+      {
+        struct ceditInterned *next = entry->next;
+        entry->next = buckets[entry->hash & (bucketNum - 1)];
+        buckets[entry->hash & (bucketNum - 1)] = entry;
+        entry = next;
+      }
+    }
+    free(Cedit.intern.buckets);
+    Cedit.intern.buckets = buckets;
+    Cedit.intern.bucketNum = bucketNum;
   }
-  ceditRowInsertCharacter(&Cedit.row[Cedit.cursorY], Cedit.cursorX, character);
-  Cedit.cursorX++;
+
+  // The row's own buffers become the shared copy
+  struct ceditInterned *entry = malloc(sizeof(struct ceditInterned));
+  entry->refs = 0;
+  entry->size = row->size;
+  entry->rSize = row->rSize;
+  entry->inComment = inComment;
+  entry->hlOpenComment = row->hlOpenComment;
+  entry->footprint = row->footprint;
+  entry->hash = hash;
+  entry->characters = row->characters;
+  entry->render = row->render;
+  entry->spans = row->spans;
+  entry->spanNum = row->spanNum;
+  entry->brackets = row->brackets;
+  entry->owner = ceditContext;
+  entry->listed = 1;
+  entry->next = Cedit.intern.buckets[hash & (Cedit.intern.bucketNum - 1)];
+  Cedit.intern.buckets[hash & (Cedit.intern.bucketNum - 1)] = entry;
+  Cedit.intern.count++;
+  Cedit.intern.uniqueBytes += row->size;
+
+  row->footprint = 0;
+  ceditInternAttach(row, entry);
 }
 
-void ceditInsertNewline()
+void ceditInternAttach(editorRow *row, struct ceditInterned *entry)
 {
-  if (Cedit.cursorX == 0)
+  entry->refs++;
+  row->interned = entry;
+  row->characters = entry->characters;
+  row->render = entry->render;
+  row->spans = entry->spans;
+  row->spanNum = entry->spanNum;
+  row->rSize = entry->rSize;
+  row->brackets = entry->brackets;
+  if (entry->listed)
   {
-    ceditInsertRow(Cedit.cursorY, "", 0);
+    Cedit.intern.rows++;
+    Cedit.intern.bytes += row->size;
   }
-  else
+}
+
+void ceditInternDetach(editorRow *row)
+{
+  struct ceditInterned *entry = row->interned;
+  row->interned = NULL;
+  row->characters = row->render = NULL;
+  row->spans = NULL;
+  if (entry->listed)
   {
-    editorRow *row = &Cedit.row[Cedit.cursorY];
-    ceditInsertRow(Cedit.cursorY + 1, &row->characters[Cedit.cursorX], row->size - Cedit.cursorX);
-    row = &Cedit.row[Cedit.cursorY];
-    row->size = Cedit.cursorX;
-    row->characters[row->size] = '\0';
-    ceditUpdateRow(row);
+    Cedit.intern.rows--;
+    Cedit.intern.bytes -= row->size;
   }
-  Cedit.cursorY++;
-  Cedit.cursorX = 0;
+  ceditInternRelease(entry);
 }
 
-void ceditDeleteCharacter()
+void ceditInternRelease(struct ceditInterned *entry)
 {
-  if (Cedit.cursorY == Cedit.rowNum)
+  if (--entry->refs > 0)
     return;
-  if (Cedit.cursorX == 0 && Cedit.cursorY == 0)
+
+  struct ceditConfig *owner = entry->owner;
+  if (entry->listed)
+  {
+    struct ceditInterned **link = &owner->intern.buckets[entry->hash & (owner->intern.bucketNum - 1)];
+    while (*link != entry)
+      link = &(*link)->next;
+    *link = entry->next;
+    owner->intern.count--;
+    owner->intern.uniqueBytes -= entry->size;
+  }
+
+  if (owner)
+    owner->cold.resident -= entry->footprint;
+  free(entry->characters);
+  free(entry->render);
+  free(entry->spans);
+  free(entry);
+}
+
+struct ceditInterned *ceditInternShare(editorRow *row)
+{
+  // The row must be warm, flat and fully built; its buffers become shared
+  if (row->interned == NULL)
+  {
+    struct ceditInterned *entry = calloc(1, sizeof(struct ceditInterned));
+    entry->size = row->size;
+    entry->rSize = row->rSize;
+    entry->inComment = row->index > 0 && Cedit.row[row->index - 1].hlOpenComment;
+    entry->hlOpenComment = row->hlOpenComment;
+    entry->footprint = row->footprint;
+    entry->characters = row->characters;
+    entry->render = row->render;
+    entry->spans = row->spans;
+    entry->spanNum = row->spanNum;
+    entry->brackets = row->brackets;
+    entry->owner = ceditContext;
+    row->footprint = 0;
+    ceditInternAttach(row, entry);
+
+    // A running save still reads the buffer; it holds the entry like the
+    // ones that were shared when it started
+    if (row->saveSlot != -1)
+    {
+      Cedit.save.interned[row->saveSlot] = entry;
+      entry->refs++;
+      row->saveSlot = -1;
+    }
+  }
+  row->interned->refs++;
+  return row->interned;
+}
+
+void ceditRowUnshare(editorRow *row)
+{
+  struct ceditInterned *entry = row->interned;
+  if (entry == NULL)
     return;
 
-  editorRow *row = &Cedit.row[Cedit.cursorY];
-  if (Cedit.cursorX > 0)
+  char *characters = entry->characters;
+  char *render = entry->render;
+  struct ceditSpan *spans = entry->spans;
+  int spanNum = entry->spanNum;
+  if (entry->refs == 1)
   {
-    ceditRowDeleteCharacter(row, Cedit.cursorX - 1);
-    Cedit.cursorX--;
+    // The last row using the buffers takes them over
+    entry->characters = entry->render = NULL;
+    entry->spans = NULL;
+    if (entry->owner)
+      entry->owner->cold.resident -= entry->footprint;
+    entry->footprint = 0;
   }
   else
   {
-    Cedit.cursorX = Cedit.row[Cedit.cursorY - 1].size;
-    ceditRowAppendString(&Cedit.row[Cedit.cursorY - 1], row->characters, row->size);
-    ceditDeleteRow(Cedit.cursorY);
-    Cedit.cursorY--;
+    characters = malloc(entry->size + 1);
+    memcpy(characters, entry->characters, entry->size + 1);
+    render = malloc(entry->rSize + 1);
+    memcpy(render, entry->render, entry->rSize + 1);
+    spans = NULL;
+    if (spanNum)
+    {
+      spans = malloc(sizeof(struct ceditSpan) * spanNum);
+      memcpy(spans, entry->spans, sizeof(struct ceditSpan) * spanNum);
+    }
   }
+
+  ceditInternDetach(row);
+  row->characters = characters;
+  row->render = render;
+  row->spans = spans;
+  row->spanNum = spanNum;
+  row->footprint = ceditRowFootprint(row);
+  Cedit.cold.resident += row->footprint;
 }
 
-/*** FILE OPERATIONS ***/
+/*** LONG ROWS ***/
+
+/*
+  Rows of CEDIT_LONG_ROW characters or more are kept as a sequence of
+  chunks of about CEDIT_CHUNK_SIZE characters, each with its own render,
+  spans and bracket summary. An edit re-renders and re-highlights only the
+  chunk it lands in; the chunks after it are highlighted again only while
+  the syntax state they start with keeps changing. While a row is chunked
+  its characters, render and spans are NULL. Reading the whole line joins
+  a copy with ceditChunkJoin and leaves the chunks as they are;
+  ceditRowFlatten joins the row itself back for the few operations that
+  rewrite the whole line anyway, or for good once it shrinks to half of
+  CEDIT_LONG_ROW.
+
+  Each chunk is lexed on its own with only the state carried over, so
+  chunks end just after a blank or punctuation no token spans; a chunk
+  that loses that end to a deletion is joined to the next one. Only a
+  stretch of CEDIT_CHUNK_SIZE characters without any such place is cut
+  where it has to be.
+*/
+
+int ceditChunkSafe(int character)
+{
+  return character == ' ' || character == '\t' || (character && strchr(",;(){}[]", character));
+}
 
-char *ceditRowToString(int *bufferLength)
+int ceditChunkCut(char *characters, int size)
 {
-  int totalLength = 0;
+  // How much of characters the next chunk takes
+  if (size <= CEDIT_CHUNK_SIZE)
+    return size;
   int j;
-  for (j = 0; j < Cedit.rowNum; j++)
-    totalLength += Cedit.row[j].size + 1;
-  *bufferLength = totalLength;
+  for (j = CEDIT_CHUNK_SIZE; j > CEDIT_CHUNK_SIZE / 2; j--)
+    if (ceditChunkSafe(characters[j - 1]))
+      return j;
+  for (j = CEDIT_CHUNK_SIZE + 1; j < size && j <= 2 * CEDIT_CHUNK_SIZE; j++)
+    if (ceditChunkSafe(characters[j - 1]))
+      return j;
+  // Not right after a character that starts a two-character token, unless
+  // there is a long run of them
+  for (j = CEDIT_CHUNK_SIZE; j > CEDIT_CHUNK_SIZE / 2; j--)
+    if (!characters[j - 1] || !strchr("\\/*", characters[j - 1]))
+      return j;
+  return CEDIT_CHUNK_SIZE;
+}
 
-  char *buffer = malloc(totalLength);
-  char *p = buffer;
-  for (j = 0; j < Cedit.rowNum; j++)
+int ceditChunkFind(editorRow *row, int at, int column)
+{
+  // The last chunk starting at or before the character (or render column)
+  int low = 0, high = row->chunkNum - 1;
+  while (low < high)
   {
-    memcpy(p, Cedit.row[j].characters, Cedit.row[j].size);
-    p += Cedit.row[j].size;
-    *p = '\n';
-    p++;
+    int middle = (low + high + 1) / 2;
+    int start = column ? row->chunks[middle].renderStart : row->chunks[middle].start;
+    if (start <= at)
+      low = middle;
+    else
+      high = middle - 1;
   }
-
-  return buffer;
+  return low;
 }
 
-void ceditOpen(char *fileName)
+void ceditRowChunk(editorRow *row)
 {
-  free(Cedit.fileName);
-  Cedit.fileName = strdup(fileName);
+  ceditRowDetach(row);
+  free(row->render);
+  free(row->spans);
+  row->spanNum = 0;
 
-  ceditHighlightSyntax();
+  row->chunks = calloc(1, sizeof(struct ceditChunk));
+  row->chunkNum = 1;
+  row->chunks[0].characters = row->characters;
+  row->chunks[0].size = row->size;
+  ceditChunkSplit(row, 0);
 
-  FILE *fp = fopen(fileName, "r");
-  if (!fp)
-    terminateProgram("File Open Error!");
+  row->characters = row->render = NULL;
+  row->spans = NULL;
+}
 
-  char *line = NULL;
-  size_t lineCap = 0;
-  ssize_t lineLength;
-  while ((lineLength = getline(&line, &lineCap, fp)) != -1)
+void ceditRowFlatten(editorRow *row)
+{
+  if (row->chunks == NULL)
+    return;
+
+  row->characters = malloc(row->size + 1);
+  row->render = malloc(row->rSize + 1);
+  row->spans = NULL;
+  row->spanNum = 0;
+  int k, j;
+  for (k = 0; k < row->chunkNum; k++)
   {
-    while (lineLength > 0 && (line[lineLength - 1] == '\n' ||
-                              line[lineLength - 1] == '\r'))
-      lineLength--;
-    ceditInsertRow(Cedit.rowNum, line, lineLength);
+    struct ceditChunk *chunk = &row->chunks[k];
+    memcpy(&row->characters[chunk->start], chunk->characters, chunk->size);
+    memcpy(&row->render[chunk->renderStart], chunk->render, chunk->rSize);
+    for (j = 0; j < chunk->spanNum; j++)
+      ceditSpanPush(&row->spans, &row->spanNum, chunk->spans[j].hl, chunk->spans[j].length);
   }
-  free(line);
-  fclose(fp);
-  Cedit.modified = 0;
+  ceditSpanShrink(&row->spans, row->spanNum);
+  row->characters[row->size] = '\0';
+  row->render[row->rSize] = '\0';
+  ceditChunkFree(row);
 }
 
-void ceditSave()
+char *ceditChunkJoin(editorRow *row, int render)
 {
-  if (Cedit.fileName == NULL)
+  // The copy is only valid until the next chunked row is joined
+  int size = render ? row->rSize : row->size;
+  if (size + 1 > Cedit.chunkScratchCapacity)
   {
-    Cedit.fileName = ceditPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (Cedit.fileName == NULL)
-    {
-      ceditSetStatusMessage("Save aborted");
-      return;
-    }
-    ceditHighlightSyntax();
+    Cedit.chunkScratchCapacity = size + 1;
+    Cedit.chunkScratch = realloc(Cedit.chunkScratch, Cedit.chunkScratchCapacity);
+  }
+  int k;
+  for (k = 0; k < row->chunkNum; k++)
+  {
+    struct ceditChunk *chunk = &row->chunks[k];
+    if (render)
+      memcpy(&Cedit.chunkScratch[chunk->renderStart], chunk->render, chunk->rSize);
+    else
+      memcpy(&Cedit.chunkScratch[chunk->start], chunk->characters, chunk->size);
   }
+  Cedit.chunkScratch[size] = '\0';
+  return Cedit.chunkScratch;
+}
 
-  int length;
-  char *buffer = ceditRowToString(&length);
+void ceditChunkFree(editorRow *row)
+{
+  int k;
+  for (k = 0; k < row->chunkNum; k++)
+  {
+    free(row->chunks[k].characters);
+    free(row->chunks[k].render);
+    free(row->chunks[k].spans);
+  }
+  free(row->chunks);
+  row->chunks = NULL;
+  row->chunkNum = 0;
+}
 
-  int fd = open(Cedit.fileName, O_RDWR | O_CREAT, 0644);
-  if (fd != -1)
+void ceditChunkRender(struct ceditChunk *chunk, int renderStart)
+{
+  int j;
+  chunk->tabs = 0;
+  for (j = 0; j < chunk->size; j++)
+    if (chunk->characters[j] == '\t')
+      chunk->tabs++;
+
+  free(chunk->render);
+  chunk->render = malloc(chunk->size + chunk->tabs * (CEDIT_TAB_STOP - 1) + 1);
+
+  int index = 0;
+  for (j = 0; j < chunk->size; j++)
   {
-    if (ftruncate(fd, length) != -1)
+    if (chunk->characters[j] == '\t')
     {
-      if (write(fd, buffer, length) == length)
-      {
-        close(fd);
-        free(buffer);
-        Cedit.modified = 0;
-        ceditSetStatusMessage("%d bytes written to disk", length);
-        return;
-      }
+      chunk->render[index++] = ' ';
+      while ((renderStart + index) % CEDIT_TAB_STOP != 0)
+        chunk->render[index++] = ' ';
+    }
+    else
+    {
+      chunk->render[index++] = chunk->characters[j];
     }
-    close(fd);
   }
-
-  free(buffer);
-  ceditSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  chunk->render[index] = '\0';
+  chunk->rSize = index;
+  chunk->renderStart = renderStart;
+  chunk->entry.inComment = -1;
 }
 
-/*** FIND OPERATIONS ***/
+void ceditChunkLayout(editorRow *row)
+{
+  int start = 0, renderStart = 0;
+  int k;
+  for (k = 0; k < row->chunkNum; k++)
+  {
+    struct ceditChunk *chunk = &row->chunks[k];
+    chunk->start = start;
+    // Tabs expand differently once the chunk moves to another tab stop phase
+    if (chunk->rSize == -1 || (chunk->tabs && (chunk->renderStart - renderStart) % CEDIT_TAB_STOP))
+      ceditChunkRender(chunk, renderStart);
+    chunk->renderStart = renderStart;
+    start += chunk->size;
+    renderStart += chunk->rSize;
+  }
+  row->rSize = renderStart;
+}
 
-void ceditFindCallback(char *query, int key)
+void ceditChunkSplit(editorRow *row, int k)
 {
-  static int lastMatch = -1;
-  static int direction = 1;
+  struct ceditChunk whole = row->chunks[k];
+  int pieces = 0, at;
+  for (at = 0; at < whole.size; pieces++)
+    at += ceditChunkCut(&whole.characters[at], whole.size - at);
+  if (pieces < 1)
+    pieces = 1;
 
-  static int savedHlLine;
-  static char *savedHl = NULL;
+  row->chunks = realloc(row->chunks, sizeof(struct ceditChunk) * (row->chunkNum + pieces - 1));
+  memmove(&row->chunks[k + pieces], &row->chunks[k + 1], sizeof(struct ceditChunk) * (row->chunkNum - k - 1));
+  row->chunkNum += pieces - 1;
 
-  if (savedHl)
+  int j;
+  for (j = 0, at = 0; j < pieces; j++)
   {
-    memcpy(Cedit.row[savedHlLine].hl, savedHl, Cedit.row[savedHlLine].rSize);
-    free(savedHl);
-    savedHl = NULL;
+    struct ceditChunk *chunk = &row->chunks[k + j];
+    memset(chunk, 0, sizeof(struct ceditChunk));
+    chunk->size = ceditChunkCut(&whole.characters[at], whole.size - at);
+    chunk->characters = malloc(chunk->size + 1);
+    memcpy(chunk->characters, &whole.characters[at], chunk->size);
+    chunk->rSize = -1;
+    at += chunk->size;
   }
+  free(whole.characters);
+  free(whole.render);
+  free(whole.spans);
+}
 
-  if (key == '\r' || key == '\x1b')
+void ceditChunkInsert(editorRow *row, int at, char *s, int length)
+{
+  int k = ceditChunkFind(row, at, 0);
+  struct ceditChunk *chunk = &row->chunks[k];
+  at -= chunk->start;
+
+  chunk->characters = realloc(chunk->characters, chunk->size + length + 1);
+  memmove(&chunk->characters[at + length], &chunk->characters[at], chunk->size - at);
+  memcpy(&chunk->characters[at], s, length);
+  chunk->size += length;
+  chunk->rSize = -1;
+  row->size += length;
+
+  if (chunk->size > 2 * CEDIT_CHUNK_SIZE)
+    ceditChunkSplit(row, k);
+}
+
+void ceditChunkDelete(editorRow *row, int at)
+{
+  int k = ceditChunkFind(row, at, 0);
+  struct ceditChunk *chunk = &row->chunks[k];
+  at -= chunk->start;
+
+  memmove(&chunk->characters[at], &chunk->characters[at + 1], chunk->size - at - 1);
+  chunk->size--;
+  chunk->rSize = -1;
+  row->size--;
+
+  if (chunk->size == 0 && row->chunkNum > 1)
   {
-    lastMatch = -1;
-    direction = 1;
-    return;
+    free(chunk->characters);
+    free(chunk->render);
+    free(chunk->spans);
+    memmove(chunk, chunk + 1, sizeof(struct ceditChunk) * (row->chunkNum - k - 1));
+    row->chunkNum--;
   }
-  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  else if (k + 1 < row->chunkNum && !ceditChunkSafe(chunk->characters[chunk->size - 1]))
+    ceditChunkMerge(row, k);
+}
+
+void ceditChunkMerge(editorRow *row, int k)
+{
+  struct ceditChunk *chunk = &row->chunks[k];
+  struct ceditChunk *next = &row->chunks[k + 1];
+  chunk->characters = realloc(chunk->characters, chunk->size + next->size + 1);
+  memcpy(&chunk->characters[chunk->size], next->characters, next->size);
+  chunk->size += next->size;
+  chunk->rSize = -1;
+  free(next->characters);
+  free(next->render);
+  free(next->spans);
+  memmove(next, next + 1, sizeof(struct ceditChunk) * (row->chunkNum - k - 2));
+  row->chunkNum--;
+
+  if (chunk->size > 2 * CEDIT_CHUNK_SIZE)
+    ceditChunkSplit(row, k);
+}
+
+void ceditChunkSyntax(editorRow *row, struct ceditHighlightState *state)
+{
+  int k;
+  for (k = 0; k < row->chunkNum; k++)
   {
-    direction = 1;
+    struct ceditChunk *chunk = &row->chunks[k];
+    if (!memcmp(&chunk->entry, state, sizeof(struct ceditHighlightState)))
+    {
+      *state = chunk->exit;
+      continue;
+    }
+    chunk->entry = *state;
+    chunk->spanNum = 0;
+    ceditHighlightSpan(chunk->render, chunk->rSize, state, &chunk->spans, &chunk->spanNum);
+    ceditSpanShrink(&chunk->spans, chunk->spanNum);
+    chunk->exit = *state;
+    ceditBracketCount(&chunk->brackets, chunk->render, chunk->spans, chunk->spanNum);
   }
-  else if (key == ARROW_LEFT || key == ARROW_UP)
+}
+
+int ceditChunkWindow(editorRow *row, int from, int length, char *render, struct ceditSpan *spans)
+{
+  int spanNum = 0;
+  int k;
+  for (k = ceditChunkFind(row, from, 1); length > 0 && k < row->chunkNum; k++)
   {
-    direction = -1;
-  }
-  else
-  {
-    lastMatch = -1;
-    direction = 1;
+    struct ceditChunk *chunk = &row->chunks[k];
+    int offset = from - chunk->renderStart;
+    int count = chunk->rSize - offset;
+    if (count > length)
+      count = length;
+    if (count <= 0)
+      continue;
+    memcpy(render, &chunk->render[offset], count);
+    spanNum += ceditSpanSlice(chunk->spans, chunk->spanNum, offset, count, &spans[spanNum]);
+    render += count;
+    from += count;
+    length -= count;
   }
+  return spanNum;
+}
 
-  if (lastMatch == -1)
-    direction = 1;
-  int current = lastMatch;
-  int i;
-  for (i = 0; i < Cedit.rowNum; i++)
+int ceditChunkScan(editorRow *row, int from, int direction, int kind, int *depth)
+{
+  if (from < 0 || from >= row->rSize)
+    return -1;
+
+  int k;
+  for (k = ceditChunkFind(row, from, 1); k >= 0 && k < row->chunkNum; k += direction)
   {
-    current += direction;
-    if (current == -1)
-      current = Cedit.rowNum - 1;
-    else if (current == Cedit.rowNum)
-      current = 0;
+    struct ceditChunk *chunk = &row->chunks[k];
+    int inside = from >= chunk->renderStart && from < chunk->renderStart + chunk->rSize;
 
-    editorRow *row = &Cedit.row[current];
-    char *match = strstr(row->render, query);
-    if (match)
+    // As in the bracket tree, a chunk that cannot bring depth to zero is skipped whole
+    if (!inside)
     {
-      lastMatch = current;
-      Cedit.cursorY = current;
-      Cedit.cursorX = ceditRowCursorTransformRxToCx(row, match - row->render);
-      Cedit.rowOff = Cedit.rowNum;
+      int open = chunk->brackets.open[kind];
+      int close = chunk->brackets.close[kind];
+      if ((direction == 1 ? close : open) < *depth)
+      {
+        *depth += direction == 1 ? open - close : close - open;
+        continue;
+      }
+    }
 
-      savedHlLine = current;
-      savedHl = malloc(row->rSize);
-      memcpy(savedHl, row->hl, row->rSize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+    int i = inside ? from - chunk->renderStart : (direction == 1 ? 0 : chunk->rSize - 1);
+    for (; i >= 0 && i < chunk->rSize; i += direction)
+    {
+      int isOpen = 0;
+      if (ceditBracketKind(chunk->render, chunk->spans, chunk->spanNum, i, &isOpen) != kind)
+        continue;
+      *depth += (isOpen == (direction == 1)) ? 1 : -1;
+      if (*depth == 0)
+        return chunk->renderStart + i;
     }
   }
+  return -1;
 }
 
-void ceditFind()
+/*** COLD ROW STORAGE ***/
+
+/*
+  When the rows take more memory than the configured budget, blocks of
+  CEDIT_COLD_BLOCK_ROWS rows that have not been drawn or edited recently
+  are packed with a small LZ77 codec (an LZ4-style block format) and their
+  characters, render and spans are freed. Sizes, comment state and
+  bracket summaries stay in the rows, so most bookkeeping keeps working on
+  cold rows. Anything that needs the text calls ceditRowWarm, which
+  unpacks the whole block, or ceditRowText for a read-only look.
+
+  Before any text is packed, the same least recently used ranges are shed:
+  only their render and spans are freed. Those are derived from the text
+  and the comment state the row starts in, so ceditRowWarm rebuilds them
+  for one row at a time without unpacking anything.
+*/
+
+void ceditLzLength(unsigned char **out, int length)
 {
-  int savedCursorX = Cedit.cursorX;
-  int savedCursorY = Cedit.cursorY;
-  int savedColumn = Cedit.columnOff;
-  int savedRow = Cedit.rowOff;
+  length -= 15;
+  while (length >= 255)
+  {
+    *(*out)++ = 255;
+    length -= 255;
+  }
+  *(*out)++ = length;
+}
 
-  char *query = ceditPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                            ceditFindCallback);
+int ceditLzCompress(const unsigned char *in, int length, unsigned char *out)
+{
+  int table[1 << CEDIT_LZ_HASH_BITS];
+  unsigned char *op = out;
+  int anchor = 0, i = 0;
 
-  if (query)
+  memset(table, -1, sizeof(table));
+  while (i + CEDIT_LZ_MIN_MATCH <= length)
   {
-    free(query);
+    uint32_t sequence;
+    memcpy(&sequence, &in[i], sizeof(sequence));
+    int hash = (sequence * 2654435761u) >> (32 - CEDIT_LZ_HASH_BITS);
+    int candidate = table[hash];
+    table[hash] = i;
+    if (candidate < 0 || i - candidate > 65535 || memcmp(&in[candidate], &in[i], CEDIT_LZ_MIN_MATCH))
+    {
+      i++;
+      continue;
+    }
+
+    int matchLength = CEDIT_LZ_MIN_MATCH;
+    while (i + matchLength < length && in[candidate + matchLength] == in[i + matchLength])
+      matchLength++;
+
+    int literals = i - anchor;
+    int extra = matchLength - CEDIT_LZ_MIN_MATCH;
+    *op++ = (literals >= 15 ? 15 : literals) << 4 | (extra >= 15 ? 15 : extra);
+    if (literals >= 15)
+      ceditLzLength(&op, literals);
+    memcpy(op, &in[anchor], literals);
+    op += literals;
+    *op++ = (i - candidate) & 0xff;
+    *op++ = (i - candidate) >> 8;
+    if (extra >= 15)
+      ceditLzLength(&op, extra);
+
+    i += matchLength;
+    anchor = i;
   }
-  else
+
+  int literals = length - anchor;
+  *op++ = (literals >= 15 ? 15 : literals) << 4;
+  if (literals >= 15)
+    ceditLzLength(&op, literals);
+  memcpy(op, &in[anchor], literals);
+  op += literals;
+  return op - out;
+}
+
+int ceditLzDecompress(const unsigned char *in, int length, unsigned char *out)
+{
+  const unsigned char *ip = in;
+  const unsigned char *end = in + length;
+  unsigned char *op = out;
+
+  while (ip < end)
   {
-    Cedit.cursorX = savedCursorX;
-    Cedit.cursorY = savedCursorY;
-    Cedit.columnOff = savedColumn;
-    Cedit.rowOff = savedRow;
+    int token = *ip++;
+    int literals = token >> 4;
+    if (literals == 15)
+      do
+        literals += *ip;
+      while (*ip++ == 255);
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+    if (ip >= end)
+      break;
+
+    int offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    int matchLength = token & 15;
+    if (matchLength == 15)
+      do
+        matchLength += *ip;
+      while (*ip++ == 255);
+    matchLength += CEDIT_LZ_MIN_MATCH;
+
+    // Byte by byte, since a match may overlap the bytes it produces
+    unsigned char *match = op - offset;
+    while (matchLength--)
+      *op++ = *match++;
   }
+  return op - out;
 }
 
-/*** BUFFER FUNCTIONS ***/
+void ceditColdUnpack(struct ceditColdBlock *block, char *raw, int *offsets)
+{
+  // Blocks opened from the index cache still point into the file's text
+  if (block->text)
+  {
+    memcpy(raw, block->text, block->rawSize);
+    memcpy(offsets, block->starts, sizeof(int) * block->rowCount);
+    return;
+  }
 
-#define BUFFER_INITIALIZATION \
-  {                           \
-    NULL, 0                   \
+  ceditLzDecompress(block->packed, block->packedSize, (unsigned char *)raw);
+
+  int position = 0;
+  int j;
+  for (j = 0; j < block->rowCount; j++)
+  {
+    int size;
+    memcpy(&size, &raw[position], sizeof(int));
+    offsets[j] = position + sizeof(int);
+    position += sizeof(int) + size;
   }
+}
 
-void appendBuffer(struct bufferContainer *bc, const char *s, int length)
+char *ceditRowText(editorRow *row)
 {
-  char *new = realloc(bc->b, bc->length + length);
+  // Cold rows are read from a scratch copy of their block, which is not
+  // NUL-terminated and is only valid until another block is unpacked
+  if (row->chunks)
+    return ceditChunkJoin(row, 0);
+  if (row->cold == NULL)
+    return row->characters;
+
+  struct ceditColdBlock *block = row->cold;
+  if (Cedit.cold.scratchBlock != block)
+  {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-  if (new == NULL)
-    return;
-  memcpy(&new[bc->length], s, length);
-  bc->b = new;
-  bc->length += length;
+    if (block->rawSize > Cedit.cold.scratchCapacity)
+    {
+      Cedit.cold.scratchCapacity = block->rawSize;
+      Cedit.cold.scratch = realloc(Cedit.cold.scratch, block->rawSize);
+    }
+    ceditColdUnpack(block, Cedit.cold.scratch, Cedit.cold.offsets);
+    Cedit.cold.scratchBlock = block;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long nanos = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    Cedit.cold.unpacks++;
+    Cedit.cold.unpackNanos += nanos;
+    if (nanos > Cedit.cold.unpackMaxNanos)
+      Cedit.cold.unpackMaxNanos = nanos;
+  }
+  return Cedit.cold.scratch + Cedit.cold.offsets[row->coldSlot];
 }
 
-void freeBuffer(struct bufferContainer *bc)
+void ceditColdRelease(struct ceditColdBlock *block)
 {
-  free(bc->b);
+  if (--block->refs > 0)
+    return;
+  if (Cedit.cold.scratchBlock == block)
+    Cedit.cold.scratchBlock = NULL;
+  if (block->source && --block->source->refs == 0)
+  {
+    free(block->source->text);
+    free(block->source);
+  }
+  free(block->starts);
+  free(block->packed);
+  free(block);
 }
 
-/*** OUTPUT OPERATIONS ***/
+void ceditRowRebuild(editorRow *row)
+{
+  // The previous row's comment state is the lexer checkpoint; the spans
+  // come out as they were, so nothing after this row needs redoing
+  ceditRowLayout(row);
+  struct ceditHighlightState state = {
+      row->index > 0 && Cedit.row[row->index - 1].hlOpenComment, 0, 1, 0, HL_NORMAL};
+  row->spanNum = 0;
+  ceditHighlightSpan(row->render, row->rSize, &state, &row->spans, &row->spanNum);
+  ceditSpanShrink(&row->spans, row->spanNum);
+
+  int footprint = ceditRowFootprint(row);
+  Cedit.cold.resident += footprint - row->footprint;
+  row->footprint = footprint;
+  Cedit.cold.rebuilds++;
+}
 
-void ceditScroll()
+void ceditRowWarm(editorRow *row)
 {
-  Cedit.rowX = 0;
-  if (Cedit.cursorY < Cedit.rowNum)
+  struct ceditColdBlock *block = row->cold;
+  if (block == NULL)
   {
-    Cedit.rowX = ceditRowCursorTransformCxtoRx(&Cedit.row[Cedit.cursorY], Cedit.cursorX);
+    if (row->render == NULL && row->characters && row->chunks == NULL)
+      ceditRowRebuild(row);
+    return;
   }
-  if (Cedit.cursorY < Cedit.rowOff)
+
+  int first = row->index - row->coldSlot;
+  int j;
+  for (j = 0; j < block->rowCount; j++)
   {
-    Cedit.rowOff = Cedit.cursorY;
+    editorRow *member = &Cedit.row[first + j];
+    char *text = ceditRowText(member);
+    member->characters = malloc(member->size + 1);
+    memcpy(member->characters, text, member->size);
+    member->characters[member->size] = '\0';
   }
-  if (Cedit.cursorY >= Cedit.rowOff + Cedit.terminalRows)
+  for (j = 0; j < block->rowCount; j++)
+    Cedit.row[first + j].cold = NULL;
+
+  // Re-highlighting may reach rows beyond the block; let that run once
+  int deferred = Cedit.syntaxDeferred;
+  Cedit.syntaxDeferred = 1;
+  for (j = 0; j < block->rowCount; j++)
+    ceditUpdateRow(&Cedit.row[first + j]);
+  if (!deferred)
+    ceditSyntaxFlush();
+
+  if (block->packed)
   {
-    Cedit.rowOff = Cedit.cursorY - Cedit.terminalRows + 1;
+    Cedit.cold.blocks--;
+    Cedit.cold.rawBytes -= block->rawSize;
+    Cedit.cold.packedBytes -= block->packedSize;
   }
-  if (Cedit.rowX < Cedit.columnOff)
+  ceditColdTouch(first);
+  ceditColdRelease(block);
+}
+
+void ceditColdGrow(int range)
+{
+  // Ranges never seen have tick 0, the least recently used of all
+  if (range >= Cedit.cold.tickCapacity)
   {
-    Cedit.columnOff = Cedit.rowX;
+    int capacity = Cedit.cold.tickCapacity ? Cedit.cold.tickCapacity : 64;
+    while (capacity <= range)
+      capacity *= 2;
+    Cedit.cold.tick = realloc(Cedit.cold.tick, sizeof(unsigned int) * capacity);
+    memset(&Cedit.cold.tick[Cedit.cold.tickCapacity], 0,
+           sizeof(unsigned int) * (capacity - Cedit.cold.tickCapacity));
+    Cedit.cold.tickCapacity = capacity;
   }
-  if (Cedit.rowX >= Cedit.columnOff + Cedit.terminalColumns)
+}
+
+void ceditColdTouch(int at)
+{
+  int range = at / CEDIT_COLD_BLOCK_ROWS;
+  ceditColdGrow(range);
+  Cedit.cold.tick[range] = Cedit.cold.clock;
+}
+
+void ceditColdShed(int first, int count)
+{
+  int j;
+  for (j = 0; j < count; j++)
   {
-    Cedit.columnOff = Cedit.rowX - Cedit.terminalColumns + 1;
+    editorRow *row = &Cedit.row[first + j];
+    if (row->cold || row->chunks || row->interned || row->render == NULL)
+      continue;
+    free(row->render);
+    free(row->spans);
+    row->render = NULL;
+    row->spans = NULL;
+    row->spanNum = 0;
+
+    int footprint = ceditRowFootprint(row);
+    Cedit.cold.resident += footprint - row->footprint;
+    row->footprint = footprint;
+    Cedit.cold.sheds++;
   }
 }
 
-void ceditPrintRows(struct bufferContainer *bc)
+void ceditColdCompress(int first, int count)
 {
-  int y;
-  for (y = 0; y < Cedit.terminalRows; y++)
+  int rawSize = 0;
+  int j;
+  for (j = 0; j < count; j++)
   {
-    int fileRow = y + Cedit.rowOff;
-    if (fileRow >= Cedit.rowNum)
-    {
-      if (Cedit.rowNum == 0 && y == Cedit.terminalRows / 3)
-      {
-        char welcomeMessage[80];
-        int welcomeLength = snprintf(welcomeMessage, sizeof(welcomeMessage),
-                                     "Cedit - v%s", CEDIT_VERSION);
-        if (welcomeLength > Cedit.terminalColumns)
-          welcomeLength = Cedit.terminalColumns;
-        int padding = (Cedit.terminalColumns - welcomeLength) / 2;
-        if (padding)
-        {
-          appendBuffer(bc, "~", 1);
-          padding--;
-        }
-        while (padding--)
-          appendBuffer(bc, " ", 1);
-        appendBuffer(bc, welcomeMessage, welcomeLength);
-      }
-      else
-      {
-        appendBuffer(bc, "~", 1);
-      }
-    }
-    else
-    {
-      int length = Cedit.row[fileRow].rSize - Cedit.columnOff;
-      if (length < 0)
-        length = 0;
-      if (length > Cedit.terminalColumns)
-        length = Cedit.terminalColumns;
-      char *character = &Cedit.row[fileRow].render[Cedit.columnOff];
-      unsigned char *hl = &Cedit.row[fileRow].hl[Cedit.columnOff];
-      int currentColor = -1;
-      int j;
-      for (j = 0; j < length; j++)
-      {
-        if (iscntrl(character[j]))
-        {
-          char symbol = (character[j] <= 26) ? '@' + character[j] : '?';
-          appendBuffer(bc, "\x1b[7m", 4);
-          appendBuffer(bc, &symbol, 1);
-          appendBuffer(bc, "\x1b[m", 3);
-          if (currentColor != -1)
-          {
-            char buffer[16];
-            int cLength = snprintf(buffer, sizeof(buffer), "\x1b[%dm", currentColor);
-            appendBuffer(bc, buffer, cLength);
-          }
-        }
-        else if (hl[j] == HL_NORMAL)
-        {
-          if (currentColor != -1)
-          {
-            appendBuffer(bc, "\x1b[39m", 5);
-            currentColor = -1;
-          }
-          appendBuffer(bc, &character[j], 1);
-        }
-        else
-        {
-          int color = ceditSyntaxColoring(hl[j]);
-          if (color != currentColor)
-          {
-            currentColor = color;
-            char buffer[16];
-            int cLength = snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
-            appendBuffer(bc, buffer, cLength);
-          }
-          appendBuffer(bc, &character[j], 1);
-        }
-      }
-      appendBuffer(bc, "\x1b[39m", 5);
-    }
+    if (Cedit.row[first + j].cold || Cedit.row[first + j].chunks)
+      return;
+    rawSize += sizeof(int) + Cedit.row[first + j].size;
+  }
 
-    appendBuffer(bc, "\x1b[K", 3);
-    appendBuffer(bc, "\r\n", 2);
+  char *raw = calloc(1, rawSize);
+  char *p = raw;
+  for (j = 0; j < count; j++)
+  {
+    editorRow *row = &Cedit.row[first + j];
+    memcpy(p, &row->size, sizeof(int));
+    memcpy(p + sizeof(int), row->characters, row->size);
+    p += sizeof(int) + row->size;
   }
-}
 
-void ceditDrawStatusBar(struct bufferContainer *bc)
-{
-  appendBuffer(bc, "\x1b[7m", 4);
-  char status[80], rStatus[80];
-  int length = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                        Cedit.fileName ? Cedit.fileName : "[No Name]", Cedit.rowNum,
-                        Cedit.modified ? "(modified)" : "");
-  int rLength = snprintf(rStatus, sizeof(rStatus), "%s | %d/%d",
-                         Cedit.syntax ? Cedit.syntax->fileType : "Line number:", Cedit.cursorY + 1, Cedit.rowNum);
-  if (length > Cedit.terminalColumns)
-    length = Cedit.terminalColumns;
-  appendBuffer(bc, status, length);
-  while (length < Cedit.terminalColumns)
+  struct ceditColdBlock *block = calloc(1, sizeof(struct ceditColdBlock));
+  block->packed = malloc(rawSize + rawSize / 255 + 16);
+  block->packedSize = ceditLzCompress((unsigned char *)raw, rawSize, block->packed);
+  block->packed = realloc(block->packed, block->packedSize);
+  block->rawSize = rawSize;
+  block->rowCount = count;
+  block->refs = 1;
+  free(raw);
+
+  for (j = 0; j < count; j++)
   {
-    if (Cedit.terminalColumns - length == rLength)
-    {
-      appendBuffer(bc, rStatus, rLength);
-      break;
-    }
-    else
-    {
-      appendBuffer(bc, " ", 1);
-      length++;
-    }
+    editorRow *row = &Cedit.row[first + j];
+    ceditFreeRow(row);
+    row->characters = row->render = NULL;
+    row->spans = NULL;
+    row->spanNum = 0;
+    row->footprint = 0;
+    row->cold = block;
+    row->coldSlot = j;
   }
-  appendBuffer(bc, "\x1b[m", 3);
-  appendBuffer(bc, "\r\n", 2);
+  Cedit.cold.blocks++;
+  Cedit.cold.rawBytes += rawSize;
+  Cedit.cold.packedBytes += block->packedSize;
 }
 
-void ceditDrawMessageBar(struct bufferContainer *bc)
+int ceditColdCompare(const void *a, const void *b)
 {
-  appendBuffer(bc, "\x1b[K", 3);
-  int messageLength = strlen(Cedit.statusMessage);
-  if (messageLength > Cedit.terminalColumns)
-    messageLength = Cedit.terminalColumns;
-  if (messageLength && time(NULL) - Cedit.statusMessageTime < 5)
-    appendBuffer(bc, Cedit.statusMessage, messageLength);
+  unsigned int left = Cedit.cold.tick[*(const int *)a];
+  unsigned int right = Cedit.cold.tick[*(const int *)b];
+  return left < right ? -1 : left > right;
 }
 
-void ceditRefreshTerminal()
+void ceditColdCompact()
 {
-  ceditScroll();
-
-  struct bufferContainer bc = BUFFER_INITIALIZATION;
+  if (Cedit.cold.budget == 0 || Cedit.cold.resident <= Cedit.cold.budget || Cedit.saving)
+    return;
 
-  appendBuffer(&bc, "\x1b[?25l", 6);
-  appendBuffer(&bc, "\x1b[H", 3);
+  int ranges = Cedit.rowNum / CEDIT_COLD_BLOCK_ROWS;
+  if (ranges == 0)
+    return;
+  ceditColdGrow(ranges - 1);
 
-  ceditPrintRows(&bc);
-  ceditDrawStatusBar(&bc);
-  ceditDrawMessageBar(&bc);
+  // Least recently used first, never within a screen of the viewport or
+  // under the cursor, so scrolling nearby never has to rebuild anything
+  int *order = malloc(sizeof(int) * ranges);
+  int count = 0;
+  int j;
+  for (j = 0; j < ranges; j++)
+  {
+    int first = j * CEDIT_COLD_BLOCK_ROWS;
+    if (Cedit.cold.tick[j] == Cedit.cold.clock)
+      continue;
+    if (first < Cedit.rowOff + 2 * Cedit.terminalRows &&
+        first + CEDIT_COLD_BLOCK_ROWS > Cedit.rowOff - Cedit.terminalRows)
+      continue;
+    if (Cedit.cursorY >= first && Cedit.cursorY < first + CEDIT_COLD_BLOCK_ROWS)
+      continue;
+    order[count++] = j;
+  }
+  qsort(order, count, sizeof(int), ceditColdCompare);
+
+  // Shedding is cheap to undo, so the text is only packed if it is not enough
+  long long target = Cedit.cold.budget / 4 * 3;
+  for (j = 0; j < count && Cedit.cold.resident > target; j++)
+    ceditColdShed(order[j] * CEDIT_COLD_BLOCK_ROWS, CEDIT_COLD_BLOCK_ROWS);
+  for (j = 0; j < count && Cedit.cold.resident > target; j++)
+    ceditColdCompress(order[j] * CEDIT_COLD_BLOCK_ROWS, CEDIT_COLD_BLOCK_ROWS);
+  free(order);
+}
 
-  char buffer[32];
-  snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", (Cedit.cursorY - Cedit.rowOff) + 1,
-           (Cedit.rowX - Cedit.columnOff) + 1);
-  appendBuffer(&bc, buffer, strlen(buffer));
+void ceditShowStats()
+{
+  long long unpackAverage = Cedit.cold.unpacks ? Cedit.cold.unpackNanos / Cedit.cold.unpacks : 0;
+  char dedup[32] = "";
+  if (Cedit.intern.enabled)
+    snprintf(dedup, sizeof(dedup), " | dedup %.1fx",
+             Cedit.intern.uniqueBytes ? (double)Cedit.intern.bytes / Cedit.intern.uniqueBytes : 1.0);
+  long long paintAverage = Cedit.frame.frames ? Cedit.frame.latencyNanos / Cedit.frame.frames : 0;
+  long long frameBytes = Cedit.frame.frames ? Cedit.output.bytes / Cedit.frame.frames : 0;
+  long long plainBytes = Cedit.output.bytes + Cedit.output.saved;
+  ceditSetStatusMessage("%.1f MB | shed %lld/%lld | %d cold %.1fx | unpack %lld/%lld us%s | paint %lld/%lld ms | %lld B/frame -%d%%",
+                        Cedit.cold.resident / 1048576.0, Cedit.cold.sheds, Cedit.cold.rebuilds, Cedit.cold.blocks,
+                        Cedit.cold.packedBytes ? (double)Cedit.cold.rawBytes / Cedit.cold.packedBytes : 0.0,
+                        unpackAverage / 1000, Cedit.cold.unpackMaxNanos / 1000, dedup,
+                        paintAverage / 1000000, Cedit.frame.latencyMaxNanos / 1000000, frameBytes,
+                        plainBytes ? (int)(Cedit.output.saved * 100 / plainBytes) : 0);
+}
 
-  appendBuffer(&bc, "\x1b[?25h", 6);
+/*** BRACKET MATCHING ***/
+
+/*
+  Every row keeps a summary of the brackets it leaves unmatched, per kind:
+  closes that need an opener from an earlier row, and opens that need a
+  closer from a later row. The summaries are combined in a treap ordered
+  by row, each node holding its row's summary and its subtree's, so a
+  match that lies many rows away is found by descending the tree instead
+  of scanning the rows in between. A row inserted or deleted splits the
+  treap at its position and merges it back, in O(log n); only operations
+  that move many rows at once rebuild it. Brackets inside strings and
+  comments are skipped using the classes computed by ceditUpdateSyntax.
+*/
+
+int ceditBracketKind(char *render, struct ceditSpan *spans, int spanNum, int at, int *isOpen)
+{
+  // Brackets are rare, so the class is only looked up for them
+  char *bracket = strchr(CEDIT_BRACKETS, render[at]);
+  if (render[at] == '\0' || bracket == NULL)
+    return -1;
+  if (ceditSpanClass(spans, spanNum, at) != HL_NORMAL)
+    return -1;
 
-  write(STDOUT_FILENO, bc.b, bc.length);
-  freeBuffer(&bc);
+  int kind = bracket - CEDIT_BRACKETS;
+  *isOpen = kind < CEDIT_BRACKET_KINDS;
+  return kind % CEDIT_BRACKET_KINDS;
 }
 
-void ceditSetStatusMessage(const char *fmt, ...)
+int ceditBracketAt(editorRow *row, int rowX, int *isOpen)
 {
-  va_list ap;
-  va_start(ap, fmt);
-  vsnprintf(Cedit.statusMessage, sizeof(Cedit.statusMessage), fmt, ap);
-  va_end(ap);
-  Cedit.statusMessageTime = time(NULL);
+  if (rowX < 0 || rowX >= row->rSize)
+    return -1;
+  if (row->chunks)
+  {
+    struct ceditChunk *chunk = &row->chunks[ceditChunkFind(row, rowX, 1)];
+    rowX -= chunk->renderStart;
+    return ceditBracketKind(chunk->render, chunk->spans, chunk->spanNum, rowX, isOpen);
+  }
+  return ceditBracketKind(row->render, row->spans, row->spanNum, rowX, isOpen);
 }
 
-/*** INPUT OPERATIONS ***/
-
-char *ceditPrompt(char *prompt, void (*callback)(char *, int))
+void ceditBracketCombine(struct bracketSummary *out, struct bracketSummary *left, struct bracketSummary *right)
 {
-  size_t bufferSize = 128;
-  char *buffer = malloc(bufferSize);
+  int kind;
+  for (kind = 0; kind < CEDIT_BRACKET_KINDS; kind++)
+  {
+    int matched = left->open[kind] < right->close[kind] ? left->open[kind] : right->close[kind];
+    out->open[kind] = left->open[kind] - matched + right->open[kind];
+    out->close[kind] = left->close[kind] + right->close[kind] - matched;
+  }
+}
 
-  size_t bufferLength = 0;
-  buffer[0] = '\0';
+void ceditBracketCount(struct bracketSummary *summary, char *render, struct ceditSpan *spans, int spanNum)
+{
+  memset(summary, 0, sizeof(struct bracketSummary));
 
-  while (1)
+  int start = 0;
+  int k, i;
+  for (k = 0; k < spanNum; start += spans[k++].length)
   {
-    ceditSetStatusMessage(prompt, buffer);
-    ceditRefreshTerminal();
-
-    int character = ceditReadCharacter();
-    if (character == DEL_KEY || character == ctrl('h') || character == BACKSPACE)
+    if (spans[k].hl != HL_NORMAL)
+      continue;
+    for (i = start; i < start + spans[k].length; i++)
     {
-      if (bufferLength != 0)
-        buffer[--bufferLength] = '\0';
+      char *bracket = strchr(CEDIT_BRACKETS, render[i]);
+      if (render[i] == '\0' || bracket == NULL)
+        continue;
+      int kind = (bracket - CEDIT_BRACKETS) % CEDIT_BRACKET_KINDS;
+      if (bracket - CEDIT_BRACKETS < CEDIT_BRACKET_KINDS)
+        summary->open[kind]++;
+      else if (summary->open[kind] > 0)
+        summary->open[kind]--;
+      else
+        summary->close[kind]++;
     }
-    else if (character == '\x1b')
+  }
+}
+
+void ceditBracketSummarize(editorRow *row)
+{
+  if (row->chunks)
+  {
+    int k;
+    memset(&row->brackets, 0, sizeof(row->brackets));
+    for (k = 0; k < row->chunkNum; k++)
+      ceditBracketCombine(&row->brackets, &row->brackets, &row->chunks[k].brackets);
+  }
+  else
+    ceditBracketCount(&row->brackets, row->render, row->spans, row->spanNum);
+  ceditBracketStore(row);
+}
+
+void ceditBracketStore(editorRow *row)
+{
+  if (Cedit.bracketTreeDirty || row->bracketNode == -1)
+    return;
+
+  int node = row->bracketNode;
+  Cedit.bracketNodes[node].own = row->brackets;
+  for (; node != -1; node = Cedit.bracketNodes[node].parent)
+    ceditBracketPull(node);
+}
+
+unsigned int ceditBracketPriority()
+{
+  unsigned int x = Cedit.bracketSeed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return Cedit.bracketSeed = x;
+}
+
+void ceditBracketPull(int node)
+{
+  struct ceditBracketNode *n = &Cedit.bracketNodes[node];
+  n->count = 1;
+  n->sum = n->own;
+  if (n->left != -1)
+  {
+    struct ceditBracketNode *left = &Cedit.bracketNodes[n->left];
+    left->parent = node;
+    n->count += left->count;
+    ceditBracketCombine(&n->sum, &left->sum, &n->own);
+  }
+  if (n->right != -1)
+  {
+    struct ceditBracketNode *right = &Cedit.bracketNodes[n->right];
+    right->parent = node;
+    n->count += right->count;
+    ceditBracketCombine(&n->sum, &n->sum, &right->sum);
+  }
+}
+
+void ceditBracketSplit(int node, int count, int *left, int *right)
+{
+  // The first count rows of the subtree go left, the rest right
+  if (node == -1)
+  {
+    *left = *right = -1;
+    return;
+  }
+  struct ceditBracketNode *n = &Cedit.bracketNodes[node];
+  int leftCount = n->left == -1 ? 0 : Cedit.bracketNodes[n->left].count;
+  if (count <= leftCount)
+  {
+    ceditBracketSplit(n->left, count, left, &n->left);
+    *right = node;
+  }
+  else
+  {
+    ceditBracketSplit(n->right, count - leftCount - 1, &n->right, right);
+    *left = node;
+  }
+  ceditBracketPull(node);
+}
+
+int ceditBracketMerge(int left, int right)
+{
+  if (left == -1)
+    return right;
+  if (right == -1)
+    return left;
+  struct ceditBracketNode *nodes = Cedit.bracketNodes;
+  if (nodes[left].priority > nodes[right].priority)
+  {
+    nodes[left].right = ceditBracketMerge(nodes[left].right, right);
+    ceditBracketPull(left);
+    return left;
+  }
+  nodes[right].left = ceditBracketMerge(left, nodes[right].left);
+  ceditBracketPull(right);
+  return right;
+}
+
+int ceditBracketInsert(int at)
+{
+  // An empty node for a new row at, which stores its summary when it has one
+  int node = Cedit.bracketFree;
+  if (node != -1)
+    Cedit.bracketFree = Cedit.bracketNodes[node].left;
+  else
+  {
+    if (Cedit.bracketNodeNum == Cedit.bracketNodeCapacity)
     {
-      ceditSetStatusMessage("");
-      if (callback)
-        callback(buffer, character);
-      free(buffer);
-      return NULL;
+      Cedit.bracketNodeCapacity = Cedit.bracketNodeCapacity ? Cedit.bracketNodeCapacity * 2 : 64;
+      Cedit.bracketNodes = realloc(Cedit.bracketNodes, sizeof(struct ceditBracketNode) * Cedit.bracketNodeCapacity);
     }
-    else if (character == '\r')
+    node = Cedit.bracketNodeNum++;
+  }
+  struct ceditBracketNode *n = &Cedit.bracketNodes[node];
+  memset(n, 0, sizeof(struct ceditBracketNode));
+  n->left = n->right = n->parent = -1;
+  n->count = 1;
+  n->priority = ceditBracketPriority();
+
+  int left, right;
+  ceditBracketSplit(Cedit.bracketRoot, at, &left, &right);
+  Cedit.bracketRoot = ceditBracketMerge(ceditBracketMerge(left, node), right);
+  Cedit.bracketNodes[Cedit.bracketRoot].parent = -1;
+  return node;
+}
+
+void ceditBracketRemove(int at)
+{
+  int left, middle, right;
+  ceditBracketSplit(Cedit.bracketRoot, at, &left, &middle);
+  ceditBracketSplit(middle, 1, &middle, &right);
+  Cedit.bracketNodes[middle].left = Cedit.bracketFree;
+  Cedit.bracketFree = middle;
+  Cedit.bracketRoot = ceditBracketMerge(left, right);
+  if (Cedit.bracketRoot != -1)
+    Cedit.bracketNodes[Cedit.bracketRoot].parent = -1;
+}
+
+void ceditBracketBuild()
+{
+  // In one pass over the rows: each becomes the right child of the last
+  // node on the right spine with a higher priority, and takes the nodes it
+  // pops off the spine as its left subtree. A popped node's subtree is
+  // complete, so its summary is taken then.
+  if (Cedit.rowNum > Cedit.bracketNodeCapacity)
+  {
+    Cedit.bracketNodeCapacity = Cedit.rowNum;
+    Cedit.bracketNodes = realloc(Cedit.bracketNodes, sizeof(struct ceditBracketNode) * Cedit.bracketNodeCapacity);
+  }
+  Cedit.bracketNodeNum = Cedit.rowNum;
+  Cedit.bracketFree = -1;
+
+  struct ceditBracketNode *nodes = Cedit.bracketNodes;
+  int *spine = malloc(sizeof(int) * (Cedit.rowNum + 1));
+  int depth = 0;
+  int j;
+  for (j = 0; j < Cedit.rowNum; j++)
+  {
+    nodes[j].own = Cedit.row[j].brackets;
+    nodes[j].priority = ceditBracketPriority();
+    nodes[j].right = -1;
+    Cedit.row[j].bracketNode = j;
+    int last = -1;
+    while (depth > 0 && nodes[spine[depth - 1]].priority < nodes[j].priority)
     {
-      if (bufferLength != 0)
-      {
-        ceditSetStatusMessage("");
-        if (callback)
-          callback(buffer, character);
-        return buffer;
-      }
+      last = spine[--depth];
+      ceditBracketPull(last);
     }
-    else if (!iscntrl(character) && character < 128)
+    nodes[j].left = last;
+    if (depth > 0)
+      nodes[spine[depth - 1]].right = j;
+    spine[depth++] = j;
+  }
+  while (depth > 0)
+    ceditBracketPull(spine[--depth]);
+  Cedit.bracketRoot = Cedit.rowNum ? spine[0] : -1;
+  if (Cedit.bracketRoot != -1)
+    nodes[Cedit.bracketRoot].parent = -1;
+  free(spine);
+
+  Cedit.bracketTreeDirty = 0;
+}
+
+int ceditBracketScanRow(editorRow *row, int from, int direction, int kind, int *depth)
+{
+  int i;
+  ceditRowWarm(row);
+  if (row->chunks)
+    return ceditChunkScan(row, from, direction, kind, depth);
+  for (i = from; i >= 0 && i < row->rSize; i += direction)
+  {
+    int isOpen;
+    if (ceditBracketAt(row, i, &isOpen) != kind)
+      continue;
+    *depth += (isOpen == (direction == 1)) ? 1 : -1;
+    if (*depth == 0)
+      return i;
+  }
+  return -1;
+}
+
+int ceditBracketSearchForward(int node, int low, int from, int kind, int *depth)
+{
+  // The subtree holds the rows from low on
+  if (node == -1)
+    return -1;
+  struct ceditBracketNode *n = &Cedit.bracketNodes[node];
+  if (low + n->count <= from)
+    return -1;
+  if (low >= from && n->sum.close[kind] < *depth)
+  {
+    *depth += n->sum.open[kind] - n->sum.close[kind];
+    return -1;
+  }
+
+  int at = low + (n->left == -1 ? 0 : Cedit.bracketNodes[n->left].count);
+  int found = ceditBracketSearchForward(n->left, low, from, kind, depth);
+  if (found != -1)
+    return found;
+  if (at >= from)
+  {
+    if (n->own.close[kind] >= *depth)
+      return at;
+    *depth += n->own.open[kind] - n->own.close[kind];
+  }
+  return ceditBracketSearchForward(n->right, at + 1, from, kind, depth);
+}
+
+int ceditBracketSearchBackward(int node, int low, int to, int kind, int *depth)
+{
+  if (node == -1 || low >= to)
+    return -1;
+  struct ceditBracketNode *n = &Cedit.bracketNodes[node];
+  if (low + n->count <= to && n->sum.open[kind] < *depth)
+  {
+    *depth += n->sum.close[kind] - n->sum.open[kind];
+    return -1;
+  }
+
+  int at = low + (n->left == -1 ? 0 : Cedit.bracketNodes[n->left].count);
+  int found = ceditBracketSearchBackward(n->right, at + 1, to, kind, depth);
+  if (found != -1)
+    return found;
+  if (at < to)
+  {
+    if (n->own.open[kind] >= *depth)
+      return at;
+    *depth += n->own.close[kind] - n->own.open[kind];
+  }
+  return ceditBracketSearchBackward(n->left, low, to, kind, depth);
+}
+
+int ceditBracketMatch(int fileRow, int rowX, int *matchRow, int *matchRowX)
+{
+  editorRow *row = &Cedit.row[fileRow];
+  int isOpen;
+  ceditRowWarm(row);
+  int kind = ceditBracketAt(row, rowX, &isOpen);
+  if (kind == -1)
+    return -1;
+
+  int direction = isOpen ? 1 : -1;
+  int depth = 1;
+  int found = ceditBracketScanRow(row, rowX + direction, direction, kind, &depth);
+  if (found != -1)
+  {
+    *matchRow = fileRow;
+    *matchRowX = found;
+    return 0;
+  }
+
+  if (Cedit.bracketTreeDirty)
+    ceditBracketBuild();
+
+  int target;
+  if (isOpen)
+    target = ceditBracketSearchForward(Cedit.bracketRoot, 0, fileRow + 1, kind, &depth);
+  else
+    target = ceditBracketSearchBackward(Cedit.bracketRoot, 0, fileRow, kind, &depth);
+  if (target == -1)
+    return -1;
+
+  row = &Cedit.row[target];
+  found = ceditBracketScanRow(row, isOpen ? 0 : row->rSize - 1, direction, kind, &depth);
+  if (found == -1)
+    return -1;
+  *matchRow = target;
+  *matchRowX = found;
+  return 0;
+}
+
+int ceditBracketEnclosing(int fileRow, int rowX, int *openRow, int *openRowX)
+{
+  int bestRow = -1, bestRowX = -1;
+  int kind;
+
+  if (Cedit.bracketTreeDirty)
+    ceditBracketBuild();
+
+  for (kind = 0; kind < CEDIT_BRACKET_KINDS; kind++)
+  {
+    int depth = 1;
+    int targetRow = fileRow;
+    int found = ceditBracketScanRow(&Cedit.row[fileRow], rowX - 1, -1, kind, &depth);
+    if (found == -1)
     {
-      if (bufferLength == bufferSize - 1)
+      targetRow = ceditBracketSearchBackward(Cedit.bracketRoot, 0, fileRow, kind, &depth);
+      if (targetRow == -1)
+        continue;
+      editorRow *row = &Cedit.row[targetRow];
+      found = ceditBracketScanRow(row, row->rSize - 1, -1, kind, &depth);
+      if (found == -1)
+        continue;
+    }
+    if (targetRow > bestRow || (targetRow == bestRow && found > bestRowX))
+    {
+      bestRow = targetRow;
+      bestRowX = found;
+    }
+  }
+
+  if (bestRow == -1)
+    return -1;
+  *openRow = bestRow;
+  *openRowX = bestRowX;
+  return 0;
+}
+
+void ceditBracketHighlight()
+{
+  Cedit.bracketRow = Cedit.bracketMatchRow = -1;
+  if (Cedit.cursorY >= Cedit.rowNum)
+    return;
+
+  editorRow *row = &Cedit.row[Cedit.cursorY];
+  int isOpen;
+  int rowX = Cedit.rowX;
+  if (ceditBracketAt(row, rowX, &isOpen) == -1)
+    rowX--;
+  if (ceditBracketMatch(Cedit.cursorY, rowX, &Cedit.bracketMatchRow, &Cedit.bracketMatchColumn) == -1)
+    return;
+  Cedit.bracketRow = Cedit.cursorY;
+  Cedit.bracketColumn = rowX;
+}
+
+void ceditJumpToBracket()
+{
+  ceditScroll();
+  ceditBracketHighlight();
+  if (Cedit.bracketMatchRow == -1)
+  {
+    ceditSetStatusMessage("No matching bracket");
+    return;
+  }
+  Cedit.cursorY = Cedit.bracketMatchRow;
+  Cedit.cursorX = ceditRowCursorTransformRxToCx(&Cedit.row[Cedit.cursorY], Cedit.bracketMatchColumn);
+}
+
+void ceditEnclosingBlock()
+{
+  if (Cedit.cursorY >= Cedit.rowNum)
+    return;
+
+  ceditScroll();
+  int openRow, openRowX, closeRow, closeRowX;
+  if (ceditBracketEnclosing(Cedit.cursorY, Cedit.rowX, &openRow, &openRowX) == -1)
+  {
+    ceditSetStatusMessage("No enclosing block");
+    return;
+  }
+  Cedit.cursorY = openRow;
+  Cedit.cursorX = ceditRowCursorTransformRxToCx(&Cedit.row[openRow], openRowX);
+  if (ceditBracketMatch(openRow, openRowX, &closeRow, &closeRowX) == -1)
+    ceditSetStatusMessage("Block from line %d is never closed", openRow + 1);
+  else
+    ceditSetStatusMessage("Block: lines %d-%d", openRow + 1, closeRow + 1);
+}
+
+/*** FOLDING ***/
+
+/*
+  A fold hides the rows after its first one, up to and including its last.
+  Folds may nest. The rows they hide form disjoint runs, kept sorted along
+  with how many rows are hidden before each, so visible lines and document
+  rows are converted into each other by a binary search over the runs.
+  Scrolling, drawing, cursor movement and search go through these and
+  never visit the rows inside a fold. Adding or removing rows inside a
+  fold opens it, and so does moving the cursor into one.
+*/
+
+void ceditFoldRebuild()
+{
+  struct ceditFoldMap *map = &Cedit.fold;
+  int hidden = 0;
+  int k;
+  map->runNum = 0;
+  for (k = 0; k < map->foldNum; k++)
+  {
+    struct ceditFold *fold = &map->folds[k];
+    struct ceditFoldRun *run = map->runNum ? &map->runs[map->runNum - 1] : NULL;
+    if (run && fold->first <= run->end)
+    {
+      // Starts inside a fold that is already closed
+      if (fold->last > run->end)
       {
-        bufferSize *= 2;
-        buffer = realloc(buffer, bufferSize);
+        hidden += fold->last - run->end;
+        run->end = fold->last;
       }
-      buffer[bufferLength++] = character;
-      buffer[bufferLength] = '\0';
+      continue;
     }
+    run = &map->runs[map->runNum++];
+    run->start = fold->first + 1;
+    run->end = fold->last;
+    run->hiddenBefore = hidden;
+    hidden += fold->last - fold->first;
+  }
+  map->dirty = 0;
+}
 
-    if (callback)
-      callback(buffer, character);
+int ceditFoldRun(int row)
+{
+  // The last run starting at or before the row
+  if (Cedit.fold.dirty)
+    ceditFoldRebuild();
+  int low = 0, high = Cedit.fold.runNum - 1, found = -1;
+  while (low <= high)
+  {
+    int middle = (low + high) / 2;
+    if (Cedit.fold.runs[middle].start <= row)
+    {
+      found = middle;
+      low = middle + 1;
+    }
+    else
+      high = middle - 1;
+  }
+  return found;
+}
+
+int ceditFoldHidden(int row)
+{
+  int k = ceditFoldRun(row);
+  return k != -1 && row <= Cedit.fold.runs[k].end;
+}
+
+int ceditFoldVisible(int row)
+{
+  // A hidden row is on the line of the fold that hides it
+  int k = ceditFoldRun(row);
+  if (k == -1)
+    return row;
+  struct ceditFoldRun *run = &Cedit.fold.runs[k];
+  if (row <= run->end)
+    return run->start - 1 - run->hiddenBefore;
+  return row - run->hiddenBefore - (run->end - run->start + 1);
+}
+
+int ceditFoldRow(int line)
+{
+  if (Cedit.fold.dirty)
+    ceditFoldRebuild();
+  int low = 0, high = Cedit.fold.runNum - 1, found = -1;
+  while (low <= high)
+  {
+    int middle = (low + high) / 2;
+    struct ceditFoldRun *run = &Cedit.fold.runs[middle];
+    if (run->start - run->hiddenBefore <= line)
+    {
+      found = middle;
+      low = middle + 1;
+    }
+    else
+      high = middle - 1;
+  }
+  if (found == -1)
+    return line;
+  struct ceditFoldRun *run = &Cedit.fold.runs[found];
+  return line + run->hiddenBefore + (run->end - run->start + 1);
+}
+
+int ceditFoldStep(int row, int direction)
+{
+  row += direction;
+  int k = ceditFoldRun(row);
+  if (k != -1 && row <= Cedit.fold.runs[k].end)
+    row = direction == 1 ? Cedit.fold.runs[k].end + 1 : Cedit.fold.runs[k].start - 1;
+  return row;
+}
+
+int ceditFoldAt(int row)
+{
+  int low = 0, high = Cedit.fold.foldNum - 1;
+  while (low <= high)
+  {
+    int middle = (low + high) / 2;
+    if (Cedit.fold.folds[middle].first == row)
+      return middle;
+    if (Cedit.fold.folds[middle].first < row)
+      low = middle + 1;
+    else
+      high = middle - 1;
+  }
+  return -1;
+}
+
+void ceditFoldAdd(int first, int last)
+{
+  struct ceditFoldMap *map = &Cedit.fold;
+  int k = 0;
+  while (k < map->foldNum && map->folds[k].first < first)
+    k++;
+  if (k == map->foldNum || map->folds[k].first != first)
+  {
+    map->folds = realloc(map->folds, sizeof(struct ceditFold) * (map->foldNum + 1));
+    map->runs = realloc(map->runs, sizeof(struct ceditFoldRun) * (map->foldNum + 1));
+    memmove(&map->folds[k + 1], &map->folds[k], sizeof(struct ceditFold) * (map->foldNum - k));
+    map->foldNum++;
+  }
+  map->folds[k].first = first;
+  map->folds[k].last = last;
+  map->dirty = 1;
+}
+
+void ceditFoldRemove(int k)
+{
+  struct ceditFoldMap *map = &Cedit.fold;
+  memmove(&map->folds[k], &map->folds[k + 1], sizeof(struct ceditFold) * (map->foldNum - k - 1));
+  map->foldNum--;
+  map->dirty = 1;
+}
+
+void ceditFoldShift(int at, int delta)
+{
+  // A row was inserted at (delta 1) or deleted from (delta -1) the document
+  struct ceditFoldMap *map = &Cedit.fold;
+  if (map->foldNum == 0)
+    return;
+  int kept = 0;
+  int k;
+  for (k = 0; k < map->foldNum; k++)
+  {
+    struct ceditFold fold = map->folds[k];
+    if (at > fold.first - (delta < 0) && at <= fold.last)
+      continue;
+    if (fold.first >= at)
+    {
+      fold.first += delta;
+      fold.last += delta;
+    }
+    map->folds[kept++] = fold;
+  }
+  map->foldNum = kept;
+  map->dirty = 1;
+}
+
+void ceditFoldSplice(int first, int last, int delta)
+{
+  // Rows first..last-1 were rearranged and delta rows added after them
+  struct ceditFoldMap *map = &Cedit.fold;
+  int kept = 0;
+  int k;
+  for (k = 0; k < map->foldNum; k++)
+  {
+    struct ceditFold fold = map->folds[k];
+    if (fold.last >= first && fold.first < last)
+      continue;
+    if (fold.first >= last)
+    {
+      fold.first += delta;
+      fold.last += delta;
+    }
+    map->folds[kept++] = fold;
+  }
+  map->foldNum = kept;
+  map->dirty = 1;
+}
+
+void ceditFoldReveal(int row)
+{
+  int k;
+  for (k = Cedit.fold.foldNum - 1; k >= 0; k--)
+    if (Cedit.fold.folds[k].first < row && row <= Cedit.fold.folds[k].last)
+      ceditFoldRemove(k);
+}
+
+int ceditFoldIndent(int row)
+{
+  // Leading whitespace in columns, or -1 for a blank row
+  char *text = ceditRowText(&Cedit.row[row]);
+  int indent = 0;
+  int j;
+  for (j = 0; j < Cedit.row[row].size; j++)
+  {
+    if (text[j] == '\t')
+      indent += CEDIT_TAB_STOP - indent % CEDIT_TAB_STOP;
+    else if (text[j] == ' ')
+      indent++;
+    else
+      return indent;
+  }
+  return -1;
+}
+
+int ceditFoldRegion(int row, int *first, int *last)
+{
+  int openRow, openRowX, closeRow, closeRowX;
+  int j;
+
+  // A comment block, whole
+  if (Cedit.syntax && (Cedit.row[row].hlOpenComment || (row > 0 && Cedit.row[row - 1].hlOpenComment)))
+  {
+    *first = *last = row;
+    while (*first > 0 && Cedit.row[*first - 1].hlOpenComment)
+      (*first)--;
+    while (*last < Cedit.rowNum - 1 && Cedit.row[*last].hlOpenComment)
+      (*last)++;
+    return *last > *first ? 0 : -1;
   }
+
+  // A block opened on this row, or by a bracket alone at the start of the next
+  for (j = row; j <= row + 1 && j < Cedit.rowNum; j++)
+  {
+    if (ceditBracketEnclosing(j, Cedit.row[j].rSize, &openRow, &openRowX) == -1 || openRow != j)
+      continue;
+    if (j > row && ceditFoldIndent(j) != openRowX)
+      continue;
+    if (ceditBracketMatch(openRow, openRowX, &closeRow, &closeRowX) == 0 && closeRow > row)
+    {
+      *first = row;
+      *last = closeRow;
+      return 0;
+    }
+  }
+
+  // The rows indented deeper than this one
+  int indent = ceditFoldIndent(row);
+  *first = *last = row;
+  for (j = row + 1; indent != -1 && j < Cedit.rowNum; j++)
+  {
+    int depth = ceditFoldIndent(j);
+    if (depth == -1)
+      continue;
+    if (depth <= indent)
+      break;
+    *last = j;
+  }
+  if (*last > row)
+    return 0;
+
+  // The block the row is in
+  if (ceditBracketEnclosing(row, 0, &openRow, &openRowX) == 0 &&
+      ceditBracketMatch(openRow, openRowX, &closeRow, &closeRowX) == 0 && closeRow > openRow)
+  {
+    *first = openRow;
+    *last = closeRow;
+    return 0;
+  }
+  return -1;
+}
+
+void ceditFoldToggle()
+{
+  if (Cedit.cursorY >= Cedit.rowNum)
+    return;
+
+  int k = ceditFoldAt(Cedit.cursorY);
+  if (k != -1)
+  {
+    ceditSetStatusMessage("Unfolded lines %d-%d", Cedit.fold.folds[k].first + 1, Cedit.fold.folds[k].last + 1);
+    ceditFoldRemove(k);
+    return;
+  }
+
+  int first, last;
+  if (ceditFoldRegion(Cedit.cursorY, &first, &last) == -1)
+  {
+    ceditSetStatusMessage("Nothing to fold here (ctrl+N folds up to a line)");
+    return;
+  }
+  ceditFoldAdd(first, last);
+  Cedit.cursorY = first;
+  if (Cedit.cursorX > Cedit.row[first].size)
+    Cedit.cursorX = Cedit.row[first].size;
+  ceditSetStatusMessage("Folded lines %d-%d", first + 1, last + 1);
+}
+
+void ceditFoldToLine()
+{
+  if (Cedit.cursorY >= Cedit.rowNum)
+    return;
+
+  char *answer = ceditPrompt("Fold up to line: %s (ESC to cancel)", NULL);
+  if (answer == NULL)
+    return;
+  int line = atoi(answer) - 1;
+  free(answer);
+  if (line < 0 || line >= Cedit.rowNum || line == Cedit.cursorY)
+  {
+    ceditSetStatusMessage("No such line to fold to");
+    return;
+  }
+
+  int first = line < Cedit.cursorY ? line : Cedit.cursorY;
+  int last = line < Cedit.cursorY ? Cedit.cursorY : line;
+  ceditFoldAdd(first, last);
+  Cedit.cursorY = first;
+  if (Cedit.cursorX > Cedit.row[first].size)
+    Cedit.cursorX = Cedit.row[first].size;
+  ceditSetStatusMessage("Folded lines %d-%d", first + 1, last + 1);
+}
+
+/*** CEDIT OPERATIONS ***/
+
+void ceditInsertCharacter(int character)
+{
+  if (Cedit.cursorY == Cedit.rowNum)
+  {
+    ceditInsertRow(Cedit.rowNum, "", 0);
+  }
+  ceditRowInsertCharacter(&Cedit.row[Cedit.cursorY], Cedit.cursorX, character);
+  Cedit.cursorX++;
+}
+
+void ceditInsertNewline()
+{
+  if (Cedit.cursorY < Cedit.rowNum)
+  {
+    ceditRowWarm(&Cedit.row[Cedit.cursorY]);
+    ceditRowFlatten(&Cedit.row[Cedit.cursorY]);
+  }
+  if (Cedit.cursorX == 0)
+  {
+    ceditInsertRow(Cedit.cursorY, "", 0);
+  }
+  else
+  {
+    editorRow *row = &Cedit.row[Cedit.cursorY];
+    ceditInsertRow(Cedit.cursorY + 1, &row->characters[Cedit.cursorX], row->size - Cedit.cursorX);
+    row = &Cedit.row[Cedit.cursorY];
+    ceditRowDetach(row);
+    ceditDiskTouch(row);
+    row->size = Cedit.cursorX;
+    row->characters[row->size] = '\0';
+    ceditUpdateRow(row);
+  }
+  Cedit.cursorY++;
+  Cedit.cursorX = 0;
+}
+
+void ceditDeleteCharacter()
+{
+  if (Cedit.cursorY == Cedit.rowNum)
+    return;
+  if (Cedit.cursorX == 0 && Cedit.cursorY == 0)
+    return;
+
+  editorRow *row = &Cedit.row[Cedit.cursorY];
+  ceditRowWarm(row);
+  if (Cedit.cursorX > 0)
+  {
+    ceditRowDeleteCharacter(row, Cedit.cursorX - 1);
+    Cedit.cursorX--;
+  }
+  else
+  {
+    Cedit.cursorX = Cedit.row[Cedit.cursorY - 1].size;
+    ceditRowFlatten(row);
+    ceditRowAppendString(&Cedit.row[Cedit.cursorY - 1], row->characters, row->size);
+    ceditDeleteRow(Cedit.cursorY);
+    Cedit.cursorY--;
+  }
+}
+
+/*** DIRTY TRACKING ***/
+
+/*
+  Cedit.disk remembers the file as it was last read or written: how long
+  each line is and, once known, its hash. A row is clean while it sits at
+  the position of a disk line with the same text; rows that were never
+  edited are clean by position alone, so nothing is hashed until an edit
+  needs it. Undoing an edit by hand makes the row clean again, and the
+  document counts as modified only while some row is dirty. Saves use the
+  same information to rewrite only what changed.
+*/
+
+void ceditDiskTouch(editorRow *row)
+{
+  // Before its first edit the row holds the disk line, so hash that now
+  if (row->changed)
+    return;
+  if (row->diskRow >= 0 && !Cedit.disk.hashes[row->diskRow] && !row->chunks)
+    Cedit.disk.hashes[row->diskRow] = ceditHash(ceditRowText(row), row->size) | 1;
+  row->changed = 1;
+}
+
+void ceditDiskCheck(editorRow *row)
+{
+  int clean = row->index < Cedit.disk.rowNum &&
+              (row->changed ? row->hash && row->hash == Cedit.disk.hashes[row->index]
+                            : row->diskRow == row->index);
+  Cedit.disk.cleanRows += clean - row->clean;
+  row->clean = clean;
+}
+
+void ceditDiskReset(int canonical)
+{
+  // Canonical: every line on disk ends in a single newline, as saves write it
+  uint64_t *hashes = calloc(Cedit.rowNum + 1, sizeof(uint64_t));
+  int *sizes = malloc(sizeof(int) * (Cedit.rowNum + 1));
+  int j;
+  for (j = 0; j < Cedit.rowNum; j++)
+  {
+    editorRow *row = &Cedit.row[j];
+    if (row->changed)
+      hashes[j] = row->hash;
+    else if (row->diskRow >= 0 && row->diskRow < Cedit.disk.rowNum)
+      hashes[j] = Cedit.disk.hashes[row->diskRow];
+    sizes[j] = row->size;
+    row->diskRow = j;
+    row->changed = 0;
+    row->clean = 1;
+  }
+  free(Cedit.disk.hashes);
+  free(Cedit.disk.sizes);
+  Cedit.disk.hashes = hashes;
+  Cedit.disk.sizes = sizes;
+  Cedit.disk.rowNum = Cedit.rowNum;
+  Cedit.disk.cleanRows = Cedit.rowNum;
+  Cedit.disk.canonical = canonical;
+}
+
+void ceditDiskAppend(int first, int grown)
+{
+  // The rows from first on were just read from the end of the file and hold
+  // its last lines; with grown, the first of them is the line that was open
+  // and already has its place on disk
+  int from = Cedit.disk.rowNum - grown;
+  int rowNum = from + Cedit.rowNum - first;
+  Cedit.disk.hashes = realloc(Cedit.disk.hashes, sizeof(uint64_t) * (rowNum + 1));
+  Cedit.disk.sizes = realloc(Cedit.disk.sizes, sizeof(int) * (rowNum + 1));
+  int j;
+  for (j = first; j < Cedit.rowNum; j++)
+  {
+    editorRow *row = &Cedit.row[j];
+    Cedit.disk.hashes[from + j - first] = row->changed ? row->hash : 0;
+    Cedit.disk.sizes[from + j - first] = row->size;
+    row->diskRow = from + j - first;
+    row->changed = 0;
+  }
+  Cedit.disk.rowNum = rowNum;
+
+  // Only rows from there on can have a disk line they did not have before
+  for (j = from; j < Cedit.rowNum; j++)
+    ceditDiskCheck(&Cedit.row[j]);
+}
+
+int ceditModified()
+{
+  if (Cedit.hex.map)
+    return Cedit.hex.editNum > 0;
+  return Cedit.modified && (Cedit.disk.cleanRows != Cedit.rowNum || Cedit.rowNum != Cedit.disk.rowNum);
+}
+
+/*** FILE OPERATIONS ***/
+
+char *ceditRowToString(int *bufferLength)
+{
+  int totalLength = 0;
+  int j;
+  for (j = 0; j < Cedit.rowNum; j++)
+    totalLength += Cedit.row[j].size + 1;
+  *bufferLength = totalLength;
+
+  char *buffer = malloc(totalLength);
+  char *p = buffer;
+  for (j = 0; j < Cedit.rowNum; j++)
+  {
+    memcpy(p, ceditRowText(&Cedit.row[j]), Cedit.row[j].size);
+    p += Cedit.row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buffer;
+}
+
+void ceditOpen(char *fileName)
+{
+  free(Cedit.fileName);
+  Cedit.fileName = strdup(fileName);
+
+  // Batch edits work on lines, so only the editor looks for binaries
+  if (!ceditHeadless && ceditHexOpen(fileName))
+  {
+    Cedit.modified = 0;
+    ceditWatchFile();
+    return;
+  }
+
+  ceditHighlightSyntax();
+
+  if (Cedit.indexCache && ceditIndexLoad(fileName))
+  {
+    Cedit.modified = 0;
+    ceditWatchFile();
+    return;
+  }
+  int canonical = 1;
+
+  FILE *fp = fopen(fileName, "r");
+  if (!fp)
+    terminateProgram("File Open Error!");
+
+  // The bytes stripped after each row are kept for the index cache
+  struct stat st;
+  int indexed = Cedit.indexCache && fstat(fileno(fp), &st) == 0;
+  int *gaps = NULL;
+
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t lineLength;
+  off_t offset = 0;
+  while ((lineLength = getline(&line, &lineCap, fp)) != -1)
+  {
+    offset += lineLength;
+    Cedit.lastRowOpen = line[lineLength - 1] != '\n';
+    int stripped = lineLength;
+    while (lineLength > 0 && (line[lineLength - 1] == '\n' ||
+                              line[lineLength - 1] == '\r'))
+      lineLength--;
+    canonical &= stripped - lineLength == 1 && line[lineLength] == '\n';
+    if (indexed)
+    {
+      if (Cedit.rowNum % 1024 == 0)
+        gaps = realloc(gaps, sizeof(int) * (Cedit.rowNum + 1024));
+      gaps[Cedit.rowNum] = stripped - lineLength;
+    }
+    ceditInsertRow(Cedit.rowNum, line, lineLength);
+
+    // Keep a large file within the budget while it loads, not just after
+    if (!ceditHeadless && Cedit.rowNum % CEDIT_COLD_BLOCK_ROWS == 0)
+      ceditColdCompact();
+  }
+  free(line);
+  if (indexed)
+    ceditIndexWrite(fileno(fp), &st, gaps);
+  free(gaps);
+  fclose(fp);
+  Cedit.modified = 0;
+  ceditDiskReset(canonical);
+  ceditWatchFile();
+  Cedit.fileOffset = offset;
+}
+
+/*
+  Reading from a pipe: rows are appended as the data arrives, so the
+  document can be viewed and edited while the rest is still loading. The
+  handler reads at most CEDIT_STREAM_BUDGET bytes per call to keep the
+  keyboard responsive when the producer is fast.
+*/
+
+int ceditRedirectInput()
+{
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+  if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    terminateProgram("Terminal Open Error!");
+  close(tty);
+  return fd;
+}
+
+void ceditAppendText(char *text, int length)
+{
+  // A last line without its newline yet stays open and grows in place
+  int modified = Cedit.modified;
+  char *end = text + length;
+
+  while (text < end)
+  {
+    // Every '\r' before the newline is stripped, as ceditOpen does
+    char *newline = memchr(text, '\n', end - text);
+    int lineLength = (newline ? newline : end) - text;
+    int returns = 0;
+    while (lineLength > 0 && text[lineLength - 1] == '\r')
+    {
+      lineLength--;
+      returns++;
+    }
+
+    // A line ending can be split between two reads; only what follows the
+    // '\r's at the end of one tells whether they ended the line or were text
+    if (Cedit.pendingReturn && lineLength > 0 && Cedit.lastRowOpen && Cedit.rowNum > 0)
+      for (; Cedit.pendingReturn > 0; Cedit.pendingReturn--)
+        ceditRowAppendString(&Cedit.row[Cedit.rowNum - 1], "\r", 1);
+    if (lineLength > 0 || newline)
+      Cedit.pendingReturn = 0;
+    if (newline == NULL)
+      Cedit.pendingReturn += returns;
+
+    if (Cedit.lastRowOpen && Cedit.rowNum > 0)
+      ceditRowAppendString(&Cedit.row[Cedit.rowNum - 1], text, lineLength);
+    else
+      ceditInsertRow(Cedit.rowNum, text, lineLength);
+
+    Cedit.lastRowOpen = (newline == NULL);
+    text = newline ? newline + 1 : end;
+  }
+  Cedit.modified = modified;
+}
+
+void ceditStreamOpen(int fd)
+{
+  struct stat st;
+  Cedit.streamFd = fd;
+  Cedit.streamBytes = 0;
+  Cedit.streamTotal = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  ceditWatchFd(fd, ceditStreamHandler);
+}
+
+void ceditStreamHandler(int fd)
+{
+  char chunk[CEDIT_STREAM_CHUNK];
+  int budget = CEDIT_STREAM_BUDGET;
+  ssize_t length = 0;
+
+  while (budget > 0 && (length = read(fd, chunk, sizeof(chunk))) > 0)
+  {
+    ceditAppendText(chunk, length);
+    Cedit.streamBytes += length;
+    budget -= length;
+  }
+
+  if (length == 0 || (length == -1 && errno != EAGAIN && errno != EINTR))
+  {
+    Cedit.lastRowOpen = 0;
+    Cedit.pendingReturn = 0;
+    ceditUnwatchFd(fd);
+    close(fd);
+    Cedit.streamFd = -1;
+    ceditSetStatusMessage("Loaded %d lines (%lld bytes)", Cedit.rowNum, Cedit.streamBytes);
+  }
+}
+
+void ceditSave()
+{
+  if (Cedit.hex.map)
+  {
+    ceditHexSave();
+    return;
+  }
+  if (Cedit.saving)
+  {
+    ceditSetStatusMessage("A save is already in progress");
+    return;
+  }
+
+  // Only a file that still looks the way we left it is patched in place
+  struct stat st;
+  int partial = Cedit.fileName && !Cedit.diskChanged && Cedit.disk.canonical &&
+                stat(Cedit.fileName, &st) == 0 && !ceditDiskStatChanged(&st);
+
+  if (Cedit.fileName == NULL)
+  {
+    Cedit.fileName = ceditPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (Cedit.fileName == NULL)
+    {
+      ceditSetStatusMessage("Save aborted");
+      return;
+    }
+    ceditHighlightSyntax();
+  }
+  else if (Cedit.diskChanged)
+  {
+    char *answer = ceditPrompt("File changed on disk. Overwrite it? (y/n): %s", NULL);
+    int overwrite = answer && (answer[0] == 'y' || answer[0] == 'Y');
+    free(answer);
+    if (!overwrite)
+    {
+      ceditSetStatusMessage("Save aborted");
+      return;
+    }
+  }
+
+  /*
+    The worker thread writes from a snapshot of the row buffers. Rows are
+    not copied up front: an edit to a row still referenced by the snapshot
+    goes through ceditRowDetach, which leaves the old buffer to the save.
+  */
+  struct ceditSaveJob *job = &Cedit.save;
+  job->rowNum = Cedit.rowNum;
+  job->characters = calloc(Cedit.rowNum + 1, sizeof(char *));
+  job->blocks = calloc(Cedit.rowNum + 1, sizeof(struct ceditColdBlock *));
+  job->interned = calloc(Cedit.rowNum + 1, sizeof(struct ceditInterned *));
+  job->slots = malloc(sizeof(int) * (Cedit.rowNum + 1));
+  job->sizes = malloc(sizeof(int) * (Cedit.rowNum + 1));
+  job->owned = calloc(Cedit.rowNum + 1, 1);
+  job->written = 0;
+  ceditSavePlan(job, partial);
+
+  int r, j;
+  for (r = 0; r < job->rangeNum; r++)
+  {
+    for (j = job->ranges[2 * r]; j < job->ranges[2 * r + 1]; j++)
+    {
+      job->characters[j] = Cedit.row[j].characters;
+      job->blocks[j] = Cedit.row[j].cold;
+      job->interned[j] = Cedit.row[j].interned;
+      job->slots[j] = Cedit.row[j].coldSlot;
+      job->total += Cedit.row[j].size + 1;
+      if (Cedit.row[j].cold)
+        Cedit.row[j].cold->refs++;
+      else if (Cedit.row[j].interned)
+        Cedit.row[j].interned->refs++;
+      else if (Cedit.row[j].chunks)
+      {
+        // Chunks change under every keystroke, so the save gets its own copy
+        editorRow *row = &Cedit.row[j];
+        job->characters[j] = malloc(row->size + 1);
+        int k;
+        for (k = 0; k < row->chunkNum; k++)
+          memcpy(&job->characters[j][row->chunks[k].start], row->chunks[k].characters, row->chunks[k].size);
+        job->owned[j] = 1;
+      }
+      else
+        Cedit.row[j].saveSlot = j;
+    }
+  }
+  job->fileName = strdup(Cedit.fileName);
+  job->sync = Cedit.saveSync;
+  job->modifiedAtStart = Cedit.modified;
+
+  if (pipe(job->pipe) == -1 ||
+      fcntl(job->pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+      pthread_create(&job->thread, NULL, ceditSaveWorker, job) != 0)
+    terminateProgram("Save Thread Error!");
+
+  Cedit.saving = 1;
+  ceditWatchFd(job->pipe[0], ceditSaveProgressHandler);
+  ceditSetStatusMessage("Saving %s...", Cedit.fileName);
+}
+
+void ceditSavePlan(struct ceditSaveJob *job, int partial)
+{
+  /*
+    If the dirty rows keep their disk lengths, only they are written, in
+    place. Otherwise everything from the first dirty row on is rewritten,
+    which is still only the tail of the file. Clean rows before that point
+    have the lengths they have on disk, so the offsets line up.
+  */
+  int first = -1, sameLength = Cedit.rowNum == Cedit.disk.rowNum;
+  int j;
+  job->size = 0;
+  for (j = 0; j < Cedit.rowNum; j++)
+  {
+    job->sizes[j] = Cedit.row[j].size;
+    job->size += Cedit.row[j].size + 1;
+    if (Cedit.row[j].clean)
+      continue;
+    if (first == -1)
+      first = j;
+    if (sameLength && Cedit.row[j].size != Cedit.disk.sizes[j])
+      sameLength = 0;
+  }
+  if (!partial)
+    first = 0, sameLength = 0;
+  else if (first == -1)
+    first = Cedit.rowNum;
+
+  job->ranges = malloc(sizeof(int) * 2 * (Cedit.rowNum + 1));
+  job->offsets = malloc(sizeof(off_t) * (Cedit.rowNum + 1));
+  job->rangeNum = 0;
+  job->total = 0;
+  off_t offset = 0;
+  for (j = 0; j <= Cedit.rowNum; j++)
+  {
+    int dirty = j < Cedit.rowNum && (sameLength ? !Cedit.row[j].clean : j >= first);
+    int open = job->rangeNum > 0 && job->ranges[2 * job->rangeNum - 1] == j;
+    if (dirty && open)
+      job->ranges[2 * job->rangeNum - 1] = j + 1;
+    else if (dirty)
+    {
+      job->ranges[2 * job->rangeNum] = j;
+      job->ranges[2 * job->rangeNum + 1] = j + 1;
+      job->offsets[job->rangeNum++] = offset;
+    }
+    if (j < Cedit.rowNum)
+      offset += Cedit.row[j].size + 1;
+  }
+}
+
+void *ceditSaveWorker(void *argument)
+{
+  struct ceditSaveJob *job = argument;
+  struct ceditSaveProgress progress = {0, 0, 0};
+  char *chunk = malloc(CEDIT_SAVE_CHUNK);
+  int chunkLength = 0;
+  struct ceditColdBlock *unpacked = NULL;
+  char *raw = NULL;
+  int offsets[CEDIT_COLD_BLOCK_ROWS];
+
+  int fd = open(job->fileName, O_RDWR | O_CREAT, 0644);
+  if (fd == -1 || ftruncate(fd, job->size) == -1)
+    progress.error = errno;
+
+  int r, j;
+  for (r = 0; r < job->rangeNum && !progress.error; r++)
+  {
+    off_t position = job->offsets[r];
+    int last = job->ranges[2 * r + 1];
+    for (j = job->ranges[2 * r]; j <= last && !progress.error; j++)
+    {
+      if (j < last)
+      {
+        char *characters = job->characters[j];
+        if (job->blocks[j])
+        {
+          if (unpacked != job->blocks[j])
+          {
+            unpacked = job->blocks[j];
+            raw = realloc(raw, unpacked->rawSize);
+            ceditColdUnpack(unpacked, raw, offsets);
+          }
+          characters = raw + offsets[job->slots[j]];
+        }
+
+        int offset = 0;
+        while (offset <= job->sizes[j])
+        {
+          int length = job->sizes[j] + 1 - offset;
+          if (length > CEDIT_SAVE_CHUNK - chunkLength)
+            length = CEDIT_SAVE_CHUNK - chunkLength;
+          if (offset + length > job->sizes[j])
+          {
+            memcpy(&chunk[chunkLength], &characters[offset], length - 1);
+            chunk[chunkLength + length - 1] = '\n';
+          }
+          else
+          {
+            memcpy(&chunk[chunkLength], &characters[offset], length);
+          }
+          chunkLength += length;
+          offset += length;
+          if (chunkLength < CEDIT_SAVE_CHUNK)
+            continue;
+
+          if (pwrite(fd, chunk, chunkLength, position) != chunkLength)
+          {
+            progress.error = errno ? errno : EIO;
+            break;
+          }
+          position += chunkLength;
+          progress.written += chunkLength;
+          chunkLength = 0;
+          write(job->pipe[1], &progress, sizeof(progress));
+        }
+      }
+      else if (chunkLength > 0)
+      {
+        if (pwrite(fd, chunk, chunkLength, position) != chunkLength)
+          progress.error = errno ? errno : EIO;
+        else
+          progress.written += chunkLength;
+        chunkLength = 0;
+      }
+    }
+  }
+
+  if (!progress.error && job->sync == SYNC_DATA && fdatasync(fd) == -1)
+    progress.error = errno;
+  if (!progress.error && job->sync == SYNC_FULL && fsync(fd) == -1)
+    progress.error = errno;
+  if (fd != -1)
+    close(fd);
+  free(chunk);
+  free(raw);
+
+  progress.done = 1;
+  write(job->pipe[1], &progress, sizeof(progress));
+  return NULL;
+}
+
+void ceditSaveProgressHandler(int fd)
+{
+  struct ceditSaveJob *job = &Cedit.save;
+  struct ceditSaveProgress progress;
+
+  while (read(fd, &progress, sizeof(progress)) == sizeof(progress))
+  {
+    job->written = progress.written;
+    if (!progress.done)
+      continue;
+
+    pthread_join(job->thread, NULL);
+    ceditUnwatchFd(job->pipe[0]);
+    close(job->pipe[0]);
+    close(job->pipe[1]);
+
+    int j;
+    for (j = 0; j < job->rowNum; j++)
+    {
+      if (job->owned[j])
+        free(job->characters[j]);
+      if (job->blocks[j])
+        ceditColdRelease(job->blocks[j]);
+      if (job->interned[j])
+        ceditInternRelease(job->interned[j]);
+    }
+    for (j = 0; j < Cedit.rowNum; j++)
+      Cedit.row[j].saveSlot = -1;
+    free(job->characters);
+    free(job->blocks);
+    free(job->interned);
+    free(job->slots);
+    free(job->owned);
+    free(job->ranges);
+    free(job->offsets);
+    Cedit.saving = 0;
+
+    if (progress.error)
+      ceditSetStatusMessage("Can't save! I/O error: %s", strerror(progress.error));
+    else if (Cedit.modified != job->modifiedAtStart)
+      ceditSetStatusMessage("%lld bytes written to %s, edited since", progress.written, job->fileName);
+    else
+      ceditSetStatusMessage("%lld bytes written to disk", progress.written);
+    if (!progress.error && Cedit.modified == job->modifiedAtStart)
+    {
+      Cedit.modified = 0;
+      ceditDiskReset(1);
+    }
+    else if (!progress.error)
+    {
+      // The file holds the snapshot; which rows still match it is unknown
+      free(Cedit.disk.sizes);
+      Cedit.disk.sizes = job->sizes;
+      job->sizes = NULL;
+      memset(Cedit.disk.hashes = realloc(Cedit.disk.hashes, sizeof(uint64_t) * (job->rowNum + 1)), 0,
+             sizeof(uint64_t) * (job->rowNum + 1));
+      Cedit.disk.rowNum = job->rowNum;
+      Cedit.disk.cleanRows = 0;
+      Cedit.disk.canonical = 1;
+      for (j = 0; j < Cedit.rowNum; j++)
+        Cedit.row[j].diskRow = -1, Cedit.row[j].clean = 0;
+    }
+    else
+      Cedit.disk.canonical = 0;
+    free(job->sizes);
+    if (!progress.error)
+      ceditWatchFile();
+    free(job->fileName);
+    return;
+  }
+}
+
+void ceditSaveWait()
+{
+  struct pollfd fd;
+  while (Cedit.saving)
+  {
+    fd.fd = Cedit.save.pipe[0];
+    fd.events = POLLIN;
+    if (poll(&fd, 1, -1) == 1)
+      ceditSaveProgressHandler(fd.fd);
+  }
+}
+
+/*** INDEX CACHE ***/
+
+/*
+  With --index-cache, opening a file leaves a small sidecar in the user's
+  cache directory with the size of every row, the bytes that ended it, its
+  comment state and its bracket summary. The sidecar is keyed by the
+  file's size, modification time, inode, syntax and a hash of all of its
+  content, so an edit that keeps the size and the timestamp is still
+  noticed. On a reopen the file is mapped, hashed and checked in place and
+  only copied once it matches; its rows start out cold, pointing into that
+  copy, so only the rows that are drawn get rendered and highlighted. The
+  copy is needed since saves rewrite the file in place. Every row ending
+  is checked against the text before the index is trusted; anything that
+  does not fit sends the open down the normal path, which rewrites it.
+*/
+
+char *ceditIndexPath(char *fileName, int create)
+{
+  char *real = realpath(fileName, NULL);
+  char *cache = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (real == NULL || (cache == NULL && home == NULL))
+  {
+    free(real);
+    return NULL;
+  }
+
+  int length = strlen(cache ? cache : home) + 64;
+  char *path = malloc(length);
+  if (cache)
+    snprintf(path, length, "%s", cache);
+  else
+    snprintf(path, length, "%s/.cache", home);
+  if (create)
+    mkdir(path, 0700);
+  strcat(path, "/cedit");
+  if (create)
+    mkdir(path, 0700);
+
+  char name[24];
+  snprintf(name, sizeof(name), "/%016llx", (unsigned long long)ceditHash(real, strlen(real)));
+  strcat(path, name);
+  free(real);
+  return path;
+}
+
+void ceditIndexKey(struct ceditIndexKey *key, const char *text, struct stat *st)
+{
+  memset(key, 0, sizeof(struct ceditIndexKey));
+  memcpy(key->magic, CEDIT_INDEX_MAGIC, sizeof(key->magic));
+  key->size = st->st_size;
+  key->mtimeSec = st->st_mtim.tv_sec;
+  key->mtimeNsec = st->st_mtim.tv_nsec;
+  key->inode = st->st_ino;
+  if (Cedit.syntax)
+    key->syntax = ceditHash(Cedit.syntax->fileType, strlen(Cedit.syntax->fileType));
+  key->content = ceditHashContent(text, st->st_size);
+}
+
+char *ceditIndexMap(int fd, struct stat *st)
+{
+  // An empty file has nothing to map, and nothing to read either
+  static char empty[1];
+  if (st->st_size == 0)
+    return empty;
+  char *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+  madvise(data, st->st_size, MADV_SEQUENTIAL);
+  return data;
+}
+
+void ceditIndexUnmap(char *data, struct stat *st)
+{
+  if (data && st->st_size > 0)
+    munmap(data, st->st_size);
+}
+
+void ceditIndexWrite(int fd, struct stat *opened, int *gaps)
+{
+  // Skip it if the file changed while it was being read
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size != opened->st_size ||
+      st.st_mtim.tv_sec != opened->st_mtim.tv_sec || st.st_mtim.tv_nsec != opened->st_mtim.tv_nsec)
+    return;
+
+  char *path = ceditIndexPath(Cedit.fileName, 1);
+  if (path == NULL)
+    return;
+  int length = strlen(path) + 16;
+  char *temporary = malloc(length);
+  snprintf(temporary, length, "%s.%d", path, (int)getpid());
+
+  FILE *out = fopen(temporary, "w");
+  int ok = out != NULL;
+  struct bracketSummary none;
+  memset(&none, 0, sizeof(none));
+
+  struct ceditIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  char *data = ceditIndexMap(fd, &st);
+  ok = ok && data != NULL;
+  if (data)
+    ceditIndexKey(&header.key, data, &st);
+  ceditIndexUnmap(data, &st);
+  header.rowNum = Cedit.rowNum;
+  header.lastRowOpen = Cedit.lastRowOpen;
+  int j;
+  for (j = 0; j < Cedit.rowNum; j++)
+    if (memcmp(&Cedit.row[j].brackets, &none, sizeof(none)))
+      header.bracketNum++;
+  ok = ok && fwrite(&header, sizeof(header), 1, out) == 1;
+
+  for (j = 0; ok && j < Cedit.rowNum; j++)
+  {
+    struct ceditIndexRow entry = {Cedit.row[j].size, Cedit.row[j].hlOpenComment | gaps[j] << 8};
+    ok = gaps[j] < (1 << 24) && fwrite(&entry, sizeof(entry), 1, out) == 1;
+  }
+  for (j = 0; ok && j < Cedit.rowNum; j++)
+  {
+    if (!memcmp(&Cedit.row[j].brackets, &none, sizeof(none)))
+      continue;
+    struct ceditIndexBracket entry;
+    entry.row = j;
+    entry.brackets = Cedit.row[j].brackets;
+    ok = fwrite(&entry, sizeof(entry), 1, out) == 1;
+  }
+
+  if (out && fclose(out) != 0)
+    ok = 0;
+  if (ok)
+    rename(temporary, path);
+  else
+    unlink(temporary);
+  free(temporary);
+  free(path);
+}
+
+int ceditIndexLoad(char *fileName)
+{
+  char *path = ceditIndexPath(fileName, 0);
+  if (path == NULL)
+    return 0;
+  int cacheFd = open(path, O_RDONLY);
+  free(path);
+  if (cacheFd == -1)
+    return 0;
+
+  struct stat cacheStat;
+  void *map = MAP_FAILED;
+  if (fstat(cacheFd, &cacheStat) == 0 && cacheStat.st_size >= (off_t)sizeof(struct ceditIndexHeader))
+    map = mmap(NULL, cacheStat.st_size, PROT_READ, MAP_PRIVATE, cacheFd, 0);
+  close(cacheFd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  struct ceditIndexHeader *header = map;
+  size_t expected = sizeof(struct ceditIndexHeader) + (size_t)header->rowNum * sizeof(struct ceditIndexRow) +
+                    (size_t)header->bracketNum * sizeof(struct ceditIndexBracket);
+
+  int loaded = 0;
+  struct stat st;
+  struct ceditIndexKey key;
+  int fd = open(fileName, O_RDONLY);
+  char *data = NULL;
+  // Nothing is hashed unless the cheap parts of the key match
+  if (fd != -1 && fstat(fd, &st) == 0 && expected == (size_t)cacheStat.st_size &&
+      header->key.size == (uint64_t)st.st_size && header->key.inode == (uint64_t)st.st_ino &&
+      header->key.mtimeSec == st.st_mtim.tv_sec && header->key.mtimeNsec == st.st_mtim.tv_nsec &&
+      (data = ceditIndexMap(fd, &st)) != NULL)
+  {
+    ceditIndexKey(&key, data, &st);
+    if (!memcmp(&key, &header->key, sizeof(key)))
+      loaded = ceditIndexApply(header, data, &st);
+  }
+  ceditIndexUnmap(data, &st);
+  if (fd != -1)
+    close(fd);
+  munmap(map, cacheStat.st_size);
+  return loaded;
+}
+
+int ceditIndexApply(struct ceditIndexHeader *header, const char *data, struct stat *st)
+{
+  struct ceditIndexRow *rows = (struct ceditIndexRow *)(header + 1);
+  struct ceditIndexBracket *brackets = (struct ceditIndexBracket *)(rows + header->rowNum);
+  int rowNum = header->rowNum;
+
+  // Each row has to end in carriage returns and a newline (or the end of
+  // an open last row) exactly where the index says
+  off_t position = 0;
+  int j;
+  for (j = 0; j < rowNum; j++)
+  {
+    off_t end = position + rows[j].size;
+    int gap = rows[j].flags >> 8;
+    int open = header->lastRowOpen && j == rowNum - 1;
+    if (end + gap > st->st_size || (!open && (gap == 0 || data[end + gap - 1] != '\n')))
+      break;
+    int k;
+    for (k = 0; k < gap - !open; k++)
+      if (data[end + k] != '\r')
+        break;
+    if (k < gap - !open)
+      break;
+    position = end + gap;
+  }
+  if (j < rowNum || position != st->st_size)
+    return 0;
+
+  char *text = malloc(st->st_size + 1);
+  memcpy(text, data, st->st_size);
+
+  if (rowNum > Cedit.rowCapacity)
+  {
+    Cedit.rowCapacity = rowNum;
+    Cedit.row = realloc(Cedit.row, sizeof(editorRow) * Cedit.rowCapacity);
+  }
+
+  struct ceditColdSource *source = malloc(sizeof(struct ceditColdSource));
+  source->refs = 0;
+  source->text = text;
+  position = 0;
+  int first;
+  for (first = 0; first < rowNum; first += CEDIT_COLD_BLOCK_ROWS)
+  {
+    struct ceditColdBlock *block = calloc(1, sizeof(struct ceditColdBlock));
+    block->refs = 1;
+    block->rowCount = rowNum - first < CEDIT_COLD_BLOCK_ROWS ? rowNum - first : CEDIT_COLD_BLOCK_ROWS;
+    block->source = source;
+    block->text = text + position;
+    block->starts = malloc(sizeof(int) * block->rowCount);
+    source->refs++;
+
+    off_t blockStart = position;
+    for (j = 0; j < block->rowCount; j++)
+    {
+      editorRow *row = &Cedit.row[first + j];
+      memset(row, 0, sizeof(editorRow));
+      row->index = first + j;
+      row->diskRow = -1;
+      row->bracketNode = -1;
+      row->size = rows[first + j].size;
+      row->hlOpenComment = rows[first + j].flags & 1;
+      row->saveSlot = -1;
+      row->cold = block;
+      row->coldSlot = j;
+      block->starts[j] = position - blockStart;
+      position += rows[first + j].size + (rows[first + j].flags >> 8);
+    }
+    block->rawSize = position - blockStart;
+  }
+  if (source->refs == 0)
+  {
+    free(text);
+    free(source);
+  }
+
+  for (j = 0; j < (int)header->bracketNum; j++)
+    if (brackets[j].row < (uint32_t)rowNum)
+      Cedit.row[brackets[j].row].brackets = brackets[j].brackets;
+
+  Cedit.rowNum = rowNum;
+  Cedit.bracketTreeDirty = 1;
+  Cedit.lastRowOpen = header->lastRowOpen;
+  Cedit.fileOffset = st->st_size;
+
+  int canonical = !header->lastRowOpen;
+  for (j = 0; j < rowNum && canonical; j++)
+    canonical = rows[j].flags >> 8 == 1;
+  ceditDiskReset(canonical);
+  return 1;
+}
+
+/*** FILE WATCHING ***/
+
+/*
+  The directory holding the file is watched rather than the file itself,
+  so replacing it with a rename (as generators and git checkout do) is
+  noticed as well. Events are confirmed against the stat taken when the
+  file was last read or written, which also filters out our own saves.
+*/
+
+uint64_t ceditHash(const char *s, int length)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  int j;
+  for (j = 0; j < length; j++)
+  {
+    hash ^= (unsigned char)s[j];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t ceditHashContent(const char *s, size_t length)
+{
+  // ceditHash waits on a multiply for every byte; a whole file is taken a
+  // word at a time on four lanes that do not wait on each other
+  uint64_t lanes[4] = {14695981039346656037ULL, 0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+                       0x165667b19e3779f9ULL};
+  size_t position;
+  int k;
+  for (position = 0; position + 32 <= length; position += 32)
+    for (k = 0; k < 4; k++)
+    {
+      uint64_t word;
+      memcpy(&word, s + position + k * 8, 8);
+      lanes[k] = (lanes[k] ^ word) * 0xff51afd7ed558ccdULL;
+      lanes[k] ^= lanes[k] >> 32;
+    }
+
+  uint64_t hash = ceditHash(s + position, length - position) ^ length;
+  for (k = 0; k < 4; k++)
+  {
+    hash = (hash ^ lanes[k]) * 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+void ceditWatchFile()
+{
+  Cedit.diskChanged = 0;
+  if (stat(Cedit.fileName, &Cedit.diskStat) == -1)
+    memset(&Cedit.diskStat, 0, sizeof(Cedit.diskStat));
+  Cedit.fileOffset = Cedit.diskStat.st_size;
+
+  if (ceditHeadless)
+    return;
+  if (Cedit.inotifyFd == -1)
+  {
+    Cedit.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (Cedit.inotifyFd == -1)
+      return;
+    ceditWatchFd(Cedit.inotifyFd, ceditFileEventHandler);
+  }
+  if (Cedit.inotifyWatch != -1)
+    inotify_rm_watch(Cedit.inotifyFd, Cedit.inotifyWatch);
+
+  char *slash = strrchr(Cedit.fileName, '/');
+  char *directory = slash ? strndup(Cedit.fileName, slash - Cedit.fileName + 1) : strdup(".");
+  Cedit.inotifyWatch = inotify_add_watch(Cedit.inotifyFd, directory,
+                                         IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO |
+                                             IN_CREATE | IN_DELETE | IN_MOVED_FROM);
+  free(directory);
+}
+
+int ceditDiskStatChanged(struct stat *st)
+{
+  return st->st_ino != Cedit.diskStat.st_ino || st->st_dev != Cedit.diskStat.st_dev ||
+         st->st_size != Cedit.diskStat.st_size ||
+         st->st_mtim.tv_sec != Cedit.diskStat.st_mtim.tv_sec ||
+         st->st_mtim.tv_nsec != Cedit.diskStat.st_mtim.tv_nsec;
+}
+
+void ceditFileEventHandler(int fd)
+{
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char *slash = Cedit.fileName ? strrchr(Cedit.fileName, '/') : NULL;
+  char *baseName = slash ? slash + 1 : Cedit.fileName;
+  int relevant = 0;
+  ssize_t length;
+
+  while ((length = read(fd, events, sizeof(events))) > 0)
+  {
+    char *p = events;
+    while (p < events + length)
+    {
+      struct inotify_event *event = (struct inotify_event *)p;
+      if (baseName && event->len && !strcmp(event->name, baseName))
+        relevant = 1;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+
+  if (!relevant || Cedit.saving)
+    return;
+  if (Cedit.hex.map)
+    ceditHexCheck();
+  if (Cedit.follow)
+  {
+    ceditFollowUpdate();
+    return;
+  }
+  if (Cedit.diskChanged)
+    return;
+
+  struct stat st;
+  if (stat(Cedit.fileName, &st) == -1)
+  {
+    Cedit.diskChanged = 1;
+    ceditSetStatusMessage("File was removed from disk");
+  }
+  else if (ceditDiskStatChanged(&st))
+  {
+    Cedit.diskChanged = 1;
+    ceditSetStatusMessage("File changed on disk. Press ctrl+O to reload");
+  }
+}
+
+/*
+  Follow mode treats the file as a growing log: only the bytes past
+  fileOffset are read and appended as rows. A file that shrank was
+  truncated and is read again from the start, unless that would throw away
+  edits, in which case following stops instead; a different inode under the
+  same name means it was rotated, and the new file is appended after the
+  rows of the old one.
+*/
+void ceditFollowUpdate()
+{
+  struct stat st;
+  if (stat(Cedit.fileName, &st) == -1)
+    return;
+
+  int rotated = 0;
+  if (st.st_ino != Cedit.diskStat.st_ino || st.st_dev != Cedit.diskStat.st_dev)
+  {
+    rotated = 1;
+    Cedit.fileOffset = 0;
+    Cedit.lastRowOpen = 0;
+    Cedit.pendingReturn = 0;
+    ceditSetStatusMessage("%s was rotated, following the new file", Cedit.fileName);
+  }
+  else if (st.st_size < Cedit.fileOffset && ceditModified())
+  {
+    // Reading it again would drop the edits; ctrl+O reloads, and asks first
+    Cedit.follow = 0;
+    Cedit.diskChanged = 1;
+    ceditSetStatusMessage("%s was truncated. Stopped following; ctrl+O reloads", Cedit.fileName);
+    return;
+  }
+  else if (st.st_size < Cedit.fileOffset)
+  {
+    while (Cedit.rowNum > 0)
+      ceditDeleteRow(Cedit.rowNum - 1);
+    Cedit.cursorX = Cedit.cursorY = 0;
+    Cedit.fileOffset = 0;
+    Cedit.lastRowOpen = 0;
+    Cedit.pendingReturn = 0;
+    Cedit.modified = 0;
+    ceditDiskReset(0);
+    ceditSetStatusMessage("%s was truncated", Cedit.fileName);
+  }
+  // Whatever the writer did, saves can no longer patch the file in place
+  Cedit.disk.canonical = 0;
+  Cedit.diskStat = st;
+  if (st.st_size <= Cedit.fileOffset)
+    return;
+
+  int fd = open(Cedit.fileName, O_RDONLY);
+  if (fd == -1)
+    return;
+
+  // What is appended is what the file now holds, so it starts out clean;
+  // after a rotation the rows above are not in the file any more
+  int open = Cedit.lastRowOpen && Cedit.rowNum > 0;
+  int grown = open && Cedit.row[Cedit.rowNum - 1].clean && Cedit.rowNum == Cedit.disk.rowNum;
+  int first = Cedit.rowNum - grown;
+
+  int pinned = Cedit.cursorY >= Cedit.rowNum - 1;
+  char chunk[CEDIT_STREAM_CHUNK];
+  ssize_t length;
+  while ((length = pread(fd, chunk, sizeof(chunk), Cedit.fileOffset)) > 0)
+  {
+    ceditAppendText(chunk, length);
+    Cedit.fileOffset += length;
+  }
+  close(fd);
+  if (!rotated)
+    ceditDiskAppend(first, grown);
+
+  if (pinned && Cedit.rowNum > 0)
+  {
+    Cedit.cursorY = Cedit.rowNum - 1;
+    Cedit.cursorX = 0;
+  }
+}
+
+void ceditToggleFollow()
+{
+  if (Cedit.fileName == NULL || Cedit.inotifyWatch == -1)
+  {
+    ceditSetStatusMessage("Follow mode needs a file on disk");
+    return;
+  }
+  if (Cedit.hex.map)
+  {
+    ceditSetStatusMessage("Not available in the hex view");
+    return;
+  }
+  Cedit.follow = !Cedit.follow;
+  if (Cedit.follow && Cedit.rowNum > 0)
+  {
+    Cedit.cursorY = Cedit.rowNum - 1;
+    Cedit.cursorX = 0;
+  }
+  if (Cedit.follow)
+    ceditFollowUpdate();
+  ceditSetStatusMessage(Cedit.follow ? "Following %s" : "Stopped following %s", Cedit.fileName);
+}
+
+int ceditReadLines(char *fileName, char ***lines, int **lengths)
+{
+  FILE *fp = fopen(fileName, "r");
+  if (!fp)
+    return -1;
+
+  int lineNum = 0, lineCapacity = 0;
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t lineLength;
+  *lines = NULL;
+  *lengths = NULL;
+  while ((lineLength = getline(&line, &lineCap, fp)) != -1)
+  {
+    while (lineLength > 0 && (line[lineLength - 1] == '\n' ||
+                              line[lineLength - 1] == '\r'))
+      lineLength--;
+    if (lineNum == lineCapacity)
+    {
+      lineCapacity = lineCapacity ? lineCapacity * 2 : 1024;
+      *lines = realloc(*lines, sizeof(char *) * lineCapacity);
+      *lengths = realloc(*lengths, sizeof(int) * lineCapacity);
+    }
+    (*lines)[lineNum] = malloc(lineLength + 1);
+    memcpy((*lines)[lineNum], line, lineLength);
+    (*lines)[lineNum][lineLength] = '\0';
+    (*lengths)[lineNum] = lineLength;
+    lineNum++;
+  }
+  free(line);
+  fclose(fp);
+  return lineNum;
+}
+
+/*
+  Brings the rows in line with the new file contents, touching only the
+  rows that differ. Common leading and trailing lines are skipped, and the
+  rest is diffed with Myers' algorithm on line hashes, each match checked
+  against the text so that a collision cannot keep a stale row. The edit
+  script is applied from the bottom up so row indices stay valid while it
+  runs. If the files differ in more than CEDIT_DIFF_LIMIT lines, the whole
+  middle section is replaced instead.
+*/
+void ceditApplyDiff(char **lines, int *lengths, int lineNum)
+{
+  int start = 0;
+  while (start < Cedit.rowNum && start < lineNum && Cedit.row[start].size == lengths[start] &&
+         !memcmp(ceditRowText(&Cedit.row[start]), lines[start], lengths[start]))
+    start++;
+  int oldEnd = Cedit.rowNum, newEnd = lineNum;
+  while (oldEnd > start && newEnd > start && Cedit.row[oldEnd - 1].size == lengths[newEnd - 1] &&
+         !memcmp(ceditRowText(&Cedit.row[oldEnd - 1]), lines[newEnd - 1], lengths[newEnd - 1]))
+  {
+    oldEnd--;
+    newEnd--;
+  }
+
+  int n = oldEnd - start, m = newEnd - start;
+  uint64_t *oldHash = malloc(sizeof(uint64_t) * (n + 1));
+  uint64_t *newHash = malloc(sizeof(uint64_t) * (m + 1));
+  int j;
+  for (j = 0; j < n; j++)
+    oldHash[j] = ceditHash(ceditRowText(&Cedit.row[start + j]), Cedit.row[start + j].size);
+  for (j = 0; j < m; j++)
+    newHash[j] = ceditHash(lines[start + j], lengths[start + j]);
+
+  int limit = n + m < CEDIT_DIFF_LIMIT ? n + m : CEDIT_DIFF_LIMIT;
+  int *v = malloc(sizeof(int) * (2 * limit + 3));
+  int *trace = malloc(sizeof(int) * (limit + 1) * (limit + 1));
+  int distance = -1, d, k;
+  v[limit + 2] = 0;
+  for (d = 0; d <= limit && distance == -1; d++)
+  {
+    memcpy(&trace[d * d], &v[limit + 1 - d], sizeof(int) * (2 * d + 1));
+    for (k = -d; k <= d; k += 2)
+    {
+      int x;
+      if (k == -d || (k != d && v[limit + 1 + k - 1] < v[limit + 1 + k + 1]))
+        x = v[limit + 1 + k + 1];
+      else
+        x = v[limit + 1 + k - 1] + 1;
+      int y = x - k;
+      while (x < n && y < m && oldHash[x] == newHash[y] &&
+             Cedit.row[start + x].size == lengths[start + y] &&
+             !memcmp(ceditRowText(&Cedit.row[start + x]), lines[start + y], lengths[start + y]))
+      {
+        x++;
+        y++;
+      }
+      v[limit + 1 + k] = x;
+      if (x >= n && y >= m)
+      {
+        distance = d;
+        break;
+      }
+    }
+  }
+
+  // New-document positions whose highlighting may depend on changed rows
+  int *touched = malloc(sizeof(int) * (n + m + 2));
+  int touchedNum = 0;
+
+  if (distance == -1)
+  {
+    for (j = n - 1; j >= 0; j--)
+      ceditDeleteRow(start + j);
+    for (j = m - 1; j >= 0; j--)
+      ceditInsertRow(start, lines[start + j], lengths[start + j]);
+    if (Cedit.cursorY >= start + n)
+      Cedit.cursorY += m - n;
+    else if (Cedit.cursorY > start + m)
+      Cedit.cursorY = start + m;
+    touched[touchedNum++] = start + m;
+    touched[touchedNum++] = start;
+  }
+  else
+  {
+    int x = n, y = m;
+    for (d = distance; d > 0; d--)
+    {
+      int *previous = &trace[d * d + d];
+      k = x - y;
+      int previousK;
+      if (k == -d || (k != d && previous[k - 1] < previous[k + 1]))
+        previousK = k + 1;
+      else
+        previousK = k - 1;
+      int previousX = previous[previousK];
+      int previousY = previousX - previousK;
+
+      if (previousK == k + 1)
+      {
+        ceditInsertRow(start + previousX, lines[start + previousY], lengths[start + previousY]);
+        if (start + previousX < Cedit.cursorY)
+          Cedit.cursorY++;
+      }
+      else
+      {
+        ceditDeleteRow(start + previousX);
+        if (start + previousX < Cedit.cursorY)
+          Cedit.cursorY--;
+      }
+      touched[touchedNum++] = start + previousY;
+      x = previousX;
+      y = previousY;
+    }
+  }
+
+  // The edit script runs bottom-up; redo the highlighting top-down
+  for (j = touchedNum - 1; j >= 0; j--)
+  {
+    if (touched[j] < Cedit.rowNum && (j == touchedNum - 1 || touched[j] != touched[j + 1]))
+      ceditUpdateSyntax(&Cedit.row[touched[j]]);
+  }
+
+  free(touched);
+  free(trace);
+  free(v);
+  free(newHash);
+  free(oldHash);
+}
+
+void ceditReload()
+{
+  if (Cedit.fileName == NULL)
+    return;
+  if (Cedit.saving)
+  {
+    ceditSetStatusMessage("Wait for the save to finish before reloading");
+    return;
+  }
+  if (ceditModified())
+  {
+    char *answer = ceditPrompt("Discard unsaved changes and reload? (y/n): %s", NULL);
+    int discard = answer && (answer[0] == 'y' || answer[0] == 'Y');
+    free(answer);
+    if (!discard)
+      return;
+  }
+
+  char **lines;
+  int *lengths;
+  int lineNum = ceditReadLines(Cedit.fileName, &lines, &lengths);
+  if (lineNum == -1)
+  {
+    ceditSetStatusMessage("Can't reload! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  ceditApplyDiff(lines, lengths, lineNum);
+
+  int j;
+  for (j = 0; j < lineNum; j++)
+    free(lines[j]);
+  free(lines);
+  free(lengths);
+
+  if (Cedit.cursorY > Cedit.rowNum)
+    Cedit.cursorY = Cedit.rowNum;
+  int rowLength = Cedit.cursorY < Cedit.rowNum ? Cedit.row[Cedit.cursorY].size : 0;
+  if (Cedit.cursorX > rowLength)
+    Cedit.cursorX = rowLength;
+  Cedit.modified = 0;
+  ceditDiskReset(0);
+  ceditWatchFile();
+  ceditSetStatusMessage("Reloaded %s", Cedit.fileName);
+}
+
+/*** FIND OPERATIONS ***/
+
+// Every search goes through here: find, replace, batch edits and project search
+char *ceditSearch(char *text, int length, char *query, int queryLength)
+{
+  if (queryLength == 0 || length < queryLength)
+    return NULL;
+  return memmem(text, length, query, queryLength);
+}
+
+void ceditFindCallback(char *query, int key)
+{
+  static int lastMatch = -1;
+  static int direction = 1;
+
+  // The match is drawn as an overlay; the row's own spans are left alone
+  Cedit.matchRow = -1;
+
+  if (key == '\r' || key == '\x1b')
+  {
+    lastMatch = -1;
+    direction = 1;
+    return;
+  }
+  else if (key == ARROW_RIGHT || key == ARROW_DOWN)
+  {
+    direction = 1;
+  }
+  else if (key == ARROW_LEFT || key == ARROW_UP)
+  {
+    direction = -1;
+  }
+  else
+  {
+    lastMatch = -1;
+    direction = 1;
+  }
+
+  if (lastMatch == -1)
+    direction = 1;
+  int current = lastMatch;
+  int i;
+  for (i = 0; i < Cedit.rowNum; i++)
+  {
+    current += direction;
+    if (current == -1)
+      current = Cedit.rowNum - 1;
+    else if (current == Cedit.rowNum)
+      current = 0;
+    if (ceditFoldHidden(current))
+    {
+      // Collapsed rows are passed over whole
+      int next = ceditFoldStep(current - direction, direction);
+      i += next > current ? next - current : current - next;
+      current = next == Cedit.rowNum ? 0 : next;
+      if (i >= Cedit.rowNum)
+        break;
+    }
+
+    editorRow *row = &Cedit.row[current];
+    if (row->cold)
+    {
+      // Without tabs the render is the text itself, so check before unpacking
+      char *text = ceditRowText(row);
+      if (!memchr(text, '\t', row->size) && !ceditSearch(text, row->size, query, strlen(query)))
+        continue;
+    }
+    ceditRowWarm(row);
+    char *render = row->chunks ? ceditChunkJoin(row, 1) : row->render;
+    char *match = ceditSearch(render, row->rSize, query, strlen(query));
+    if (match)
+    {
+      lastMatch = current;
+      Cedit.cursorY = current;
+      int matchX = match - render;
+      Cedit.cursorX = ceditRowCursorTransformRxToCx(row, matchX);
+      Cedit.rowOff = Cedit.rowNum;
+
+      Cedit.matchRow = current;
+      Cedit.matchColumn = matchX;
+      Cedit.matchLength = strlen(query);
+      break;
+    }
+  }
+}
+
+void ceditFind()
+{
+  int savedCursorX = Cedit.cursorX;
+  int savedCursorY = Cedit.cursorY;
+  int savedColumn = Cedit.columnOff;
+  int savedRow = Cedit.rowOff;
+
+  char *query = ceditPrompt("Search: %s (Use ESC/Arrows/Enter)",
+                            ceditFindCallback);
+
+  if (query)
+  {
+    free(query);
+  }
+  else
+  {
+    Cedit.cursorX = savedCursorX;
+    Cedit.cursorY = savedCursorY;
+    Cedit.columnOff = savedColumn;
+    Cedit.rowOff = savedRow;
+  }
+}
+
+int ceditReplaceInRow(editorRow *row, char *query, int queryLength, char *replacement, int replacementLength)
+{
+  int count = 0;
+  char *match = ceditRowText(row);
+  char *end = match + row->size;
+  while ((match = ceditSearch(match, end - match, query, queryLength)) != NULL)
+  {
+    count++;
+    match += queryLength;
+  }
+  if (count == 0)
+    return 0;
+
+  ceditRowWarm(row);
+  ceditRowFlatten(row);
+  end = row->characters + row->size;
+
+  int size = row->size + count * (replacementLength - queryLength);
+  char *characters = malloc(size + 1);
+  char *p = characters;
+  char *from = row->characters;
+  while ((match = ceditSearch(from, end - from, query, queryLength)) != NULL)
+  {
+    memcpy(p, from, match - from);
+    p += match - from;
+    memcpy(p, replacement, replacementLength);
+    p += replacementLength;
+    from = match + queryLength;
+  }
+  memcpy(p, from, end - from);
+  characters[size] = '\0';
+
+  ceditRowSetCharacters(row, characters, size);
+  ceditUpdateRow(row);
+  return count;
+}
+
+void ceditReplaceAll()
+{
+  char *query = ceditPrompt("Replace: %s (ESC to cancel)", NULL);
+  if (query == NULL)
+    return;
+  char *replacement = ceditPromptInput("Replace with: %s (Enter alone deletes, ESC to cancel)", NULL, 1);
+  if (replacement == NULL)
+  {
+    free(query);
+    return;
+  }
+
+  int rows;
+  int count = ceditReplaceRows(query, strlen(query), replacement, strlen(replacement), &rows);
+  ceditSetStatusMessage("Replaced %d occurrences on %d lines", count, rows);
+  free(query);
+  free(replacement);
+}
+
+int ceditReplaceRows(char *query, int queryLength, char *replacement, int replacementLength, int *rows)
+{
+  int count = 0;
+  int j;
+
+  *rows = 0;
+  Cedit.syntaxDeferred = 1;
+  for (j = 0; j < Cedit.rowNum; j++)
+  {
+    int replaced = ceditReplaceInRow(&Cedit.row[j], query, queryLength, replacement, replacementLength);
+    if (replaced)
+    {
+      count += replaced;
+      (*rows)++;
+    }
+  }
+  ceditSyntaxFlush();
+
+  if (count)
+    Cedit.modified++;
+  if (Cedit.cursorY < Cedit.rowNum && Cedit.cursorX > Cedit.row[Cedit.cursorY].size)
+    Cedit.cursorX = Cedit.row[Cedit.cursorY].size;
+  return count;
+}
+
+/*** LINE TRANSFORMS ***/
+
+/*
+  ctrl+X runs a command over a range of lines (the whole file unless it
+  starts with N,M): sort, uniq, keep or drop the lines containing a text,
+  and indent. Sorting and filtering never copy text; they work out the
+  new order of the rows and move the editorRow descriptors into it, and
+  only the rows whose comment state changed get highlighted again, once,
+  at the end. The keys, the sort and the matching are split over one
+  worker per CPU; sorting is a stable merge sort, slices sorted in
+  parallel and then merged pairwise.
+*/
+
+int ceditTransformParse(char *command, struct ceditTransform *transform)
+{
+  memset(transform, 0, sizeof(*transform));
+  transform->first = transform->last = -1;
+  while (*command == ' ')
+    command++;
+  if (isdigit((unsigned char)*command))
+  {
+    char *end;
+    long first = strtol(command, &end, 10);
+    if (*end != ',' || !isdigit((unsigned char)end[1]))
+      return -1;
+    long last = strtol(end + 1, &end, 10);
+    if (first < 1 || last < first || last > INT32_MAX)
+      return -1;
+    transform->first = first - 1;
+    transform->last = last;
+    for (command = end; *command == ' '; command++)
+      ;
+  }
+
+  int length = strcspn(command, " ");
+  char *argument = command + length;
+  while (*argument == ' ')
+    argument++;
+
+  if (length == 4 && !strncmp(command, "sort", 4))
+  {
+    transform->operation = TRANSFORM_SORT;
+    while (*argument)
+    {
+      if (*argument == ' ')
+      {
+        argument++;
+        continue;
+      }
+      if (*argument++ != '-')
+        return -1;
+      while (*argument && *argument != ' ')
+      {
+        char option = *argument++;
+        if (option == 'n')
+          transform->numeric = 1;
+        else if (option == 'r')
+          transform->reverse = 1;
+        else if (option == 'k' || option == 't')
+        {
+          while (*argument == ' ')
+            argument++;
+          if (*argument == '\0')
+            return -1;
+          if (option == 't')
+            transform->separator = *argument++;
+          else
+          {
+            transform->field = strtol(argument, &argument, 10);
+            if (transform->field < 1)
+              return -1;
+          }
+          break;
+        }
+        else
+          return -1;
+      }
+    }
+  }
+  else if (length == 4 && !strncmp(command, "uniq", 4) && *argument == '\0')
+    transform->operation = TRANSFORM_UNIQ;
+  else if (length == 4 && (!strncmp(command, "keep", 4) || !strncmp(command, "drop", 4)) && *argument)
+  {
+    transform->operation = command[0] == 'k' ? TRANSFORM_KEEP : TRANSFORM_DROP;
+    transform->text = argument;
+    transform->length = strlen(argument);
+  }
+  else if (length == 6 && !strncmp(command, "indent", 6) && *argument)
+  {
+    char *end;
+    transform->operation = TRANSFORM_INDENT;
+    transform->amount = strtol(argument, &end, 10);
+    if (*end != '\0' || transform->amount == 0)
+      return -1;
+  }
+  else
+    return -1;
+  return 0;
+}
+
+int ceditTransformWorkers(int count)
+{
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (workers > CEDIT_TRANSFORM_MAX_WORKERS)
+    workers = CEDIT_TRANSFORM_MAX_WORKERS;
+  if (workers > count / CEDIT_TRANSFORM_SLICE)
+    workers = count / CEDIT_TRANSFORM_SLICE;
+  return workers < 1 ? 1 : workers;
+}
+
+void ceditParallel(void *(*worker)(void *), struct ceditTransformJob *jobs, int jobNum)
+{
+  // Workers only see their job, never Cedit, which belongs to this thread
+  pthread_t threads[CEDIT_TRANSFORM_MAX_WORKERS];
+  int started = 0;
+  int j;
+  for (j = 1; j < jobNum; j++)
+  {
+    if (pthread_create(&threads[started], NULL, worker, &jobs[j]) != 0)
+    {
+      worker(&jobs[j]);
+      continue;
+    }
+    started++;
+  }
+  worker(&jobs[0]);
+  for (j = 0; j < started; j++)
+    pthread_join(threads[j], NULL);
+}
+
+double ceditSortNumber(char *s, int length)
+{
+  // Like sort -n: an optional sign, digits and a fraction; anything else is 0
+  double value = 0, scale = 1;
+  int negative = 0;
+  int j = 0;
+  while (j < length && (s[j] == ' ' || s[j] == '\t'))
+    j++;
+  if (j < length && (s[j] == '-' || s[j] == '+'))
+    negative = s[j++] == '-';
+  for (; j < length && isdigit((unsigned char)s[j]); j++)
+    value = value * 10 + (s[j] - '0');
+  if (j < length && s[j] == '.')
+    for (j++; j < length && isdigit((unsigned char)s[j]); j++)
+      value += (s[j] - '0') * (scale /= 10);
+  return negative ? -value : value;
+}
+
+int ceditSortCompare(struct ceditTransform *transform, struct ceditSortKey *a, struct ceditSortKey *b)
+{
+  int result;
+  if (transform->numeric)
+    result = (a->key.number > b->key.number) - (a->key.number < b->key.number);
+  else if (a->key.prefix != b->key.prefix)
+    result = a->key.prefix < b->key.prefix ? -1 : 1;
+  else
+  {
+    int length = a->length < b->length ? a->length : b->length;
+    result = length > 8 ? memcmp(a->text + 8, b->text + 8, length - 8) : 0;
+    if (result == 0)
+      result = (a->length > b->length) - (a->length < b->length);
+  }
+  return transform->reverse ? -result : result;
+}
+
+void ceditSortMerge(struct ceditTransform *transform, struct ceditSortKey *left, int leftNum,
+                    struct ceditSortKey *right, int rightNum, struct ceditSortKey *out)
+{
+  // Ties go to the left, which keeps the sort stable
+  while (leftNum && rightNum)
+  {
+    if (ceditSortCompare(transform, right, left) < 0)
+    {
+      *out++ = *right++;
+      rightNum--;
+    }
+    else
+    {
+      *out++ = *left++;
+      leftNum--;
+    }
+  }
+  memcpy(out, left, sizeof(struct ceditSortKey) * leftNum);
+  memcpy(out + leftNum, right, sizeof(struct ceditSortKey) * rightNum);
+}
+
+void ceditSortSlice(struct ceditTransform *transform, struct ceditSortKey *keys, struct ceditSortKey *scratch, int count)
+{
+  // Insertion sort for runs of 16, then merges back and forth between the buffers
+  int j, k;
+  for (j = 0; j < count; j += 16)
+  {
+    int end = j + 16 < count ? j + 16 : count;
+    for (k = j + 1; k < end; k++)
+    {
+      struct ceditSortKey key = keys[k];
+      int at = k;
+      while (at > j && ceditSortCompare(transform, &key, &keys[at - 1]) < 0)
+      {
+        keys[at] = keys[at - 1];
+        at--;
+      }
+      keys[at] = key;
+    }
+  }
+
+  struct ceditSortKey *from = keys, *to = scratch;
+  int width;
+  for (width = 16; width < count; width *= 2)
+  {
+    for (j = 0; j < count; j += 2 * width)
+    {
+      int leftNum = j + width < count ? width : count - j;
+      int rightNum = j + 2 * width < count ? width : count - j - leftNum;
+      ceditSortMerge(transform, from + j, leftNum, from + j + leftNum, rightNum, to + j);
+    }
+    struct ceditSortKey *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != keys)
+    memcpy(keys, from, sizeof(struct ceditSortKey) * count);
+}
+
+void *ceditSortWorker(void *argument)
+{
+  struct ceditTransformJob *job = argument;
+  struct ceditTransform *transform = job->transform;
+  int j;
+  for (j = job->from; j < job->to; j++)
+  {
+    char *text = job->rows[j].characters;
+    int length = job->rows[j].size;
+
+    // The key runs from the start of its field to the end of it
+    if (transform->field)
+    {
+      int field = 1, at = 0;
+      while (field < transform->field && at < length)
+      {
+        if (transform->separator)
+        {
+          char *next = memchr(text + at, transform->separator, length - at);
+          at = next ? next - text + 1 : length;
+        }
+        else
+        {
+          while (at < length && (text[at] == ' ' || text[at] == '\t'))
+            at++;
+          while (at < length && text[at] != ' ' && text[at] != '\t')
+            at++;
+        }
+        field++;
+      }
+      if (!transform->separator)
+        while (at < length && (text[at] == ' ' || text[at] == '\t'))
+          at++;
+      int end = at;
+      if (transform->separator)
+      {
+        char *next = memchr(text + at, transform->separator, length - at);
+        end = next ? next - text : length;
+      }
+      else
+        while (end < length && text[end] != ' ' && text[end] != '\t')
+          end++;
+      text += at;
+      length = end - at;
+    }
+
+    struct ceditSortKey *key = &job->keys[j];
+    key->text = text;
+    key->length = length;
+    key->row = j;
+    if (transform->numeric)
+      key->key.number = ceditSortNumber(text, length);
+    else
+    {
+      key->key.prefix = 0;
+      int k;
+      for (k = 0; k < 8; k++)
+        key->key.prefix = key->key.prefix << 8 | (k < length ? (unsigned char)text[k] : 0);
+    }
+  }
+
+  ceditSortSlice(transform, job->keys + job->from, job->scratch + job->from, job->to - job->from);
+  return NULL;
+}
+
+void *ceditMergeWorker(void *argument)
+{
+  struct ceditTransformJob *job = argument;
+  ceditSortMerge(job->transform, job->keys + job->from, job->middle - job->from,
+                 job->keys + job->middle, job->to - job->middle, job->scratch + job->from);
+  return NULL;
+}
+
+void *ceditFilterWorker(void *argument)
+{
+  struct ceditTransformJob *job = argument;
+  struct ceditTransform *transform = job->transform;
+  int j;
+  for (j = job->from; j < job->to; j++)
+  {
+    editorRow *row = &job->rows[j];
+    if (transform->operation == TRANSFORM_UNIQ)
+      job->dropped[j] = j > 0 && row->size == row[-1].size &&
+                        !memcmp(row->characters, row[-1].characters, row->size);
+    else
+      job->dropped[j] = (ceditSearch(row->characters, row->size, transform->text, transform->length) != NULL) ==
+                        (transform->operation == TRANSFORM_DROP);
+  }
+  return NULL;
+}
+
+int ceditTransformSort(struct ceditTransform *transform, int first, int count)
+{
+  struct ceditSortKey *keys = malloc(sizeof(struct ceditSortKey) * count);
+  struct ceditSortKey *scratch = malloc(sizeof(struct ceditSortKey) * count);
+  struct ceditTransformJob jobs[CEDIT_TRANSFORM_MAX_WORKERS];
+  int bounds[CEDIT_TRANSFORM_MAX_WORKERS + 1];
+  int workers = ceditTransformWorkers(count);
+  int j;
+  if (!keys || !scratch)
+    terminateProgram("Memory Error!");
+
+  for (j = 0; j <= workers; j++)
+    bounds[j] = (long long)count * j / workers;
+  for (j = 0; j < workers; j++)
+  {
+    jobs[j].transform = transform;
+    jobs[j].rows = &Cedit.row[first];
+    jobs[j].keys = keys;
+    jobs[j].scratch = scratch;
+    jobs[j].from = bounds[j];
+    jobs[j].to = bounds[j + 1];
+  }
+  ceditParallel(ceditSortWorker, jobs, workers);
+
+  // Sorted slices are merged two by two, half as many each round
+  int slices = workers;
+  while (slices > 1)
+  {
+    int merges = 0;
+    for (j = 0; j + 1 < slices; j += 2)
+    {
+      jobs[merges].keys = keys;
+      jobs[merges].scratch = scratch;
+      jobs[merges].from = bounds[j];
+      jobs[merges].middle = bounds[j + 1];
+      jobs[merges].to = bounds[j + 2];
+      merges++;
+    }
+    if (slices % 2)
+      memcpy(scratch + bounds[slices - 1], keys + bounds[slices - 1],
+             sizeof(struct ceditSortKey) * (bounds[slices] - bounds[slices - 1]));
+    ceditParallel(ceditMergeWorker, jobs, merges);
+
+    for (j = 0; j < slices; j += 2)
+      bounds[j / 2] = bounds[j];
+    bounds[(slices + 1) / 2] = count;
+    slices = (slices + 1) / 2;
+    struct ceditSortKey *swap = keys;
+    keys = scratch;
+    scratch = swap;
+  }
+
+  int *order = malloc(sizeof(int) * count);
+  for (j = 0; j < count; j++)
+    order[j] = keys[j].row;
+  free(keys);
+  free(scratch);
+  ceditTransformCommit(first, count, order, count);
+  free(order);
+  return count;
+}
+
+int ceditTransformFilter(struct ceditTransform *transform, int first, int count)
+{
+  unsigned char *dropped = malloc(count);
+  struct ceditTransformJob jobs[CEDIT_TRANSFORM_MAX_WORKERS];
+  int workers = ceditTransformWorkers(count);
+  int j;
+  for (j = 0; j < workers; j++)
+  {
+    jobs[j].transform = transform;
+    jobs[j].rows = &Cedit.row[first];
+    jobs[j].dropped = dropped;
+    jobs[j].from = (long long)count * j / workers;
+    jobs[j].to = (long long)count * (j + 1) / workers;
+  }
+  ceditParallel(ceditFilterWorker, jobs, workers);
+
+  int *order = malloc(sizeof(int) * count);
+  int kept = 0;
+  for (j = 0; j < count; j++)
+    if (!dropped[j])
+      order[kept++] = j;
+  free(dropped);
+  if (kept < count)
+    ceditTransformCommit(first, count, order, kept);
+  free(order);
+  return count - kept;
+}
+
+void ceditTransformCommit(int first, int count, int *order, int kept)
+{
+  // Row first + j takes the row at first + order[j]; rows left out are deleted
+  Cedit.bracketTreeDirty = 1;
+  editorRow *rows = &Cedit.row[first];
+  editorRow *moved = malloc(sizeof(editorRow) * (kept ? kept : 1));
+  unsigned char *start = malloc(count);
+  unsigned char *used = calloc(count, 1);
+  int end = rows[count - 1].hlOpenComment;
+  int j;
+
+  // The comment state each row was highlighted in, to find the ones to redo
+  for (j = 0; j < count; j++)
+    start[j] = first + j > 0 && Cedit.row[first + j - 1].hlOpenComment;
+  for (j = 0; j < kept; j++)
+  {
+    moved[j] = rows[order[j]];
+    used[order[j]] = 1;
+  }
+  for (j = 0; j < count; j++)
+  {
+    if (used[j])
+      continue;
+    // As in ceditDeleteRow, the disk line's hash outlives the row
+    editorRow *row = &rows[j];
+    int diskRow = row->changed ? -1 : row->diskRow;
+    if (diskRow >= 0 && !Cedit.disk.hashes[diskRow] && !row->chunks)
+      Cedit.disk.hashes[diskRow] = ceditHash(ceditRowText(row), row->size) | 1;
+    Cedit.disk.cleanRows -= row->clean;
+    ceditFreeRow(row);
+  }
+  memcpy(rows, moved, sizeof(editorRow) * kept);
+  memmove(&rows[kept], &rows[count], sizeof(editorRow) * (Cedit.rowNum - first - count));
+  Cedit.rowNum -= count - kept;
+  free(moved);
+  free(used);
+
+  for (j = first; j < Cedit.rowNum; j++)
+    Cedit.row[j].index = j;
+  for (j = 0; j < Cedit.rowNum; j++)
+    ceditDiskCheck(&Cedit.row[j]);
+  ceditFoldSplice(first, first + count, kept - count);
+
+  if (Cedit.syntax)
+  {
+    Cedit.syntaxDeferred = 1;
+    for (j = first; j < first + kept; j++)
+      if ((j > 0 && Cedit.row[j - 1].hlOpenComment) != start[order[j - first]])
+        ceditUpdateSyntax(&Cedit.row[j]);
+    j = first + kept;
+    if (j < Cedit.rowNum && (j > 0 && Cedit.row[j - 1].hlOpenComment) != end)
+      ceditUpdateSyntax(&Cedit.row[j]);
+    ceditSyntaxFlush();
+  }
+  free(start);
+
+  Cedit.bracketRow = Cedit.bracketMatchRow = -1;
+  Cedit.matchRow = -1;
+  Cedit.modified++;
+}
+
+int ceditTransformIndent(struct ceditTransform *transform, int first, int count)
+{
+  int changed = 0;
+  int j;
+  Cedit.syntaxDeferred = 1;
+  for (j = first; j < first + count; j++)
+  {
+    editorRow *row = &Cedit.row[j];
+    char *text = ceditRowText(row);
+    int columns = 0, at = 0;
+    for (; at < row->size && (text[at] == ' ' || text[at] == '\t'); at++)
+      columns = text[at] == '\t' ? (columns / CEDIT_TAB_STOP + 1) * CEDIT_TAB_STOP : columns + 1;
+    int indent = columns + transform->amount < 0 ? 0 : columns + transform->amount;
+    if (at == row->size || indent == columns)
+      continue;
+
+    // Lines indented with tabs keep tabs, topped up with spaces
+    int tabs = text[0] == '\t' ? indent / CEDIT_TAB_STOP : 0;
+    int spaces = indent - tabs * CEDIT_TAB_STOP;
+    int size = tabs + spaces + row->size - at;
+    char *characters = malloc(size + 1);
+    memset(characters, '\t', tabs);
+    memset(characters + tabs, ' ', spaces);
+    memcpy(characters + tabs + spaces, text + at, row->size - at);
+    characters[size] = '\0';
+    ceditRowSetCharacters(row, characters, size);
+    ceditUpdateRow(row);
+    changed++;
+  }
+  ceditSyntaxFlush();
+  if (changed)
+    Cedit.modified++;
+  return changed;
+}
+
+int ceditTransformRun(struct ceditTransform *transform)
+{
+  // Returns the rows sorted, removed or reindented
+  int first = transform->first < 0 ? 0 : transform->first;
+  int last = transform->last < 0 || transform->last > Cedit.rowNum ? Cedit.rowNum : transform->last;
+  int count = last - first;
+  int result = 0;
+  int j;
+  if (count <= 0)
+    return 0;
+
+  // Workers read the text directly, so it has to be unpacked and in one piece
+  for (j = first; j < last; j++)
+  {
+    ceditRowWarm(&Cedit.row[j]);
+    ceditRowFlatten(&Cedit.row[j]);
+  }
+
+  if (transform->operation == TRANSFORM_SORT)
+    result = count > 1 ? ceditTransformSort(transform, first, count) : 0;
+  else if (transform->operation == TRANSFORM_INDENT)
+    result = ceditTransformIndent(transform, first, count);
+  else
+    result = ceditTransformFilter(transform, first, count);
+
+  if (Cedit.cursorY > Cedit.rowNum)
+    Cedit.cursorY = Cedit.rowNum;
+  if (Cedit.cursorY < Cedit.rowNum && Cedit.cursorX > Cedit.row[Cedit.cursorY].size)
+    Cedit.cursorX = Cedit.row[Cedit.cursorY].size;
+  else if (Cedit.cursorY == Cedit.rowNum)
+    Cedit.cursorX = 0;
+  return result;
+}
+
+void ceditTransformPrompt()
+{
+  char *command = ceditPrompt("Lines: %s ([N,M] sort|uniq|keep|drop|indent, ESC to cancel)", NULL);
+  if (command == NULL)
+    return;
+
+  struct ceditTransform transform;
+  if (ceditTransformParse(command, &transform) == -1)
+  {
+    ceditSetStatusMessage("Unknown command: %.60s", command);
+    free(command);
+    return;
+  }
+
+  long long start = ceditNanos();
+  int rows = ceditTransformRun(&transform);
+  double seconds = (ceditNanos() - start) / 1e9;
+  if (transform.operation == TRANSFORM_SORT)
+    ceditSetStatusMessage("Sorted %d lines in %.2f s", rows, seconds);
+  else if (transform.operation == TRANSFORM_INDENT)
+    ceditSetStatusMessage("Reindented %d lines", rows);
+  else
+    ceditSetStatusMessage("Removed %d lines in %.2f s", rows, seconds);
+  free(command);
+}
+
+/*** CLIPBOARD ***/
+
+/*
+  ctrl+A sets a mark, and the selection runs from there to the cursor;
+  without one, ctrl+C (copy) and ctrl+D (cut) take the cursor's line.
+  ctrl+V pastes at the cursor. There is one clipboard for the session, so
+  text moves between buffers.
+
+  Copying shares rows instead of copying their text: each whole row in the
+  selection hands its characters, render and spans to a reference-counted
+  ceditInterned, as --intern does for repeated lines, and the row and the
+  clipboard both point at it. ceditRowUnshare gives whichever side is
+  edited first a copy of its own. Only the partly selected rows at either
+  end, and long rows (kept in chunks), are copied.
+
+  Pasting splices one row descriptor per line, attached to the same
+  entries, and re-highlights only the rows that now start in a different
+  comment state (or another syntax) from the one they were highlighted
+  in, so a block of a million lines costs a memmove and one pass over the
+  rows, not a million inserts.
+*/
+
+struct ceditInterned *ceditClipboardText(char *s, int length)
+{
+  // Text on its own: no render, so it is laid out wherever it is pasted
+  struct ceditInterned *entry = calloc(1, sizeof(struct ceditInterned));
+  entry->refs = 1;
+  entry->size = length;
+  entry->inComment = -1;
+  entry->characters = malloc(length + 1);
+  memcpy(entry->characters, s, length);
+  entry->characters[length] = '\0';
+  return entry;
+}
+
+void ceditClipboardClear()
+{
+  int j;
+  for (j = 0; j < ceditClipboard.lineNum; j++)
+    ceditInternRelease(ceditClipboard.lines[j]);
+  free(ceditClipboard.lines);
+  ceditClipboard.lines = NULL;
+  ceditClipboard.lineNum = 0;
+}
+
+void ceditToggleMark()
+{
+  if (Cedit.markRow != -1)
+  {
+    Cedit.markRow = -1;
+    ceditSetStatusMessage("Mark cleared");
+    return;
+  }
+  Cedit.markRow = Cedit.cursorY;
+  Cedit.markColumn = Cedit.cursorX;
+  ceditSetStatusMessage("Mark set: move to select, then ctrl+C = Copy | ctrl+D = Cut");
+}
+
+int ceditSelection(int *firstRow, int *firstColumn, int *lastRow, int *lastColumn)
+{
+  if (Cedit.markRow == -1)
+    return 0;
+
+  // Edits since the mark was set may have left it past the end of its row
+  int markRow = Cedit.markRow < Cedit.rowNum ? Cedit.markRow : Cedit.rowNum;
+  int markColumn = 0;
+  if (markRow < Cedit.rowNum)
+    markColumn = Cedit.markColumn < Cedit.row[markRow].size ? Cedit.markColumn : Cedit.row[markRow].size;
+
+  if (markRow < Cedit.cursorY || (markRow == Cedit.cursorY && markColumn < Cedit.cursorX))
+  {
+    *firstRow = markRow;
+    *firstColumn = markColumn;
+    *lastRow = Cedit.cursorY;
+    *lastColumn = Cedit.cursorX;
+  }
+  else
+  {
+    *firstRow = Cedit.cursorY;
+    *firstColumn = Cedit.cursorX;
+    *lastRow = markRow;
+    *lastColumn = markColumn;
+  }
+  return 1;
+}
+
+int ceditClipboardCopy(int firstRow, int firstColumn, int lastRow, int lastColumn)
+{
+  ceditClipboardClear();
+
+  int lineNum = lastRow - firstRow + 1;
+  ceditClipboard.lines = malloc(sizeof(struct ceditInterned *) * lineNum);
+  ceditClipboard.syntax = Cedit.syntax;
+  int j;
+  for (j = 0; j < lineNum; j++)
+  {
+    int y = firstRow + j;
+    if (y == Cedit.rowNum)
+    {
+      ceditClipboard.lines[j] = ceditClipboardText("", 0);
+      continue;
+    }
+
+    editorRow *row = &Cedit.row[y];
+    int from = y == firstRow ? firstColumn : 0;
+    int to = y == lastRow ? lastColumn : row->size;
+    ceditRowWarm(row);
+    if (from == 0 && to == row->size && row->chunks == NULL)
+      ceditClipboard.lines[j] = ceditInternShare(row);
+    else
+      ceditClipboard.lines[j] = ceditClipboardText(ceditRowText(row) + from, to - from);
+  }
+  ceditClipboard.lineNum = lineNum;
+
+  // Lines, as the user counts them: a selection ending at a line's start
+  // does not include that line
+  return lineNum - (lastColumn == 0 && lineNum > 1);
+}
+
+void ceditDeleteRange(int firstRow, int firstColumn, int lastRow, int lastColumn)
+{
+  if (firstRow == Cedit.rowNum)
+    return;
+
+  // Whole rows go in one pass, without touching their text
+  if (firstColumn == 0 && lastColumn == 0 && lastRow > firstRow)
+  {
+    ceditTransformCommit(firstRow, lastRow - firstRow, NULL, 0);
+    return;
+  }
+
+  editorRow *row = &Cedit.row[firstRow];
+  char *tail = "";
+  int tailSize = 0;
+  if (lastRow < Cedit.rowNum)
+  {
+    ceditRowWarm(&Cedit.row[lastRow]);
+    ceditRowFlatten(&Cedit.row[lastRow]);
+    tail = ceditRowText(&Cedit.row[lastRow]) + lastColumn;
+    tailSize = Cedit.row[lastRow].size - lastColumn;
+  }
+  ceditRowWarm(row);
+  char *characters = malloc(firstColumn + tailSize + 1);
+  memcpy(characters, ceditRowText(row), firstColumn);
+  memcpy(characters + firstColumn, tail, tailSize);
+  characters[firstColumn + tailSize] = '\0';
+  ceditRowSetCharacters(row, characters, firstColumn + tailSize);
+  ceditUpdateRow(row);
+  Cedit.modified++;
+
+  int count = (lastRow < Cedit.rowNum ? lastRow : Cedit.rowNum - 1) - firstRow;
+  if (count > 0)
+    ceditTransformCommit(firstRow + 1, count, NULL, 0);
+}
+
+void ceditClipboardCut()
+{
+  int firstRow, firstColumn, lastRow, lastColumn;
+  if (!ceditSelection(&firstRow, &firstColumn, &lastRow, &lastColumn))
+  {
+    firstRow = lastRow = Cedit.cursorY;
+    firstColumn = lastColumn = 0;
+    if (lastRow < Cedit.rowNum)
+      lastRow++;
+  }
+  if (firstRow == lastRow && firstColumn == lastColumn)
+  {
+    ceditSetStatusMessage("Nothing to cut");
+    return;
+  }
+
+  int lines = ceditClipboardCopy(firstRow, firstColumn, lastRow, lastColumn);
+  ceditDeleteRange(firstRow, firstColumn, lastRow, lastColumn);
+  Cedit.cursorY = firstRow;
+  Cedit.cursorX = firstColumn;
+  Cedit.markRow = -1;
+  ceditSetStatusMessage("Cut %d line%s", lines, lines == 1 ? "" : "s");
+}
+
+void ceditRowSplice(int at, struct ceditInterned **lines, int count, struct ceditSyntax *syntax)
+{
+  if (count == 0)
+    return;
+
+  // A compressed block must stay contiguous, as in ceditInsertRow
+  if (at > 0 && at < Cedit.rowNum && Cedit.row[at].cold && Cedit.row[at].cold == Cedit.row[at - 1].cold)
+    ceditRowWarm(&Cedit.row[at]);
+  int end = at > 0 && Cedit.row[at - 1].hlOpenComment;
+  Cedit.bracketTreeDirty = 1;
+
+  if (Cedit.rowNum + count > Cedit.rowCapacity)
+  {
+    while (Cedit.rowNum + count > Cedit.rowCapacity)
+      Cedit.rowCapacity = Cedit.rowCapacity ? Cedit.rowCapacity * 2 : 64;
+    Cedit.row = realloc(Cedit.row, sizeof(editorRow) * Cedit.rowCapacity);
+    if (Cedit.row == NULL)
+      terminateProgram("Memory Error!");
+  }
+  memmove(&Cedit.row[at + count], &Cedit.row[at], sizeof(editorRow) * (Cedit.rowNum - at));
+  ceditFoldSplice(at, at, count);
+
+  int j;
+  for (j = 0; j < count; j++)
+  {
+    editorRow *row = &Cedit.row[at + j];
+    memset(row, 0, sizeof(editorRow));
+    row->index = at + j;
+    row->size = lines[j]->size;
+    row->saveSlot = -1;
+    row->bracketNode = -1;
+    row->diskRow = -1;
+    row->changed = 1;
+    if (lines[j]->render)
+    {
+      ceditInternAttach(row, lines[j]);
+      row->hlOpenComment = lines[j]->hlOpenComment;
+    }
+    else
+    {
+      row->characters = malloc(row->size + 1);
+      memcpy(row->characters, lines[j]->characters, row->size + 1);
+    }
+  }
+  Cedit.rowNum += count;
+  for (j = at + count; j < Cedit.rowNum; j++)
+    Cedit.row[j].index = j;
+  for (j = at; j < Cedit.rowNum; j++)
+    ceditDiskCheck(&Cedit.row[j]);
+
+  // Shared rows keep their highlighting if they start as they did before
+  Cedit.syntaxDeferred = 1;
+  for (j = at; j < at + count; j++)
+  {
+    editorRow *row = &Cedit.row[j];
+    int inComment = j > 0 && Cedit.row[j - 1].hlOpenComment;
+    if (row->interned == NULL)
+      ceditUpdateRow(row);
+    else if (syntax != Cedit.syntax || row->interned->inComment != inComment)
+      ceditUpdateSyntax(row);
+  }
+  j = at + count;
+  if (j < Cedit.rowNum && Cedit.row[j - 1].hlOpenComment != end)
+    ceditUpdateSyntax(&Cedit.row[j]);
+  ceditSyntaxFlush();
+
+  Cedit.bracketRow = Cedit.bracketMatchRow = -1;
+  Cedit.matchRow = -1;
+  Cedit.modified++;
+}
+
+void ceditClipboardPaste()
+{
+  int lineNum = ceditClipboard.lineNum;
+  if (lineNum == 0)
+  {
+    ceditSetStatusMessage("Nothing to paste: ctrl+C or ctrl+D first");
+    return;
+  }
+  struct ceditInterned *first = ceditClipboard.lines[0];
+  struct ceditInterned *last = ceditClipboard.lines[lineNum - 1];
+
+  int at = Cedit.cursorY;
+  int column = Cedit.cursorX;
+
+  if (lineNum > 1 && column == 0 && last->size == 0)
+  {
+    // Whole lines go in above the cursor's row, which is left as it is;
+    // past the last row there is none, and they are simply appended
+    ceditRowSplice(at, ceditClipboard.lines, lineNum - 1, ceditClipboard.syntax);
+    Cedit.cursorY = at + lineNum - 1;
+  }
+  else
+  {
+    // The first line joins the text before the cursor, and the last the
+    // text after it; whatever is in between is spliced in whole
+    if (at == Cedit.rowNum)
+      ceditInsertRow(Cedit.rowNum, "", 0);
+    editorRow *row = &Cedit.row[at];
+    ceditRowWarm(row);
+    char *text = ceditRowText(row);
+    int tailSize = row->size - column;
+    int size = column + first->size + (lineNum == 1 ? tailSize : 0);
+    char *characters = malloc(size + 1);
+    memcpy(characters, text, column);
+    memcpy(characters + column, first->characters, first->size);
+    char *tail = NULL;
+    if (lineNum == 1)
+      memcpy(characters + column + first->size, text + column, tailSize);
+    else
+    {
+      tail = malloc(last->size + tailSize + 1);
+      memcpy(tail, last->characters, last->size);
+      memcpy(tail + last->size, text + column, tailSize);
+    }
+    characters[size] = '\0';
+    ceditRowSetCharacters(row, characters, size);
+    ceditUpdateRow(row);
+    Cedit.modified++;
+
+    if (lineNum > 1)
+    {
+      ceditRowSplice(at + 1, ceditClipboard.lines + 1, lineNum - 2, ceditClipboard.syntax);
+      ceditInsertRow(at + lineNum - 1, tail, last->size + tailSize);
+      free(tail);
+    }
+    Cedit.cursorY = at + lineNum - 1;
+    Cedit.cursorX = (lineNum == 1 ? column : 0) + last->size;
+  }
+  Cedit.markRow = -1;
+  int lines = lineNum - (lineNum > 1 && last->size == 0);
+  ceditSetStatusMessage("Pasted %d line%s", lines, lines == 1 ? "" : "s");
+}
+
+/*** PROJECT SEARCH ***/
+
+/*
+  ctrl+P searches every file under the working directory. Directories and
+  files are both work items: a worker pushes what it finds in a directory
+  onto its own queue and takes from the back of it, and a worker with
+  nothing left steals from the front of another's, where the big subtrees
+  are. Files are mapped rather than read, and skipped when they look
+  binary. Matches collect under the search lock, and a byte down the
+  notify pipe gets the results redrawn while the search goes on.
+*/
+
+void ceditQueuePush(struct ceditSearchQueue *queue, char *path)
+{
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail == queue->capacity && queue->head > 0)
+  {
+    memmove(queue->paths, &queue->paths[queue->head], sizeof(char *) * (queue->tail - queue->head));
+    queue->tail -= queue->head;
+    queue->head = 0;
+  }
+  if (queue->tail == queue->capacity)
+  {
+    queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+    queue->paths = realloc(queue->paths, sizeof(char *) * queue->capacity);
+  }
+  queue->paths[queue->tail++] = path;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+char *ceditQueueTake(struct ceditProjectSearch *search, int self)
+{
+  int j;
+  for (j = 0; j < search->workerNum; j++)
+  {
+    struct ceditSearchQueue *queue = &search->queues[(self + j) % search->workerNum];
+    char *path = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+      path = j == 0 ? queue->paths[--queue->tail] : queue->paths[queue->head++];
+    if (queue->head == queue->tail)
+      queue->head = queue->tail = 0;
+    pthread_mutex_unlock(&queue->lock);
+    if (path)
+      return path;
+  }
+  return NULL;
+}
+
+int ceditProjectList(struct ceditProjectSearch *search, int self, char *path, int fd)
+{
+  DIR *directory = fdopendir(fd);
+  if (directory == NULL)
+  {
+    close(fd);
+    return 0;
+  }
+
+  char **children = NULL;
+  int childNum = 0;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL)
+  {
+    // Hidden entries are skipped, which keeps .git and friends out of the way
+    if (entry->d_name[0] == '.' || entry->d_type == DT_LNK)
+      continue;
+    if (childNum % 64 == 0)
+      children = realloc(children, sizeof(char *) * (childNum + 64));
+    int length = strlen(path) + strlen(entry->d_name) + 2;
+    children[childNum] = malloc(length);
+    if (!strcmp(path, "."))
+      strcpy(children[childNum], entry->d_name);
+    else
+      snprintf(children[childNum], length, "%s/%s", path, entry->d_name);
+    childNum++;
+  }
+  closedir(directory);
+
+  // Counted before they are pushed, so the search can't look finished early
+  pthread_mutex_lock(&search->lock);
+  search->pending += childNum;
+  pthread_mutex_unlock(&search->lock);
+
+  int j;
+  for (j = 0; j < childNum; j++)
+    ceditQueuePush(&search->queues[self], children[j]);
+  free(children);
+  return childNum;
+}
+
+int ceditProjectScan(struct ceditProjectSearch *search, char *path, int fd, off_t size,
+                     struct ceditSearchResult **found, int *foundNum, long long *matches)
+{
+  // Returns 1 for a searched file and 0 for a binary one
+  if (size == 0)
+    return 1;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return 1;
+  madvise(data, size, MADV_SEQUENTIAL);
+  if (memchr(data, '\0', size < CEDIT_SEARCH_SNIFF ? size : CEDIT_SEARCH_SNIFF))
+  {
+    munmap(data, size);
+    return 0;
+  }
+
+  // Lines are only counted up to each match, and a line is reported once
+  char *end = data + size;
+  char *from = data, *counted = data, *lineStart = data;
+  int line = 1;
+  char *match;
+  int pathLength = strlen(path);
+  while ((match = ceditSearch(from, end - from, search->query, search->queryLength)) != NULL)
+  {
+    char *newline;
+    while ((newline = memchr(counted, '\n', match - counted)) != NULL)
+    {
+      line++;
+      counted = lineStart = newline + 1;
+    }
+    counted = match;
+    char *lineEnd = memchr(match, '\n', end - match);
+    if (lineEnd == NULL)
+      lineEnd = end;
+
+    (*matches)++;
+    if (*foundNum % 16 == 0)
+      *found = realloc(*found, sizeof(struct ceditSearchResult) * (*foundNum + 16));
+    struct ceditSearchResult *result = &(*found)[(*foundNum)++];
+    result->length = lineEnd - lineStart;
+    if (result->length > 0 && lineStart[result->length - 1] == '\r')
+      result->length--;
+    if (result->length > CEDIT_SEARCH_LINE)
+      result->length = CEDIT_SEARCH_LINE;
+    result->path = malloc(pathLength + 1 + result->length);
+    memcpy(result->path, path, pathLength + 1);
+    result->text = result->path + pathLength + 1;
+    memcpy(result->text, lineStart, result->length);
+    result->line = line;
+    result->column = match - lineStart;
+    from = lineEnd;
+  }
+  munmap(data, size);
+  return 1;
+}
+
+int ceditProjectVisit(struct ceditProjectSearch *search, int self, char *path)
+{
+  struct ceditSearchResult *found = NULL;
+  int foundNum = 0, pushed = 0, searched = -1;
+  long long matches = 0;
+  struct stat st;
+
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  if (fd != -1 && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+  {
+    pushed = ceditProjectList(search, self, path, fd);
+    fd = -1;
+  }
+  else if (fd != -1 && S_ISREG(st.st_mode))
+    searched = ceditProjectScan(search, path, fd, st.st_size, &found, &foundNum, &matches);
+  if (fd != -1)
+    close(fd);
+
+  pthread_mutex_lock(&search->lock);
+  if (searched == 1)
+  {
+    search->files++;
+    search->bytes += st.st_size;
+  }
+  else if (searched == 0)
+    search->binaryFiles++;
+  search->matches += matches;
+  search->matchedFiles += foundNum > 0;
+
+  int j;
+  for (j = 0; j < foundNum; j++)
+  {
+    if (search->resultNum == CEDIT_SEARCH_MAX_RESULTS)
+    {
+      free(found[j].path);
+      continue;
+    }
+    if (search->resultNum == search->resultCapacity)
+    {
+      search->resultCapacity = search->resultCapacity ? search->resultCapacity * 2 : 256;
+      search->results = realloc(search->results, sizeof(struct ceditSearchResult) * search->resultCapacity);
+    }
+    search->results[search->resultNum++] = found[j];
+  }
+
+  search->pending--;
+  search->pushes += pushed;
+  if ((pushed && search->idle) || search->pending == 0)
+    pthread_cond_broadcast(&search->work);
+  if ((foundNum || search->pending == 0) && !search->notified)
+  {
+    search->notified = 1;
+    write(search->notify[1], "x", 1);
+  }
+  int cancel = search->cancel;
+  pthread_mutex_unlock(&search->lock);
+
+  free(found);
+  return cancel;
+}
+
+void *ceditProjectWorker(void *argument)
+{
+  struct ceditSearchQueue *queue = argument;
+  struct ceditProjectSearch *search = queue->search;
+  int self = queue - search->queues;
+
+  while (1)
+  {
+    char *path = ceditQueueTake(search, self);
+    int pushes = 0;
+    if (path == NULL)
+    {
+      // Anything pushed after the snapshot means another look before sleeping
+      pthread_mutex_lock(&search->lock);
+      pushes = search->pushes;
+      pthread_mutex_unlock(&search->lock);
+      path = ceditQueueTake(search, self);
+    }
+    if (path == NULL)
+    {
+      pthread_mutex_lock(&search->lock);
+      int finished = search->pending == 0 || search->cancel;
+      if (!finished && search->pushes == pushes)
+      {
+        search->idle++;
+        pthread_cond_wait(&search->work, &search->lock);
+        search->idle--;
+      }
+      pthread_mutex_unlock(&search->lock);
+      if (finished)
+        break;
+      continue;
+    }
+
+    int cancel = ceditProjectVisit(search, self, path);
+    free(path);
+    if (cancel)
+      break;
+  }
+  return NULL;
+}
+
+double ceditProjectElapsed()
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  if (!search->running)
+    return search->elapsed;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - search->started.tv_sec) + (now.tv_nsec - search->started.tv_nsec) / 1e9;
+}
+
+void ceditProjectStop()
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  if (!search->running)
+    return;
+
+  pthread_mutex_lock(&search->lock);
+  search->cancel = 1;
+  pthread_cond_broadcast(&search->work);
+  pthread_mutex_unlock(&search->lock);
+
+  int j;
+  for (j = 0; j < search->workerNum; j++)
+    pthread_join(search->workers[j], NULL);
+  for (j = 0; j < search->workerNum; j++)
+  {
+    struct ceditSearchQueue *queue = &search->queues[j];
+    while (queue->head < queue->tail)
+      free(queue->paths[queue->head++]);
+    free(queue->paths);
+    pthread_mutex_destroy(&queue->lock);
+  }
+  free(search->queues);
+  free(search->workers);
+  search->queues = NULL;
+  search->workers = NULL;
+  search->elapsed = ceditProjectElapsed();
+  search->running = 0;
+}
+
+void ceditProjectStart(char *query)
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  ceditProjectStop();
+
+  int j;
+  for (j = 0; j < search->resultNum; j++)
+    free(search->results[j].path);
+  free(search->results);
+  free(search->query);
+  search->results = NULL;
+  search->resultNum = search->resultCapacity = 0;
+  search->query = query;
+  search->queryLength = strlen(query);
+  search->matches = 0;
+  search->matchedFiles = search->files = search->binaryFiles = 0;
+  search->bytes = 0;
+  search->selected = search->top = 0;
+  search->pending = 1;
+  search->idle = search->pushes = search->cancel = search->notified = 0;
+
+  if (search->notify[0] == -1)
+  {
+    if (pipe2(search->notify, O_NONBLOCK | O_CLOEXEC) == -1)
+      terminateProgram("Pipe Error!");
+    ceditWatchFd(search->notify[0], ceditProjectHandler);
+  }
+
+  search->workerNum = sysconf(_SC_NPROCESSORS_ONLN);
+  if (search->workerNum < 1)
+    search->workerNum = 1;
+  if (search->workerNum > CEDIT_SEARCH_MAX_WORKERS)
+    search->workerNum = CEDIT_SEARCH_MAX_WORKERS;
+  search->queues = calloc(search->workerNum, sizeof(struct ceditSearchQueue));
+  search->workers = malloc(sizeof(pthread_t) * search->workerNum);
+  for (j = 0; j < search->workerNum; j++)
+  {
+    pthread_mutex_init(&search->queues[j].lock, NULL);
+    search->queues[j].search = search;
+  }
+  ceditQueuePush(&search->queues[0], strdup("."));
+
+  clock_gettime(CLOCK_MONOTONIC, &search->started);
+  search->running = 1;
+  search->active = 1;
+  for (j = 0; j < search->workerNum; j++)
+    if (pthread_create(&search->workers[j], NULL, ceditProjectWorker, &search->queues[j]) != 0)
+      terminateProgram("Search Thread Error!");
+}
+
+void ceditProjectHandler(int fd)
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  char drain[64];
+  while (read(fd, drain, sizeof(drain)) > 0)
+    ;
+
+  pthread_mutex_lock(&search->lock);
+  search->notified = 0;
+  int finished = search->pending == 0;
+  pthread_mutex_unlock(&search->lock);
+
+  if (finished && search->running)
+  {
+    ceditProjectStop();
+    ceditSetStatusMessage("Searched %d files (%d binary skipped) in %.2f s",
+                          search->files, search->binaryFiles, search->elapsed);
+  }
+}
+
+void ceditProjectSearch()
+{
+  // Back to the last results first; from there, ctrl+P starts a new search
+  if (!Cedit.project.active && Cedit.project.query)
+    Cedit.project.active = 1;
+  else
+  {
+    char *query = ceditPrompt("Search project: %s (ESC to cancel)", NULL);
+    if (query == NULL)
+      return;
+    ceditProjectStart(query);
+  }
+  ceditSetStatusMessage("Enter = Open | ESC = Back | ctrl+P = New search");
+}
+
+int ceditProjectKeypress(int character)
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  switch (character)
+  {
+  case ARROW_UP:
+    search->selected--;
+    break;
+  case ARROW_DOWN:
+    search->selected++;
+    break;
+  case PAGE_UP:
+    search->selected -= Cedit.terminalRows;
+    break;
+  case PAGE_DOWN:
+    search->selected += Cedit.terminalRows;
+    break;
+  case HOME_KEY:
+    search->selected = 0;
+    break;
+  case END_KEY:
+    search->selected = CEDIT_SEARCH_MAX_RESULTS;
+    break;
+  case '\r':
+    ceditProjectOpen();
+    break;
+  case '\x1b':
+    search->active = 0;
+    break;
+  case ctrl('q'):
+  case ctrl('p'):
+    return 0;
+  }
+  return 1;
+}
+
+void ceditProjectOpen()
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  pthread_mutex_lock(&search->lock);
+  int found = search->selected < search->resultNum;
+  struct ceditSearchResult result;
+  if (found)
+    result = search->results[search->selected];
+  pthread_mutex_unlock(&search->lock);
+  if (!found)
+    return;
+
+  // The results stay with this document; the file opens in a buffer of its
+  // own, or in the one it already has, so nothing here is discarded
+  int other = Cedit.fileName == NULL || strcmp(Cedit.fileName, result.path);
+  if (other)
+  {
+    // Gone since the search, which would otherwise make it a new file
+    if (access(result.path, R_OK) == -1)
+    {
+      ceditSetStatusMessage("Can't open %s: %s", result.path, strerror(errno));
+      return;
+    }
+    int k = ceditBufferFind(result.path);
+    int added = k < 0 || strcmp(ceditBufferName(k), result.path);
+    if (added)
+      k = ceditBufferAdd(result.path);
+    if (ceditBufferShow(k) == -1)
+    {
+      if (added)
+      {
+        free(ceditBuffers.buffers[k].fileName);
+        ceditBuffers.bufferNum--;
+      }
+      return;
+    }
+  }
+
+  Cedit.cursorY = result.line - 1 < Cedit.rowNum ? result.line - 1 : Cedit.rowNum;
+  Cedit.cursorX = 0;
+  if (Cedit.cursorY < Cedit.rowNum && result.column <= Cedit.row[Cedit.cursorY].size)
+    Cedit.cursorX = result.column;
+  Cedit.rowOff = Cedit.cursorY > Cedit.terminalRows / 2 ? Cedit.cursorY - Cedit.terminalRows / 2 : 0;
+  search->active = 0;
+  ceditSetStatusMessage(other ? "%s:%d (ctrl+W, -, ctrl+P = Back to results)" : "%s:%d (ctrl+P = Back to results)",
+                        Cedit.fileName, result.line);
+}
+
+/*** BUFFER FUNCTIONS ***/
+
+#define BUFFER_INITIALIZATION \
+  {                           \
+    NULL, 0                   \
+  }
+
+void appendBuffer(struct bufferContainer *bc, const char *s, int length)
+{
+  char *new = realloc(bc->b, bc->length + length);
+
+  if (new == NULL)
+    return;
+  memcpy(&new[bc->length], s, length);
+  bc->b = new;
+  bc->length += length;
+}
+
+void freeBuffer(struct bufferContainer *bc)
+{
+  free(bc->b);
+}
+
+/*** OUTPUT ENCODING ***/
+
+/*
+  Over a slow link the bytes on the wire are the cost of a frame, so lines
+  are not sent as they are built. Each one is parsed into cells and
+  compared with what the terminal shows, and only the cells that differ
+  are written, each step encoded as cheaply as the terminal allows: the
+  shortest of absolute and relative cursor moves (or rewriting the few
+  cells in between), REP for a repeated character, ECH and EL for blanks,
+  and SGR changes that only name the attributes that differ.
+*/
+
+void ceditOutputDetect(int rep)
+{
+  // REP is too recent to assume: many terminals that call themselves xterm
+  // lack it and print the sequence as text, so it is only sent when asked for
+  Cedit.output.rep = rep;
+}
+
+void ceditOutputReset()
+{
+  int cells = (Cedit.terminalRows + 2) * Cedit.terminalColumns;
+  free(Cedit.screenHash);
+  free(Cedit.output.cells);
+  free(Cedit.output.scratch);
+  Cedit.screenHash = calloc(Cedit.terminalRows + 2, sizeof(uint64_t));
+  Cedit.output.cells = calloc(cells, sizeof(struct ceditCell));
+  Cedit.output.scratch = malloc(sizeof(struct ceditCell) * Cedit.terminalColumns);
+  if (!Cedit.screenHash || !Cedit.output.cells || !Cedit.output.scratch)
+    terminateProgram("Memory Error!");
+  Cedit.output.row = Cedit.output.column = -1;
+  Cedit.output.attr = -1;
+}
+
+int ceditOutputParse(struct bufferContainer *line, struct ceditCell *cells)
+{
+  // Lines only hold SGR, EL and single-column characters; anything else
+  // (UTF-8 in particular) is left to the terminal to place
+  struct ceditCell blank = {' ', 0};
+  int attr = 0, x = 0, j;
+  for (j = 0; j < line->length; j++)
+  {
+    unsigned char character = line->b[j];
+    if (character == '\x1b' && j + 1 < line->length && line->b[j + 1] == '[')
+    {
+      int value = 0;
+      for (j += 2; j < line->length; j++)
+      {
+        character = line->b[j];
+        if (isdigit(character))
+        {
+          value = value * 10 + character - '0';
+          continue;
+        }
+        if (character == 'm' || character == ';')
+        {
+          if (value == 0)
+            attr = 0;
+          else if (value == 7)
+            attr |= CEDIT_ATTR_INVERSE;
+          else if (value == 27)
+            attr &= ~CEDIT_ATTR_INVERSE;
+          else if (value == 39)
+            attr &= CEDIT_ATTR_INVERSE;
+          else if ((value >= 30 && value <= 37) || (value >= 90 && value <= 97))
+            attr = (attr & CEDIT_ATTR_INVERSE) | value;
+          else
+            return 0;
+          value = 0;
+          if (character == 'm')
+            break;
+        }
+        else if (character == 'K' && value == 0)
+        {
+          // EL leaves the cursor where it was
+          int k;
+          for (k = x; k < Cedit.terminalColumns; k++)
+            cells[k] = blank;
+          break;
+        }
+        else
+          return 0;
+      }
+      if (j == line->length)
+        return 0;
+      continue;
+    }
+    if (character < ' ' || character >= 127)
+      return 0;
+    if (x < Cedit.terminalColumns)
+    {
+      cells[x].character = character;
+      cells[x].attr = attr;
+      x++;
+    }
+  }
+  while (x < Cedit.terminalColumns)
+    cells[x++] = blank;
+  return 1;
+}
+
+int ceditAttrSequence(int from, int attr, char *out)
+{
+  if (from == attr)
+    return 0;
+
+  // Naming what changed is usually shorter; starting from 0 is needed when
+  // the current attributes are not known
+  char changed[16] = "", reset[16] = "";
+  if (from != -1)
+  {
+    int length = 0;
+    if ((from ^ attr) & CEDIT_ATTR_INVERSE)
+      length += sprintf(changed, attr & CEDIT_ATTR_INVERSE ? "7" : "27");
+    if ((from ^ attr) & ~CEDIT_ATTR_INVERSE)
+      sprintf(changed + length, "%s%d", length ? ";" : "", attr & ~CEDIT_ATTR_INVERSE ? attr & ~CEDIT_ATTR_INVERSE : 39);
+  }
+  if (attr)
+  {
+    int length = sprintf(reset, "0");
+    if (attr & CEDIT_ATTR_INVERSE)
+      length += sprintf(reset + length, ";7");
+    if (attr & ~CEDIT_ATTR_INVERSE)
+      sprintf(reset + length, ";%d", attr & ~CEDIT_ATTR_INVERSE);
+  }
+  if (from == -1 || strlen(reset) < strlen(changed))
+    return sprintf(out, "\x1b[%sm", reset);
+  return sprintf(out, "\x1b[%sm", changed);
+}
+
+void ceditOutputAttr(struct bufferContainer *bc, int attr)
+{
+  char sequence[32];
+  int length = ceditAttrSequence(Cedit.output.attr, attr, sequence);
+  appendBuffer(bc, sequence, length);
+  Cedit.output.attr = attr;
+}
+
+int ceditMoveAlong(int from, int to, char *out)
+{
+  // Moves along the current line: CR, BS, CUF, CUB or CHA
+  char best[16], candidate[16];
+  int length, bestLength;
+  if (from == to)
+    return 0;
+  bestLength = sprintf(best, to ? "\x1b[%dG" : "\x1b[G", to + 1);
+  if (to == 0)
+    length = sprintf(candidate, "\r");
+  else if (to > from)
+    length = sprintf(candidate, to - from == 1 ? "\x1b[C" : "\x1b[%dC", to - from);
+  else if (from - to == 1)
+    length = sprintf(candidate, "\b");
+  else
+    length = sprintf(candidate, "\x1b[%dD", from - to);
+  if (length < bestLength)
+  {
+    memcpy(best, candidate, length);
+    bestLength = length;
+  }
+  if (to > 0 && to < from)
+  {
+    length = sprintf(candidate, to == 1 ? "\r\x1b[C" : "\r\x1b[%dC", to);
+    if (length < bestLength)
+    {
+      memcpy(best, candidate, length);
+      bestLength = length;
+    }
+  }
+  memcpy(out, best, bestLength);
+  return bestLength;
+}
+
+int ceditMoveSequence(int row, int column, char *out)
+{
+  struct ceditOutput *output = &Cedit.output;
+  int length;
+  if (column == 0)
+    length = sprintf(out, row ? "\x1b[%dH" : "\x1b[H", row + 1);
+  else
+    length = sprintf(out, "\x1b[%d;%dH", row + 1, column + 1);
+  if (output->row == -1 || output->column == -1)
+    return length;
+
+  // Relative: up or down (LF never scrolls here, the cursor stays above
+  // the last row), then along the line
+  char relative[32];
+  int relativeLength = 0, lines = row - output->row;
+  if (lines > 0 && lines <= 3)
+    while (lines--)
+      relative[relativeLength++] = '\n';
+  else if (lines > 0)
+    relativeLength = sprintf(relative, "\x1b[%dB", lines);
+  else if (lines < 0)
+    relativeLength = sprintf(relative, lines == -1 ? "\x1b[A" : "\x1b[%dA", -lines);
+  relativeLength += ceditMoveAlong(output->column, column, relative + relativeLength);
+  if (relativeLength < length)
+  {
+    memcpy(out, relative, relativeLength);
+    length = relativeLength;
+  }
+  return length;
+}
+
+void ceditOutputMove(struct bufferContainer *bc, int row, int column)
+{
+  char sequence[32];
+  int length = ceditMoveSequence(row, column, sequence);
+  appendBuffer(bc, sequence, length);
+  Cedit.output.row = row;
+  Cedit.output.column = column;
+}
+
+void ceditOutputPut(struct bufferContainer *bc, int row, int column, struct ceditCell cell)
+{
+  ceditOutputAttr(bc, cell.attr);
+  appendBuffer(bc, &cell.character, 1);
+  Cedit.output.cells[row * Cedit.terminalColumns + column] = cell;
+  // The last column leaves the cursor waiting to wrap, which terminals
+  // disagree about, so its position is forgotten
+  Cedit.output.column = column + 1 < Cedit.terminalColumns ? column + 1 : -1;
+}
+
+void ceditOutputReach(struct bufferContainer *bc, int row, int column)
+{
+  // Writing again the few cells up to the target can be cheaper than a move
+  struct ceditOutput *output = &Cedit.output;
+  struct ceditCell *cells = &output->cells[row * Cedit.terminalColumns];
+  if (output->row == row && output->column != -1 && output->column < column)
+  {
+    char sequence[32];
+    int moveLength = ceditMoveSequence(row, column, sequence);
+    int rewriteLength = 0, attr = output->attr, x;
+    for (x = output->column; x < column && rewriteLength < moveLength; x++)
+    {
+      if (cells[x].character == '\0')
+        break;
+      rewriteLength += 1 + ceditAttrSequence(attr, cells[x].attr, sequence);
+      attr = cells[x].attr;
+    }
+    if (x == column && rewriteLength < moveLength)
+    {
+      for (x = output->column; x < column; x++)
+        ceditOutputPut(bc, row, x, cells[x]);
+      return;
+    }
+  }
+  if (output->row != row || output->column != column)
+    ceditOutputMove(bc, row, column);
+}
+
+void ceditOutputLine(struct bufferContainer *bc, int y, struct bufferContainer *line)
+{
+  struct ceditOutput *output = &Cedit.output;
+  int columns = Cedit.terminalColumns;
+  struct ceditCell *old = &output->cells[y * columns], *new = output->scratch;
+  char sequence[32];
+  int x;
+
+  if (!ceditOutputParse(line, new))
+  {
+    ceditOutputAttr(bc, 0);
+    ceditOutputMove(bc, y, 0);
+    appendBuffer(bc, line->b, line->length);
+    memset(old, 0, sizeof(struct ceditCell) * columns);
+    output->column = output->attr = -1;
+    return;
+  }
+
+  // Past its last character the line is blank, and EL clears whatever
+  // the terminal still has there in three bytes
+  int erase = columns;
+  while (erase > 0 && new[erase - 1].character == ' ' && new[erase - 1].attr == 0)
+    erase--;
+  while (erase < columns && old[erase].character == ' ' && old[erase].attr == 0)
+    erase++;
+
+  x = 0;
+  while (x < erase)
+  {
+    if (old[x].character == new[x].character && old[x].attr == new[x].attr)
+    {
+      x++;
+      continue;
+    }
+    ceditOutputReach(bc, y, x);
+
+    int run = 1;
+    while (x + run < erase && new[x + run].character == new[x].character && new[x + run].attr == new[x].attr)
+      run++;
+    int repLength = output->rep && run > 1 ? 1 + snprintf(sequence, sizeof(sequence), "\x1b[%db", run - 1) : run;
+    int echLength = run;
+    if (new[x].character == ' ' && new[x].attr == 0)
+    {
+      echLength = snprintf(sequence, sizeof(sequence), "\x1b[%dX", run);
+      if (x + run < erase)
+        echLength += snprintf(sequence, sizeof(sequence), "\x1b[%dC", run);
+    }
+
+    if (echLength < run && echLength <= repLength)
+    {
+      // ECH blanks without moving; the cursor stays at the start
+      ceditOutputAttr(bc, 0);
+      appendBuffer(bc, sequence, snprintf(sequence, sizeof(sequence), "\x1b[%dX", run));
+      memcpy(&old[x], &new[x], sizeof(struct ceditCell) * run);
+    }
+    else if (repLength < run)
+    {
+      ceditOutputPut(bc, y, x, new[x]);
+      appendBuffer(bc, sequence, snprintf(sequence, sizeof(sequence), "\x1b[%db", run - 1));
+      memcpy(&old[x], &new[x], sizeof(struct ceditCell) * run);
+      output->column = x + run < columns ? x + run : -1;
+    }
+    else
+    {
+      int j;
+      for (j = 0; j < run; j++)
+        ceditOutputPut(bc, y, x + j, new[x + j]);
+    }
+    x += run;
+  }
+
+  if (erase < columns)
+  {
+    ceditOutputReach(bc, y, erase);
+    ceditOutputAttr(bc, 0);
+    appendBuffer(bc, "\x1b[K", 3);
+    memcpy(&old[erase], &new[erase], sizeof(struct ceditCell) * (columns - erase));
+  }
+}
+
+/*** OUTPUT OPERATIONS ***/
+
+void ceditScroll()
+{
+  Cedit.rowX = 0;
+  if (ceditFoldHidden(Cedit.cursorY))
+    ceditFoldReveal(Cedit.cursorY);
+  if (Cedit.cursorY < Cedit.rowNum)
+  {
+    ceditRowWarm(&Cedit.row[Cedit.cursorY]);
+    Cedit.rowX = ceditRowCursorTransformCxtoRx(&Cedit.row[Cedit.cursorY], Cedit.cursorX);
+  }
+  // Folds count as one line each, so the viewport is measured in visible lines
+  int cursorLine = ceditFoldVisible(Cedit.cursorY);
+  int topLine = ceditFoldVisible(Cedit.rowOff);
+  Cedit.rowOff = ceditFoldRow(topLine);
+  if (cursorLine < topLine)
+  {
+    Cedit.rowOff = Cedit.cursorY;
+  }
+  if (cursorLine >= topLine + Cedit.terminalRows)
+  {
+    Cedit.rowOff = ceditFoldRow(cursorLine - Cedit.terminalRows + 1);
+  }
+  if (Cedit.rowX < Cedit.columnOff)
+  {
+    Cedit.columnOff = Cedit.rowX;
+  }
+  if (Cedit.rowX >= Cedit.columnOff + Cedit.terminalColumns)
+  {
+    Cedit.columnOff = Cedit.rowX - Cedit.terminalColumns + 1;
+  }
+}
+
+/*
+  The screen keeps a hash of every line it last drew, and a line is only
+  sent again when its bytes change. When the viewport moves by less than a
+  screen, the terminal shifts the text area itself through a scroll region
+  and only the newly exposed lines are drawn.
+*/
+
+void ceditScrollTerminal(struct bufferContainer *bc)
+{
+  int delta = ceditFoldVisible(Cedit.rowOff) - ceditFoldVisible(Cedit.screenRowOff);
+  int rows = Cedit.terminalRows;
+  int columnMoved = Cedit.columnOff != Cedit.screenColumnOff;
+
+  Cedit.screenRowOff = Cedit.rowOff;
+  Cedit.screenColumnOff = Cedit.columnOff;
+  if (delta == 0 || columnMoved || delta >= rows || delta <= -rows)
+    return;
+
+  // Lines scrolled in are blanked in the current background, and setting
+  // the region moves the cursor
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows,
+                        delta > 0 ? delta : -delta, delta > 0 ? 'S' : 'T');
+  ceditOutputAttr(bc, 0);
+  appendBuffer(bc, buffer, length);
+  Cedit.output.row = Cedit.output.column = -1;
+
+  int columns = Cedit.terminalColumns;
+  struct ceditCell *cells = Cedit.output.cells;
+  struct ceditCell blank = {' ', 0};
+  int j;
+  if (delta > 0)
+  {
+    memmove(Cedit.screenHash, &Cedit.screenHash[delta], sizeof(uint64_t) * (rows - delta));
+    memset(&Cedit.screenHash[rows - delta], 0, sizeof(uint64_t) * delta);
+    memmove(cells, &cells[delta * columns], sizeof(struct ceditCell) * (rows - delta) * columns);
+    for (j = (rows - delta) * columns; j < rows * columns; j++)
+      cells[j] = blank;
+  }
+  else
+  {
+    memmove(&Cedit.screenHash[-delta], Cedit.screenHash, sizeof(uint64_t) * (rows + delta));
+    memset(Cedit.screenHash, 0, sizeof(uint64_t) * -delta);
+    memmove(&cells[-delta * columns], cells, sizeof(struct ceditCell) * (rows + delta) * columns);
+    for (j = 0; j < -delta * columns; j++)
+      cells[j] = blank;
+  }
+}
+
+void ceditEmitLine(struct bufferContainer *bc, int y, struct bufferContainer *line)
+{
+  // Zero marks a line that has to be drawn, so real hashes are never zero
+  uint64_t hash = ceditHash(line->b, line->length) | 1;
+  if (Cedit.screenHash[y] == hash)
+    return;
+  Cedit.screenHash[y] = hash;
+
+  // Against moving to the line and sending all of it, for ctrl+G
+  char buffer[16];
+  int plain = snprintf(buffer, sizeof(buffer), "\x1b[%d;1H", y + 1) + line->length;
+  int start = bc->length;
+  ceditOutputLine(bc, y, line);
+  Cedit.output.saved += plain - (bc->length - start);
+}
+
+void ceditPrintRows(struct bufferContainer *bc)
+{
+  struct bufferContainer line = BUFFER_INITIALIZATION;
+  char *window = malloc(Cedit.terminalColumns + 1);
+  struct ceditSpan *windowSpans = malloc(sizeof(struct ceditSpan) * (Cedit.terminalColumns + 1));
+  int topLine = ceditFoldVisible(Cedit.rowOff);
+  int firstRow = 0, firstColumn = 0, lastRow = 0, lastColumn = 0;
+  int selecting = ceditSelection(&firstRow, &firstColumn, &lastRow, &lastColumn);
+  int y;
+  for (y = 0; y < Cedit.terminalRows; y++)
+  {
+    int fileRow = ceditFoldRow(topLine + y);
+    if (fileRow >= Cedit.rowNum)
+    {
+      if (Cedit.rowNum == 0 && y == Cedit.terminalRows / 3)
+      {
+        char welcomeMessage[80];
+        int welcomeLength = snprintf(welcomeMessage, sizeof(welcomeMessage),
+                                     "Cedit - v%s", CEDIT_VERSION);
+        if (welcomeLength > Cedit.terminalColumns)
+          welcomeLength = Cedit.terminalColumns;
+        int padding = (Cedit.terminalColumns - welcomeLength) / 2;
+        if (padding)
+        {
+          appendBuffer(&line, "~", 1);
+          padding--;
+        }
+        while (padding--)
+          appendBuffer(&line, " ", 1);
+        appendBuffer(&line, welcomeMessage, welcomeLength);
+      }
+      else
+      {
+        appendBuffer(&line, "~", 1);
+      }
+    }
+    else
+    {
+      ceditRowWarm(&Cedit.row[fileRow]);
+      ceditColdTouch(fileRow);
+      int length = Cedit.row[fileRow].rSize - Cedit.columnOff;
+      if (length < 0)
+        length = 0;
+      if (length > Cedit.terminalColumns)
+        length = Cedit.terminalColumns;
+      editorRow *row = &Cedit.row[fileRow];
+      char *character = window;
+      int spanNum = 0;
+      if (row->chunks)
+        spanNum = ceditChunkWindow(row, Cedit.columnOff, length, window, windowSpans);
+      else if (length > 0)
+      {
+        character = &row->render[Cedit.columnOff];
+        spanNum = ceditSpanSlice(row->spans, row->spanNum, Cedit.columnOff, length, windowSpans);
+      }
+
+      // The selection is drawn in reverse video, over the colors
+      int selectFrom = 0, selectTo = 0, inverse = 0;
+      if (selecting && fileRow >= firstRow && fileRow <= lastRow)
+      {
+        selectFrom = fileRow == firstRow ? ceditRowCursorTransformCxtoRx(row, firstColumn) : 0;
+        selectTo = fileRow == lastRow ? ceditRowCursorTransformCxtoRx(row, lastColumn) : row->rSize;
+      }
+
+      // Colors change only at span edges and around the overlays, so at
+      // most one escape is written per span
+      int currentColor = -1;
+      int span = 0, spanEnd = spanNum ? windowSpans[0].length : length;
+      int j;
+      for (j = 0; j < length; j++)
+      {
+        while (j >= spanEnd && span < spanNum)
+          spanEnd += ++span < spanNum ? windowSpans[span].length : length;
+        int highlight = span < spanNum ? windowSpans[span].hl : HL_NORMAL;
+        if (fileRow == Cedit.matchRow && j + Cedit.columnOff >= Cedit.matchColumn &&
+            j + Cedit.columnOff < Cedit.matchColumn + Cedit.matchLength)
+          highlight = HL_MATCH;
+        if ((fileRow == Cedit.bracketRow && j + Cedit.columnOff == Cedit.bracketColumn) ||
+            (fileRow == Cedit.bracketMatchRow && j + Cedit.columnOff == Cedit.bracketMatchColumn))
+          highlight = HL_BRACKET;
+        int selected = j + Cedit.columnOff >= selectFrom && j + Cedit.columnOff < selectTo;
+        if (selected != inverse)
+        {
+          appendBuffer(&line, selected ? "\x1b[7m" : "\x1b[27m", selected ? 4 : 5);
+          inverse = selected;
+        }
+
+        if (iscntrl(character[j]))
+        {
+          char symbol = (character[j] <= 26) ? '@' + character[j] : '?';
+          appendBuffer(&line, "\x1b[7m", 4);
+          appendBuffer(&line, &symbol, 1);
+          appendBuffer(&line, "\x1b[m", 3);
+          if (inverse)
+            appendBuffer(&line, "\x1b[7m", 4);
+          if (currentColor != -1)
+          {
+            char buffer[16];
+            int cLength = snprintf(buffer, sizeof(buffer), "\x1b[%dm", currentColor);
+            appendBuffer(&line, buffer, cLength);
+          }
+        }
+        else if (highlight == HL_NORMAL)
+        {
+          if (currentColor != -1)
+          {
+            appendBuffer(&line, "\x1b[39m", 5);
+            currentColor = -1;
+          }
+          appendBuffer(&line, &character[j], 1);
+        }
+        else
+        {
+          int color = ceditSyntaxColoring(highlight);
+          if (color != currentColor)
+          {
+            currentColor = color;
+            char buffer[16];
+            int cLength = snprintf(buffer, sizeof(buffer), "\x1b[%dm", color);
+            appendBuffer(&line, buffer, cLength);
+          }
+          appendBuffer(&line, &character[j], 1);
+        }
+      }
+      if (inverse)
+        appendBuffer(&line, "\x1b[27m", 5);
+      appendBuffer(&line, "\x1b[39m", 5);
+
+      int fold = ceditFoldAt(fileRow);
+      if (fold != -1)
+      {
+        char marker[32];
+        int markerLength = snprintf(marker, sizeof(marker), " ... %d lines ",
+                                    Cedit.fold.folds[fold].last - Cedit.fold.folds[fold].first);
+        if (length + 1 + markerLength <= Cedit.terminalColumns)
+        {
+          appendBuffer(&line, " \x1b[7m", 5);
+          appendBuffer(&line, marker, markerLength);
+          appendBuffer(&line, "\x1b[m", 3);
+        }
+      }
+    }
+
+    appendBuffer(&line, "\x1b[K", 3);
+    ceditEmitLine(bc, y, &line);
+    line.length = 0;
+  }
+  freeBuffer(&line);
+  free(window);
+  free(windowSpans);
+}
+
+void ceditProjectScroll()
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  pthread_mutex_lock(&search->lock);
+  if (search->selected >= search->resultNum)
+    search->selected = search->resultNum - 1;
+  pthread_mutex_unlock(&search->lock);
+  if (search->selected < 0)
+    search->selected = 0;
+  if (search->selected < search->top)
+    search->top = search->selected;
+  if (search->selected >= search->top + Cedit.terminalRows)
+    search->top = search->selected - Cedit.terminalRows + 1;
+}
+
+void ceditProjectPrintResults(struct bufferContainer *bc)
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  struct bufferContainer line = BUFFER_INITIALIZATION;
+  char *visible = malloc(Cedit.terminalColumns + 1);
+  char buffer[16];
+  int y;
+
+  pthread_mutex_lock(&search->lock);
+  for (y = 0; y < Cedit.terminalRows; y++)
+  {
+    int k = search->top + y;
+    if (k >= search->resultNum)
+      appendBuffer(&line, "~", 1);
+    else
+    {
+      // path:line: text, with the match in the search color
+      struct ceditSearchResult *result = &search->results[k];
+      int prefix = snprintf(visible, Cedit.terminalColumns + 1, "%s:%d: ", result->path, result->line);
+      if (prefix > Cedit.terminalColumns)
+        prefix = Cedit.terminalColumns;
+      int length = prefix;
+      int j;
+      for (j = 0; j < result->length && length < Cedit.terminalColumns; j++)
+        visible[length++] = iscntrl((unsigned char)result->text[j]) ? ' ' : result->text[j];
+      int matchStart = prefix + result->column;
+      int matchEnd = matchStart + search->queryLength;
+      if (matchStart > length)
+        matchStart = length;
+      if (matchEnd > length)
+        matchEnd = length;
+
+      if (k == search->selected)
+      {
+        appendBuffer(&line, "\x1b[7m", 4);
+        appendBuffer(&line, visible, length);
+        appendBuffer(&line, "\x1b[m", 3);
+      }
+      else
+      {
+        appendBuffer(&line, "\x1b[36m", 5);
+        appendBuffer(&line, visible, prefix);
+        appendBuffer(&line, "\x1b[39m", 5);
+        appendBuffer(&line, visible + prefix, matchStart - prefix);
+        int cLength = snprintf(buffer, sizeof(buffer), "\x1b[%dm", ceditSyntaxColoring(HL_MATCH));
+        appendBuffer(&line, buffer, cLength);
+        appendBuffer(&line, visible + matchStart, matchEnd - matchStart);
+        appendBuffer(&line, "\x1b[39m", 5);
+        appendBuffer(&line, visible + matchEnd, length - matchEnd);
+      }
+    }
+    appendBuffer(&line, "\x1b[K", 3);
+    ceditEmitLine(bc, y, &line);
+    line.length = 0;
+  }
+  pthread_mutex_unlock(&search->lock);
+  freeBuffer(&line);
+  free(visible);
+}
+
+void ceditProjectStatus(char *status, int *length, char *rStatus, int *rLength)
+{
+  struct ceditProjectSearch *search = &Cedit.project;
+  double elapsed = ceditProjectElapsed();
+  if (elapsed < 0.001)
+    elapsed = 0.001;
+
+  pthread_mutex_lock(&search->lock);
+  *length = snprintf(status, 80, "Search \"%.20s\" - %lld matches in %d files%s",
+                     search->query, search->matches, search->matchedFiles,
+                     search->running ? " [searching]" : "");
+  *rLength = snprintf(rStatus, 80, "%.0f files/s | %.1f MB/s",
+                      search->files / elapsed, search->bytes / elapsed / 1048576.0);
+  pthread_mutex_unlock(&search->lock);
+}
+
+void ceditDrawStatusBar(struct bufferContainer *bc)
+{
+  appendBuffer(bc, "\x1b[7m", 4);
+  char status[80], rStatus[80], progress[32] = "";
+  if (Cedit.saving)
+    snprintf(progress, sizeof(progress), " [saving %d%%]",
+             Cedit.save.total ? (int)(Cedit.save.written * 100 / Cedit.save.total) : 100);
+  else if (Cedit.streamFd != -1 && Cedit.streamTotal)
+    snprintf(progress, sizeof(progress), " [loading %d%%]",
+             (int)(Cedit.streamBytes * 100 / Cedit.streamTotal));
+  else if (Cedit.streamFd != -1)
+    snprintf(progress, sizeof(progress), " [loading %.1f MB]", Cedit.streamBytes / 1048576.0);
+  else if (Cedit.follow)
+    snprintf(progress, sizeof(progress), " [following]");
+  char buffer[32] = "";
+  if (ceditBuffers.bufferNum > 1)
+    snprintf(buffer, sizeof(buffer), "[%d/%d] ", ceditBuffers.current + 1, ceditBuffers.bufferNum);
+  int length, rLength;
+  if (Cedit.hex.map)
+  {
+    length = snprintf(status, sizeof(status), "%s%.20s - %lld bytes %s", buffer, Cedit.fileName,
+                      (long long)Cedit.hex.size, ceditModified() ? "(modified)" : "");
+    rLength = snprintf(rStatus, sizeof(rStatus), "hex | 0x%llx", (long long)Cedit.hex.cursor);
+  }
+  else
+  {
+    length = snprintf(status, sizeof(status), "%s%.20s - %d lines %s%s", buffer,
+                      Cedit.fileName ? Cedit.fileName : "[No Name]", Cedit.rowNum,
+                      ceditModified() ? "(modified)" : "", progress);
+    rLength = snprintf(rStatus, sizeof(rStatus), "%s | %d/%d",
+                       Cedit.syntax ? Cedit.syntax->fileType : "Line number:", Cedit.cursorY + 1, Cedit.rowNum);
+  }
+  if (Cedit.project.active)
+    ceditProjectStatus(status, &length, rStatus, &rLength);
+  if (length > Cedit.terminalColumns)
+    length = Cedit.terminalColumns;
+  appendBuffer(bc, status, length);
+  while (length < Cedit.terminalColumns)
+  {
+    if (Cedit.terminalColumns - length == rLength)
+    {
+      appendBuffer(bc, rStatus, rLength);
+      break;
+    }
+    else
+    {
+      appendBuffer(bc, " ", 1);
+      length++;
+    }
+  }
+  appendBuffer(bc, "\x1b[m", 3);
+}
+
+void ceditDrawMessageBar(struct bufferContainer *bc)
+{
+  appendBuffer(bc, "\x1b[K", 3);
+  int messageLength = strlen(Cedit.statusMessage);
+  if (messageLength > Cedit.terminalColumns)
+    messageLength = Cedit.terminalColumns;
+  if (messageLength && time(NULL) - Cedit.statusMessageTime < 5)
+    appendBuffer(bc, Cedit.statusMessage, messageLength);
+}
+
+void ceditRefreshTerminal()
+{
+  if (Cedit.project.active)
+    ceditProjectScroll();
+  else if (Cedit.hex.map)
+    ceditHexScroll();
+  else
+  {
+    ceditScroll();
+    ceditBracketHighlight();
+  }
+
+  struct bufferContainer bc = BUFFER_INITIALIZATION;
+  struct bufferContainer line = BUFFER_INITIALIZATION;
+
+  // Synchronized output: the terminal shows the frame only once it is complete
+  appendBuffer(&bc, "\x1b[?2026h", 8);
+  appendBuffer(&bc, "\x1b[?25l", 6);
+
+  if (Cedit.project.active)
+    ceditProjectPrintResults(&bc);
+  else if (Cedit.hex.map)
+    ceditHexPrintRows(&bc);
+  else
+  {
+    ceditScrollTerminal(&bc);
+    ceditPrintRows(&bc);
+  }
+  ceditDrawStatusBar(&line);
+  ceditEmitLine(&bc, Cedit.terminalRows, &line);
+  line.length = 0;
+  ceditDrawMessageBar(&line);
+  ceditEmitLine(&bc, Cedit.terminalRows + 1, &line);
+  freeBuffer(&line);
+
+  int cursorRow = Cedit.project.selected - Cedit.project.top, cursorColumn = 0;
+  if (!Cedit.project.active && Cedit.hex.map)
+    ceditHexCursor(&cursorRow, &cursorColumn);
+  else if (!Cedit.project.active)
+  {
+    cursorRow = ceditFoldVisible(Cedit.cursorY) - ceditFoldVisible(Cedit.rowOff);
+    cursorColumn = Cedit.rowX - Cedit.columnOff;
+  }
+  char buffer[32];
+  int plain = snprintf(buffer, sizeof(buffer), "\x1b[%d;%dH", cursorRow + 1, cursorColumn + 1);
+  int start = bc.length;
+  ceditOutputMove(&bc, cursorRow, cursorColumn);
+  Cedit.output.saved += plain - (bc.length - start);
+
+  appendBuffer(&bc, "\x1b[?25h", 6);
+  appendBuffer(&bc, "\x1b[?2026l", 8);
+
+  write(STDOUT_FILENO, bc.b, bc.length);
+  Cedit.output.bytes += bc.length;
+  freeBuffer(&bc);
+
+  Cedit.frame.last = ceditNanos();
+  Cedit.frame.frames++;
+  if (Cedit.frame.pending)
+  {
+    long long latency = Cedit.frame.last - Cedit.frame.pending;
+    Cedit.frame.latencyNanos += latency;
+    if (latency > Cedit.frame.latencyMaxNanos)
+      Cedit.frame.latencyMaxNanos = latency;
+    Cedit.frame.pending = 0;
+  }
+
+  ceditColdCompact();
+  Cedit.cold.clock++;
+}
+
+void ceditSetStatusMessage(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(Cedit.statusMessage, sizeof(Cedit.statusMessage), fmt, ap);
+  va_end(ap);
+  Cedit.statusMessageTime = time(NULL);
+}
+
+/*** INPUT OPERATIONS ***/
+
+char *ceditPrompt(char *prompt, void (*callback)(char *, int))
+{
+  return ceditPromptInput(prompt, callback, 0);
+}
+
+char *ceditPromptInput(char *prompt, void (*callback)(char *, int), int empty)
+{
+  // Enter on an empty answer is ignored unless the caller can use one
+  size_t bufferSize = 128;
+  char *buffer = malloc(bufferSize);
+
+  size_t bufferLength = 0;
+  buffer[0] = '\0';
+
+  while (1)
+  {
+    ceditSetStatusMessage(prompt, buffer);
+    ceditRefreshTerminal();
+
+    int character = ceditReadCharacter();
+    if (character == DEL_KEY || character == ctrl('h') || character == BACKSPACE)
+    {
+      if (bufferLength != 0)
+        buffer[--bufferLength] = '\0';
+    }
+    else if (character == '\x1b')
+    {
+      ceditSetStatusMessage("");
+      if (callback)
+        callback(buffer, character);
+      free(buffer);
+      return NULL;
+    }
+    else if (character == '\r')
+    {
+      if (bufferLength != 0 || empty)
+      {
+        ceditSetStatusMessage("");
+        if (callback)
+          callback(buffer, character);
+        return buffer;
+      }
+    }
+    else if (!iscntrl(character) && character < 128)
+    {
+      if (bufferLength == bufferSize - 1)
+      {
+        bufferSize *= 2;
+        buffer = realloc(buffer, bufferSize);
+      }
+      buffer[bufferLength++] = character;
+      buffer[bufferLength] = '\0';
+    }
+
+    if (callback)
+      callback(buffer, character);
+  }
+}
+
+void ceditMoveCursor(int key)
+{
+  editorRow *row = (Cedit.cursorY >= Cedit.rowNum) ? NULL : &Cedit.row[Cedit.cursorY];
+
+  switch (key)
+  {
+  case ARROW_LEFT:
+    if (Cedit.cursorX != 0)
+    {
+      Cedit.cursorX--;
+    }
+    else if (Cedit.cursorY > 0)
+    {
+      Cedit.cursorY = ceditFoldStep(Cedit.cursorY, -1);
+      Cedit.cursorX = Cedit.row[Cedit.cursorY].size;
+    }
+    break;
+  case ARROW_RIGHT:
+    if (row && Cedit.cursorX < row->size)
+    {
+      Cedit.cursorX++;
+    }
+    else if (row && Cedit.cursorX == row->size)
+    {
+      Cedit.cursorY = ceditFoldStep(Cedit.cursorY, 1);
+      Cedit.cursorX = 0;
+    }
+    break;
+  case ARROW_UP:
+    if (Cedit.cursorY != 0)
+    {
+      Cedit.cursorY = ceditFoldStep(Cedit.cursorY, -1);
+    }
+    break;
+  case ARROW_DOWN:
+    if (Cedit.cursorY < Cedit.rowNum)
+    {
+      Cedit.cursorY = ceditFoldStep(Cedit.cursorY, 1);
+    }
+    break;
+  }
+
+  row = (Cedit.cursorY >= Cedit.rowNum) ? NULL : &Cedit.row[Cedit.cursorY];
+  int rowLength = row ? row->size : 0;
+  if (Cedit.cursorX > rowLength)
+  {
+    Cedit.cursorX = rowLength;
+  }
+}
+
+void ceditProcessKeypress()
+{
+  static int quitCount = CEDIT_QUIT_COUNT;
+
+  int character = ceditReadCharacter();
+  if (Cedit.project.active && ceditProjectKeypress(character))
+    return;
+  if (Cedit.hex.map && ceditHexKeypress(character))
+  {
+    quitCount = CEDIT_QUIT_COUNT;
+    return;
+  }
+
+  switch (character)
+  {
+  case '\r':
+    ceditInsertNewline();
+    break;
+
+  case ctrl('q'):
+    if (ceditModified() && quitCount > 0)
+    {
+      ceditSetStatusMessage("Warning! File has unsaved changes. "
+                            "Press ctrl+Q %d more times to quit.",
+                            quitCount);
+      quitCount--;
+      return;
+    }
+    if (ceditBufferModified() && quitCount > 0)
+    {
+      ceditSetStatusMessage("Warning! %d other buffer(s) have unsaved changes (ctrl+W). "
+                            "Press ctrl+Q %d more times to quit.",
+                            ceditBufferModified(), quitCount);
+      quitCount--;
+      return;
+    }
+    ceditSaveWait();
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    exit(0);
+    break;
+
+  case ctrl('s'):
+    ceditSave();
+    break;
+
+  case ctrl('w'):
+    ceditBufferPrompt();
+    break;
+
+  case ctrl('a'):
+    ceditToggleMark();
+    break;
+
+  case ctrl('c'):
+  {
+    int firstRow, firstColumn, lastRow, lastColumn;
+    if (!ceditSelection(&firstRow, &firstColumn, &lastRow, &lastColumn))
+    {
+      firstRow = Cedit.cursorY;
+      lastRow = firstRow < Cedit.rowNum ? firstRow + 1 : firstRow;
+      firstColumn = lastColumn = 0;
+    }
+    if (firstRow == lastRow && firstColumn == lastColumn)
+    {
+      ceditSetStatusMessage("Nothing to copy");
+      break;
+    }
+    int lines = ceditClipboardCopy(firstRow, firstColumn, lastRow, lastColumn);
+    Cedit.markRow = -1;
+    ceditSetStatusMessage("Copied %d line%s", lines, lines == 1 ? "" : "s");
+  }
+  break;
+
+  case ctrl('d'):
+    ceditClipboardCut();
+    break;
+
+  case ctrl('v'):
+    ceditClipboardPaste();
+    break;
+
+  case HOME_KEY:
+    Cedit.cursorX = 0;
+    break;
+
+  case END_KEY:
+    if (Cedit.cursorY < Cedit.rowNum)
+      Cedit.cursorX = Cedit.row[Cedit.cursorY].size;
+    break;
+
+  case ctrl('f'):
+    ceditFind();
+    break;
+
+  case ctrl('r'):
+    ceditReplaceAll();
+    break;
+
+  case ctrl('p'):
+    ceditProjectSearch();
+    break;
+
+  case ctrl('o'):
+    ceditReload();
+    break;
+
+  case ctrl('t'):
+    ceditToggleFollow();
+    break;
+
+  case ctrl('g'):
+    ceditShowStats();
+    break;
+
+  case ctrl('b'):
+    ceditJumpToBracket();
+    break;
+
+  case ctrl('e'):
+    ceditEnclosingBlock();
+    break;
+
+  case ctrl('k'):
+    ceditFoldToggle();
+    break;
+
+  case ctrl('n'):
+    ceditFoldToLine();
+    break;
+
+  case ctrl('x'):
+    ceditTransformPrompt();
+    break;
+
+  case BACKSPACE:
+  case ctrl('h'):
+  case DEL_KEY:
+    if (character == DEL_KEY)
+      ceditMoveCursor(ARROW_RIGHT);
+    ceditDeleteCharacter();
+    break;
+
+  case PAGE_UP:
+  case PAGE_DOWN:
+  {
+    if (character == PAGE_UP)
+    {
+      Cedit.cursorY = Cedit.rowOff;
+    }
+    else if (character == PAGE_DOWN)
+    {
+      Cedit.cursorY = ceditFoldRow(ceditFoldVisible(Cedit.rowOff) + Cedit.terminalRows - 1);
+      if (Cedit.cursorY > Cedit.rowNum)
+        Cedit.cursorY = Cedit.rowNum;
+    }
+
+    int times = Cedit.terminalRows;
+    while (times--)
+      ceditMoveCursor(character == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+  }
+  break;
+
+  case ARROW_UP:
+  case ARROW_DOWN:
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    ceditMoveCursor(character);
+    break;
+
+  case ctrl('l'):
+  case '\x1b':
+    break;
+
+  default:
+    ceditInsertCharacter(character);
+    break;
+  }
+
+  quitCount = CEDIT_QUIT_COUNT;
+}
+
+/*
+  Keys that are already waiting are handled before the screen is redrawn,
+  and redraws are spaced at least a frame apart, so a held key or a burst
+  of typeahead costs one frame instead of one per key. Draining stops once
+  the oldest unshown key has waited CEDIT_FRAME_DELAY_LIMIT (or a frame,
+  if that is longer), which bounds the key-to-paint latency under a flood.
+*/
+
+void ceditDrainInput()
+{
+  long long now = ceditNanos();
+  long long due = Cedit.frame.last + Cedit.frame.interval;
+  long long limit = Cedit.frame.pending + (Cedit.frame.interval > CEDIT_FRAME_DELAY_LIMIT
+                                               ? Cedit.frame.interval
+                                               : CEDIT_FRAME_DELAY_LIMIT);
+  while (Cedit.frame.pending && now < limit)
+  {
+    int timeout = now < due ? (due - now + 999999) / 1000000 : 0;
+    if (!ceditInputPending(timeout))
+      break;
+    ceditProcessKeypress();
+    now = ceditNanos();
+  }
+}
+
+/*** HEX VIEW ***/
+
+/*
+  A file with a NUL in its first CEDIT_SEARCH_SNIFF bytes (the test
+  project search skips binaries by) is not split into rows. It is mapped
+  privately and shown as offset, hex and text columns, and only the lines
+  on screen are ever formatted, so a file of any size opens at once and
+  costs no memory beyond the pages looked at. Typing overwrites bytes of
+  the mapping in place, which copies just the pages touched; each edited
+  offset keeps its original byte, so typing that byte back undoes the
+  edit. Saving writes the edited bytes back, and nothing else of the file.
+
+  Reading a page that a truncation cut off the file raises SIGBUS, so the
+  mapping is only read through ceditHexCopy and ceditHexSearch, which catch
+  it. Once the file is seen to shrink, on a watch event or by such a fault,
+  the view draws nothing until it is reloaded.
+*/
+
+void ceditHexFaultHandler(int signalNumber)
+{
+  if (ceditHexGuarded)
+    siglongjmp(ceditHexFault, 1);
+  signal(signalNumber, SIG_DFL);
+  raise(signalNumber);
+}
+
+void ceditHexStale()
+{
+  Cedit.hex.stale = 1;
+  Cedit.hex.matchLength = 0;
+  Cedit.diskChanged = 1;
+  ceditSetStatusMessage("File changed on disk. Press ctrl+O to reload");
+}
+
+void ceditHexCheck()
+{
+  // A file replaced under the same name leaves our mapping of the old one intact
+  struct stat st;
+  if (stat(Cedit.fileName, &st) == 0 && st.st_ino == Cedit.diskStat.st_ino &&
+      st.st_dev == Cedit.diskStat.st_dev && st.st_size < Cedit.hex.size)
+    ceditHexStale();
+}
+
+int ceditHexCopy(void *to, const void *from, size_t length)
+{
+  if (Cedit.hex.stale)
+    return -1;
+  if (sigsetjmp(ceditHexFault, 1))
+  {
+    ceditHexGuarded = 0;
+    ceditHexStale();
+    return -1;
+  }
+  ceditHexGuarded = 1;
+  memcpy(to, from, length);
+  ceditHexGuarded = 0;
+  return 0;
+}
+
+int ceditHexOpen(char *fileName)
+{
+  int fd = open(fileName, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  struct stat st;
+  unsigned char sniff[CEDIT_SEARCH_SNIFF];
+  ssize_t length = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    length = pread(fd, sniff, sizeof(sniff), 0);
+  // Only the pages written to need memory of their own, so none is reserved
+  void *map = MAP_FAILED;
+  if (length > 0 && memchr(sniff, '\0', length))
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  memset(&Cedit.hex, 0, sizeof(Cedit.hex));
+  Cedit.hex.map = map;
+  Cedit.hex.size = st.st_size;
+  signal(SIGBUS, ceditHexFaultHandler);
+  return 1;
+}
+
+void ceditHexClose()
+{
+  if (Cedit.hex.map)
+    munmap(Cedit.hex.map, Cedit.hex.size);
+  free(Cedit.hex.edits);
+  memset(&Cedit.hex, 0, sizeof(Cedit.hex));
+}
+
+int ceditHexDigits()
+{
+  int digits = 8;
+  while (digits < 16 && (unsigned long long)(Cedit.hex.size - 1) >> (digits * 4))
+    digits++;
+  return digits;
+}
+
+int ceditHexColumn(int width, int at, int ascii)
+{
+  // Bytes are split into groups of 8 by an extra blank
+  if (ascii)
+    return ceditHexDigits() + 3 * width + (width + 7) / 8 + 2 + at;
+  return ceditHexDigits() + 2 + 3 * at + at / 8;
+}
+
+int ceditHexWidth()
+{
+  int width = CEDIT_HEX_WIDTH;
+  while (width > 4 && ceditHexColumn(width, width, 1) > Cedit.terminalColumns)
+    width /= 2;
+  return width;
+}
+
+int ceditHexEditFind(off_t offset)
+{
+  int low = 0, high = Cedit.hex.editNum;
+  while (low < high)
+  {
+    int middle = (low + high) / 2;
+    if (Cedit.hex.edits[middle].offset < offset)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+void ceditHexWrite(off_t offset, unsigned char value)
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  unsigned char current;
+  if (ceditHexCopy(&current, hex->map + offset, 1) == -1 || ceditHexCopy(hex->map + offset, &value, 1) == -1)
+    return;
+  int k = ceditHexEditFind(offset);
+  int edited = k < hex->editNum && hex->edits[k].offset == offset;
+  if (!edited && current != value)
+  {
+    if (hex->editNum == hex->editCapacity)
+    {
+      hex->editCapacity = hex->editCapacity ? hex->editCapacity * 2 : 64;
+      hex->edits = realloc(hex->edits, sizeof(struct ceditHexEdit) * hex->editCapacity);
+    }
+    memmove(&hex->edits[k + 1], &hex->edits[k], sizeof(struct ceditHexEdit) * (hex->editNum - k));
+    hex->edits[k].offset = offset;
+    hex->edits[k].original = current;
+    hex->editNum++;
+  }
+  else if (edited && hex->edits[k].original == value)
+  {
+    memmove(&hex->edits[k], &hex->edits[k + 1], sizeof(struct ceditHexEdit) * (hex->editNum - k - 1));
+    hex->editNum--;
+  }
+  Cedit.modified++;
+}
+
+void ceditHexMove(off_t offset)
+{
+  if (offset >= Cedit.hex.size)
+    offset = Cedit.hex.size - 1;
+  if (offset < 0)
+    offset = 0;
+  Cedit.hex.cursor = offset;
+  Cedit.hex.nibble = 0;
+}
+
+void ceditHexScroll()
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  int width = ceditHexWidth();
+  off_t line = hex->cursor - hex->cursor % width;
+  hex->top -= hex->top % width;
+  if (line < hex->top)
+    hex->top = line;
+  if (line >= hex->top + (off_t)Cedit.terminalRows * width)
+    hex->top = line - (off_t)(Cedit.terminalRows - 1) * width;
+}
+
+void ceditHexByte(struct bufferContainer *line, off_t offset, unsigned char byte, int ascii)
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  char text[3];
+  if (ascii)
+    text[0] = byte >= ' ' && byte < 127 ? byte : '.';
+  else
+    snprintf(text, sizeof(text), "%02x", byte);
+
+  int color = 0;
+  int k = ceditHexEditFind(offset);
+  if (offset >= hex->matchOffset && offset < hex->matchOffset + hex->matchLength)
+    color = ceditSyntaxColoring(HL_MATCH);
+  else if (k < hex->editNum && hex->edits[k].offset == offset)
+    color = 31;
+
+  // The terminal cursor marks the byte in the column being typed into
+  int inverse = offset == hex->cursor && ascii != hex->ascii;
+  char sequence[16];
+  int length = 0;
+  if (inverse && color)
+    length = snprintf(sequence, sizeof(sequence), "\x1b[7;%dm", color);
+  else if (inverse)
+    length = snprintf(sequence, sizeof(sequence), "\x1b[7m");
+  else if (color)
+    length = snprintf(sequence, sizeof(sequence), "\x1b[%dm", color);
+  appendBuffer(line, sequence, length);
+  appendBuffer(line, text, ascii ? 1 : 2);
+  if (length)
+    appendBuffer(line, "\x1b[m", 3);
+}
+
+void ceditHexPrintRows(struct bufferContainer *bc)
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  struct bufferContainer line = BUFFER_INITIALIZATION;
+  int width = ceditHexWidth();
+  int digits = ceditHexDigits();
+
+  // The bytes on screen are copied out in one guarded read
+  off_t shown = hex->size - hex->top;
+  if (shown > (off_t)Cedit.terminalRows * width)
+    shown = (off_t)Cedit.terminalRows * width;
+  unsigned char *window = malloc(shown);
+  if (ceditHexCopy(window, hex->map + hex->top, shown) == -1)
+    shown = 0;
+
+  int y, j;
+  for (y = 0; y < Cedit.terminalRows; y++)
+  {
+    off_t offset = hex->top + (off_t)y * width;
+    if (offset - hex->top >= shown)
+      appendBuffer(&line, "~", 1);
+    else
+    {
+      char buffer[24];
+      int length = snprintf(buffer, sizeof(buffer), "%0*llx", digits, (long long)offset);
+      appendBuffer(&line, buffer, length);
+      int count = hex->size - offset < width ? (int)(hex->size - offset) : width;
+      for (j = 0; j < width; j++)
+      {
+        appendBuffer(&line, "  ", j % 8 ? 1 : 2);
+        if (j < count)
+          ceditHexByte(&line, offset + j, window[offset - hex->top + j], 0);
+        else
+          appendBuffer(&line, "  ", 2);
+      }
+      appendBuffer(&line, "  ", 2);
+      for (j = 0; j < count; j++)
+        ceditHexByte(&line, offset + j, window[offset - hex->top + j], 1);
+    }
+
+    appendBuffer(&line, "\x1b[K", 3);
+    ceditEmitLine(bc, y, &line);
+    line.length = 0;
+  }
+  freeBuffer(&line);
+  free(window);
+}
+
+void ceditHexCursor(int *row, int *column)
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  int width = ceditHexWidth();
+  int at = hex->cursor % width;
+  *row = (hex->cursor - hex->top) / width;
+  *column = ceditHexColumn(width, at, hex->ascii) + (hex->ascii ? 0 : hex->nibble);
+}
+
+int ceditHexPattern(char *query, unsigned char *pattern)
+{
+  // Pairs of hex digits, blanks between them ignored; a quote searches for
+  // the text after it
+  int length = 0, high = -1;
+  if (query[0] == '"')
+  {
+    length = strlen(query + 1);
+    memcpy(pattern, query + 1, length);
+    return length;
+  }
+  for (; *query; query++)
+  {
+    int character = (unsigned char)*query;
+    if (character == ' ')
+      continue;
+    if (!isxdigit(character))
+      return -1;
+    int digit = isdigit(character) ? character - '0' : tolower(character) - 'a' + 10;
+    if (high == -1)
+      high = digit;
+    else
+    {
+      pattern[length++] = high << 4 | digit;
+      high = -1;
+    }
+  }
+  return high == -1 ? length : -1;
+}
+
+off_t ceditHexBackward(unsigned char *pattern, int length, off_t high, off_t low)
+{
+  // The last match starting between low and high
+  unsigned char *map = Cedit.hex.map;
+  while (high >= low)
+  {
+    unsigned char *candidate = memrchr(map + low, pattern[0], high - low + 1);
+    if (!candidate)
+      return -1;
+    if (!memcmp(candidate, pattern, length))
+      return candidate - map;
+    high = candidate - map - 1;
+  }
+  return -1;
+}
+
+off_t ceditHexScan(unsigned char *pattern, int length, off_t from, int direction)
+{
+  // From the given offset to the end of the file (or the start, going
+  // back), then around from the other end
+  struct ceditHexView *hex = &Cedit.hex;
+  if (length <= 0 || length > hex->size)
+    return -1;
+  off_t last = hex->size - length;
+  if (direction == 1)
+  {
+    if (from > last)
+      from = 0;
+    unsigned char *match = memmem(hex->map + from, hex->size - from, pattern, length);
+    if (!match && from > 0)
+      match = memmem(hex->map, from + length - 1 < hex->size ? from + length - 1 : hex->size,
+                     pattern, length);
+    return match ? match - hex->map : -1;
+  }
+  if (from > last)
+    from = last;
+  off_t match = from >= 0 ? ceditHexBackward(pattern, length, from, 0) : -1;
+  if (match == -1 && from < last)
+    match = ceditHexBackward(pattern, length, last, from + 1);
+  return match;
+}
+
+off_t ceditHexSearch(unsigned char *pattern, int length, off_t from, int direction)
+{
+  if (Cedit.hex.stale)
+    return -1;
+  if (sigsetjmp(ceditHexFault, 1))
+  {
+    ceditHexGuarded = 0;
+    ceditHexStale();
+    return -1;
+  }
+  ceditHexGuarded = 1;
+  off_t match = ceditHexScan(pattern, length, from, direction);
+  ceditHexGuarded = 0;
+  return match;
+}
+
+void ceditHexFindCallback(char *query, int key)
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  int direction;
+  if (key == '\r' || key == ARROW_RIGHT || key == ARROW_DOWN)
+    direction = 1;
+  else if (key == ARROW_LEFT || key == ARROW_UP)
+    direction = -1;
+  else
+    return;
+
+  // Searching a large file takes a while, so it waits for Enter or an arrow
+  hex->matchLength = 0;
+  unsigned char *pattern = malloc(strlen(query) + 1);
+  int length = ceditHexPattern(query, pattern);
+  off_t match = -1;
+  if (length > 0)
+    match = ceditHexSearch(pattern, length, key == '\r' ? hex->cursor : hex->cursor + direction, direction);
+  free(pattern);
+
+  if (hex->stale)
+    return;
+  if (length <= 0)
+    ceditSetStatusMessage("Search for hex bytes (de ad 00), or \"text");
+  else if (match == -1)
+    ceditSetStatusMessage("Not found: %s", query);
+  else
+  {
+    ceditHexMove(match);
+    hex->matchOffset = match;
+    hex->matchLength = length;
+  }
+}
+
+void ceditHexFind()
+{
+  off_t savedCursor = Cedit.hex.cursor;
+  off_t savedTop = Cedit.hex.top;
+
+  char *query = ceditPrompt("Search bytes: %s (hex, or \"text; Use ESC/Arrows/Enter)",
+                            ceditHexFindCallback);
+
+  if (query)
+  {
+    free(query);
+  }
+  else
+  {
+    ceditHexMove(savedCursor);
+    Cedit.hex.top = savedTop;
+    Cedit.hex.matchLength = 0;
+  }
+}
+
+void ceditHexGoto()
+{
+  char *answer = ceditPrompt("Go to offset: %s (0x for hex, ESC to cancel)", NULL);
+  if (answer == NULL)
+    return;
+  char *end;
+  int base = answer[0] == '0' && (answer[1] == 'x' || answer[1] == 'X') ? 16 : 10;
+  long long offset = strtoll(answer, &end, base);
+  if (*end || offset < 0 || offset >= Cedit.hex.size)
+    ceditSetStatusMessage("No offset %s in this file", answer);
+  else
+    ceditHexMove(offset);
+  free(answer);
+}
+
+void ceditHexSave()
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  if (Cedit.diskChanged)
+  {
+    ceditSetStatusMessage("File changed on disk. Press ctrl+O to reload");
+    return;
+  }
+
+  // Edits are kept in offset order, so each run of adjacent bytes is one write
+  int fd = open(Cedit.fileName, O_WRONLY);
+  int error = errno;
+  long long written = 0;
+  int k = 0;
+  while (fd != -1 && k < hex->editNum)
+  {
+    int run = 1;
+    while (k + run < hex->editNum && hex->edits[k + run].offset == hex->edits[k].offset + run)
+      run++;
+    if (pwrite(fd, hex->map + hex->edits[k].offset, run, hex->edits[k].offset) != run)
+    {
+      error = errno;
+      break;
+    }
+    written += run;
+    k += run;
+  }
+  int failed = fd == -1 || k < hex->editNum;
+  if (!failed && ((Cedit.saveSync == SYNC_DATA && fdatasync(fd) == -1) ||
+                  (Cedit.saveSync == SYNC_FULL && fsync(fd) == -1)))
+  {
+    error = errno;
+    failed = 1;
+  }
+  if (fd != -1)
+    close(fd);
+  if (failed)
+  {
+    ceditSetStatusMessage("Can't save! I/O error: %s", strerror(error));
+    return;
+  }
+
+  hex->editNum = 0;
+  Cedit.modified = 0;
+  ceditWatchFile();
+  ceditSetStatusMessage("%lld bytes written to disk", written);
+}
+
+void ceditHexReload()
+{
+  if (ceditModified())
+  {
+    char *answer = ceditPrompt("Discard unsaved changes and reload? (y/n): %s", NULL);
+    int discard = answer && (answer[0] == 'y' || answer[0] == 'Y');
+    free(answer);
+    if (!discard)
+      return;
+  }
+  if (access(Cedit.fileName, R_OK) == -1)
+  {
+    ceditSetStatusMessage("Can't reload! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  // A file that is no longer binary comes back as rows
+  char *fileName = strdup(Cedit.fileName);
+  ceditHexClose();
+  ceditOpen(fileName);
+  free(fileName);
+  ceditSetStatusMessage("Reloaded %s", Cedit.fileName);
+}
+
+int ceditHexKeypress(int character)
+{
+  struct ceditHexView *hex = &Cedit.hex;
+  int width = ceditHexWidth();
+  off_t page = (off_t)Cedit.terminalRows * width;
+  hex->matchLength = 0;
+
+  switch (character)
+  {
+  case ctrl('q'):
+  case ctrl('s'):
+  case ctrl('w'):
+  case ctrl('g'):
+  case ctrl('l'):
+  case '\x1b':
+    return 0;
+
+  case ctrl('f'):
+    ceditHexFind();
+    break;
+
+  case ctrl('n'):
+    ceditHexGoto();
+    break;
+
+  case ctrl('o'):
+    ceditHexReload();
+    break;
+
+  case '\t':
+    hex->ascii = !hex->ascii;
+    hex->nibble = 0;
+    break;
+
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    ceditHexMove(hex->cursor + (character == ARROW_LEFT ? -1 : 1));
+    break;
+
+  case ARROW_UP:
+    if (hex->cursor >= width)
+      ceditHexMove(hex->cursor - width);
+    break;
+
+  case ARROW_DOWN:
+    if (hex->cursor - hex->cursor % width + width < hex->size)
+      ceditHexMove(hex->cursor + width);
+    break;
+
+  case PAGE_UP:
+  case PAGE_DOWN:
+    ceditHexMove(hex->cursor + (character == PAGE_UP ? -page : page));
+    break;
+
+  case HOME_KEY:
+    ceditHexMove(hex->cursor - hex->cursor % width);
+    break;
+
+  case END_KEY:
+    ceditHexMove(hex->cursor - hex->cursor % width + width - 1);
+    break;
+
+  default:
+    if (character < ' ' || character >= 127)
+      ceditSetStatusMessage("Not available in the hex view");
+    else if (hex->stale)
+      ceditSetStatusMessage("File changed on disk. Press ctrl+O to reload");
+    else if (hex->ascii)
+    {
+      ceditHexWrite(hex->cursor, character);
+      ceditHexMove(hex->cursor + 1);
+    }
+    else if (!isxdigit(character))
+      ceditSetStatusMessage("Type hex digits here, or Tab to type text");
+    else
+    {
+      int digit = isdigit(character) ? character - '0' : tolower(character) - 'a' + 10;
+      unsigned char byte;
+      if (ceditHexCopy(&byte, hex->map + hex->cursor, 1) == -1)
+        break;
+      if (hex->nibble)
+      {
+        ceditHexWrite(hex->cursor, (byte & 0xf0) | digit);
+        ceditHexMove(hex->cursor + 1);
+      }
+      else
+      {
+        ceditHexWrite(hex->cursor, (byte & 0x0f) | digit << 4);
+        hex->nibble = 1;
+      }
+    }
+    break;
+  }
+  return 1;
+}
+
+/*** BATCH MODE ***/
+
+/*
+  cedit --batch script file... runs the same edit script over every file
+  without touching the terminal. The script is parsed once; worker threads
+  then take files off a shared counter, each opening, editing and writing
+  its file in a document of its own, so nothing but the counter and the
+  report is shared between them.
+*/
+
+int ceditBatchReplaceStep(char *argument, struct ceditBatchStep *step)
+{
+  // replace /OLD/NEW/ where any character can stand in for the slash
+  char delimiter = argument[0];
+  if (delimiter == '\0')
+    return 0;
+  char *query = argument + 1;
+  char *middle = strchr(query, delimiter);
+  if (middle == NULL || middle == query)
+    return 0;
+  char *last = strchr(middle + 1, delimiter);
+  if (last == NULL || last[1] != '\0')
+    return 0;
+
+  step->operation = BATCH_REPLACE;
+  step->length = middle - query;
+  step->text = strndup(query, step->length);
+  step->replacementLength = last - middle - 1;
+  step->replacement = strndup(middle + 1, step->replacementLength);
+  return 1;
+}
+
+int ceditBatchParse(char *scriptName, struct ceditBatch *batch)
+{
+  FILE *fp = fopen(scriptName, "r");
+  if (!fp)
+  {
+    fprintf(stderr, "%s: %s\n", scriptName, strerror(errno));
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t lineLength;
+  int lineNum = 0;
+  int error = 0;
+  while (!error && (lineLength = getline(&line, &lineCap, fp)) != -1)
+  {
+    lineNum++;
+    while (lineLength > 0 && (line[lineLength - 1] == '\n' ||
+                              line[lineLength - 1] == '\r'))
+      line[--lineLength] = '\0';
+    if (lineLength == 0 || line[0] == '#')
+      continue;
+
+    // Line transforms read their own range and options, so they keep the line
+    struct ceditBatchStep step = {0};
+    struct ceditTransform transform;
+    step.line = lineNum;
+    step.count = 1;
+    if (ceditTransformParse(line, &transform) == 0)
+    {
+      step.operation = BATCH_TRANSFORM;
+      step.text = strdup(line);
+      step.length = strlen(line);
+    }
+
+    // The command is the first word, the argument everything after the space
+    char *argument = line + strcspn(line, " ");
+    if (*argument == ' ')
+      *argument++ = '\0';
+
+    if (step.operation == BATCH_TRANSFORM)
+      ;
+    else if (!strcmp(line, "goto") && atoi(argument) > 0)
+    {
+      step.operation = BATCH_GOTO;
+      step.count = atoi(argument);
+    }
+    else if (!strcmp(line, "find") && *argument)
+    {
+      step.operation = BATCH_FIND;
+      step.length = strlen(argument);
+      step.text = strdup(argument);
+    }
+    else if (!strcmp(line, "insert") || !strcmp(line, "append"))
+    {
+      step.operation = line[0] == 'i' ? BATCH_INSERT : BATCH_APPEND;
+      step.length = strlen(argument);
+      step.text = strdup(argument);
+    }
+    else if (!strcmp(line, "delete") && (*argument == '\0' || atoi(argument) > 0))
+    {
+      step.operation = BATCH_DELETE;
+      step.count = *argument ? atoi(argument) : 1;
+    }
+    else if (!strcmp(line, "replace") && ceditBatchReplaceStep(argument, &step))
+      ;
+    else
+    {
+      fprintf(stderr, "%s:%d: unknown command \"%s\"\n", scriptName, lineNum, line);
+      error = 1;
+      continue;
+    }
+
+    if (batch->stepNum % 16 == 0)
+      batch->steps = realloc(batch->steps, sizeof(struct ceditBatchStep) * (batch->stepNum + 16));
+    batch->steps[batch->stepNum++] = step;
+  }
+  free(line);
+  fclose(fp);
+  return error ? -1 : 0;
+}
+
+int ceditBatchFind(char *text, int length)
+{
+  // The search starts at the cursor and leaves it just past the match
+  int j;
+  for (j = Cedit.cursorY; j < Cedit.rowNum; j++)
+  {
+    editorRow *row = &Cedit.row[j];
+    int from = j == Cedit.cursorY ? Cedit.cursorX : 0;
+    if (from > row->size)
+      from = row->size;
+    char *characters = ceditRowText(row);
+    char *match = ceditSearch(characters + from, row->size - from, text, length);
+    if (match)
+    {
+      Cedit.cursorY = j;
+      Cedit.cursorX = match - characters + length;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int ceditBatchApply(struct ceditBatch *batch)
+{
+  // Returns the step a failed find stopped at, or -1 once the script is done
+  struct ceditTransform transform;
+  int j, k, rows;
+  for (j = 0; j < batch->stepNum; j++)
+  {
+    struct ceditBatchStep *step = &batch->steps[j];
+    switch (step->operation)
+    {
+    case BATCH_GOTO:
+      Cedit.cursorY = step->count - 1 < Cedit.rowNum ? step->count - 1 : Cedit.rowNum;
+      Cedit.cursorX = 0;
+      break;
+    case BATCH_FIND:
+      if (!ceditBatchFind(step->text, step->length))
+        return j;
+      break;
+    case BATCH_REPLACE:
+      ceditReplaceRows(step->text, step->length, step->replacement, step->replacementLength, &rows);
+      break;
+    case BATCH_INSERT:
+      ceditInsertRow(Cedit.cursorY, step->text, step->length);
+      Cedit.cursorY++;
+      break;
+    case BATCH_APPEND:
+      Cedit.cursorY = Cedit.cursorY < Cedit.rowNum ? Cedit.cursorY + 1 : Cedit.rowNum;
+      Cedit.cursorX = 0;
+      ceditInsertRow(Cedit.cursorY, step->text, step->length);
+      break;
+    case BATCH_DELETE:
+      for (k = 0; k < step->count && Cedit.cursorY < Cedit.rowNum; k++)
+        ceditDeleteRow(Cedit.cursorY);
+      Cedit.cursorX = 0;
+      break;
+    case BATCH_TRANSFORM:
+      ceditTransformParse(step->text, &transform);
+      ceditTransformRun(&transform);
+      break;
+    }
+  }
+  return -1;
+}
+
+int ceditBatchWrite(char *fileName)
+{
+  int length;
+  char *buffer = ceditRowToString(&length);
+  int fd = open(fileName, O_RDWR | O_CREAT, 0644);
+  int written = 0;
+  if (fd != -1 && ftruncate(fd, length) != -1)
+  {
+    ssize_t n;
+    while (written < length && (n = write(fd, buffer + written, length - written)) > 0)
+      written += n;
+  }
+  int error = errno;
+  if (fd != -1)
+    close(fd);
+  free(buffer);
+  errno = error;
+  return written == length && fd != -1 ? 0 : -1;
+}
+
+void *ceditBatchWorker(void *argument)
+{
+  struct ceditBatch *batch = argument;
+  struct ceditConfig *document = malloc(sizeof(struct ceditConfig));
+  ceditContext = document;
+
+  while (1)
+  {
+    pthread_mutex_lock(&batch->lock);
+    int file = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (file >= batch->fileNum)
+      break;
+    char *fileName = batch->files[file];
+
+    // ceditOpen ends the whole process on a file it can't read, so check first
+    struct stat st;
+    const char *problem = NULL;
+    if (stat(fileName, &st) == -1 || access(fileName, R_OK | W_OK) == -1)
+      problem = strerror(errno);
+    else if (!S_ISREG(st.st_mode))
+      problem = "not a regular file";
+    if (problem)
+    {
+      fprintf(stderr, "%s: %s\n", fileName, problem);
+      pthread_mutex_lock(&batch->lock);
+      batch->failed = 1;
+      pthread_mutex_unlock(&batch->lock);
+      continue;
+    }
+
+    memset(document, 0, sizeof(struct ceditConfig));
+    ceditInitDocument();
+    ceditOpen(fileName);
+    int stopped = ceditBatchApply(batch);
+    int modified = ceditModified();
+
+    if (modified && ceditBatchWrite(fileName) == -1)
+    {
+      fprintf(stderr, "%s: %s\n", fileName, strerror(errno));
+      pthread_mutex_lock(&batch->lock);
+      batch->failed = 1;
+      pthread_mutex_unlock(&batch->lock);
+    }
+    else if (stopped != -1)
+      printf("%s: %s, stopped at script line %d: no match for \"%s\"\n", fileName,
+             modified ? "updated" : "unchanged", batch->steps[stopped].line, batch->steps[stopped].text);
+    else
+      printf("%s: %s\n", fileName, modified ? "updated" : "unchanged");
+    ceditCloseDocument();
+  }
+
+  free(document);
+  ceditContext = &ceditMain;
+  return NULL;
+}
+
+int ceditBatchRun(char *scriptName, char **files, int fileNum, int jobs)
+{
+  struct ceditBatch batch;
+  memset(&batch, 0, sizeof(batch));
+  if (ceditBatchParse(scriptName, &batch) == -1)
+    return 2;
+
+  batch.files = files;
+  batch.fileNum = fileNum;
+  pthread_mutex_init(&batch.lock, NULL);
+  ceditHeadless = 1;
+
+  if (jobs <= 0)
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs > fileNum)
+    jobs = fileNum;
+  if (jobs < 1)
+    jobs = 1;
+
+  pthread_t *workers = malloc(sizeof(pthread_t) * jobs);
+  int j;
+  for (j = 0; j < jobs; j++)
+    if (pthread_create(&workers[j], NULL, ceditBatchWorker, &batch) != 0)
+      terminateProgram("Batch Thread Error!");
+  for (j = 0; j < jobs; j++)
+    pthread_join(workers[j], NULL);
+  free(workers);
+
+  for (j = 0; j < batch.stepNum; j++)
+  {
+    free(batch.steps[j].text);
+    free(batch.steps[j].replacement);
+  }
+  free(batch.steps);
+  pthread_mutex_destroy(&batch.lock);
+  return batch.failed ? 1 : 0;
+}
+
+/*** SESSION TRACES ***/
+
+/*
+  --record=FILE writes every key ceditReadCharacter hands out to a trace,
+  eight bytes a key: the microseconds since the previous event and the key
+  itself. The trace opens with CEDIT_TRACE_MAGIC and the terminal size, in
+  the byte order of the machine that wrote it.
+
+  --replay=FILE feeds the keys back through ceditProcessKeypress, at the
+  pace they were typed or (--replay-speed=fast) back to back, and draws
+  every frame into /dev/null at the recorded size. Timing each key's
+  handling and the frame after it turns a session that felt slow into a
+  benchmark; the summary is printed when the editor exits, from ctrl+Q or
+  the end of the trace. The file has to be as it was when recording began.
+*/
+
+void ceditTraceWrite(int32_t key)
+{
+  long long now = ceditNanos();
+  long long delta = ceditTrace.last ? (now - ceditTrace.last) / 1000 : 0;
+  struct ceditTraceEvent event;
+  event.delta = delta > UINT32_MAX ? UINT32_MAX : delta;
+  event.key = key;
+  ceditTrace.last = now;
+
+  // Flushed per key, so the trace survives whatever the session ends in
+  if (fwrite(&event, sizeof(event), 1, ceditTrace.fp) != 1 || fflush(ceditTrace.fp) == EOF)
+  {
+    fclose(ceditTrace.fp);
+    ceditTrace.fp = NULL;
+    ceditSetStatusMessage("Recording stopped: %s", strerror(errno));
+  }
+}
+
+int ceditTraceRecord(char *traceName)
+{
+  ceditTrace.fp = fopen(traceName, "wb");
+  if (!ceditTrace.fp)
+    return -1;
+  if (fwrite(CEDIT_TRACE_MAGIC, 8, 1, ceditTrace.fp) != 1)
+    return -1;
+  ceditTraceWrite(CEDIT_TRACE_SIZE(Cedit.terminalRows + 2, Cedit.terminalColumns));
+  return 0;
+}
+
+int ceditTraceReplay(char *traceName, int fast)
+{
+  char magic[8];
+  struct ceditTraceEvent event;
+  ceditTrace.fp = fopen(traceName, "rb");
+  if (!ceditTrace.fp)
+    return -1;
+  if (fread(magic, 8, 1, ceditTrace.fp) != 1 || memcmp(magic, CEDIT_TRACE_MAGIC, 8) ||
+      fread(&event, sizeof(event), 1, ceditTrace.fp) != 1 || event.key >= 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+  ceditTrace.rows = (event.key >> 16) & 0x7fff;
+  ceditTrace.columns = event.key & 0xffff;
+  if (ceditTrace.rows < 3 || ceditTrace.columns < 1)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int null = open("/dev/null", O_WRONLY);
+  ceditTrace.report = dup(STDOUT_FILENO);
+  if (null == -1 || ceditTrace.report == -1 || dup2(null, STDOUT_FILENO) == -1)
+    return -1;
+  close(null);
+
+  ceditTrace.replaying = 1;
+  ceditTrace.fast = fast;
+  ceditTrace.start = ceditTrace.last = ceditNanos();
+  atexit(ceditTraceReport);
+  return 0;
+}
+
+void ceditTraceResize(int32_t key)
+{
+  Cedit.terminalRows = ((key >> 16) & 0x7fff) - 2;
+  Cedit.terminalColumns = key & 0xffff;
+  if (Cedit.terminalRows < 1)
+    Cedit.terminalRows = 1;
+  ceditOutputReset();
+}
+
+int ceditTraceTimeout()
+{
+  if (!ceditTrace.replaying)
+    return -1;
+  long long wait = ceditTrace.last - ceditNanos();
+  if (ceditTrace.fast || wait <= 0)
+    return 0;
+  return (wait + 999999) / 1000000;
+}
+
+int ceditTraceNext()
+{
+  struct ceditTraceEvent event;
+  while (fread(&event, sizeof(event), 1, ceditTrace.fp) == 1)
+  {
+    // Time spent waiting for a key to fall due is not the editor's
+    long long before = ceditNanos();
+    ceditTrace.last += event.delta * 1000LL;
+    ceditWaitForInput();
+    ceditTrace.waited += ceditNanos() - before;
+
+    if (event.key < 0)
+    {
+      ceditTraceResize(event.key);
+      continue;
+    }
+    if (!Cedit.frame.pending)
+      Cedit.frame.pending = ceditNanos();
+    // A prompt reads several keys in one event; the first one names it
+    if (ceditTrace.eventNum && ceditTrace.keys[ceditTrace.eventNum - 1] == -1)
+      ceditTrace.keys[ceditTrace.eventNum - 1] = event.key;
+    return event.key;
+  }
+
+  // A key wanted past the end of the trace ends the replay
+  ceditSaveWait();
+  exit(0);
+}
+
+void ceditReplay()
+{
+  ceditRefreshTerminal();
+  ceditTrace.startup = ceditNanos() - ceditTrace.start;
+
+  while (1)
+  {
+    int next = getc(ceditTrace.fp);
+    if (next == EOF)
+    {
+      ceditSaveWait();
+      exit(0);
+    }
+    ungetc(next, ceditTrace.fp);
+
+    if (ceditTrace.eventNum == ceditTrace.eventCapacity)
+    {
+      ceditTrace.eventCapacity = ceditTrace.eventCapacity ? ceditTrace.eventCapacity * 2 : 1024;
+      ceditTrace.process = realloc(ceditTrace.process, sizeof(long long) * ceditTrace.eventCapacity);
+      ceditTrace.render = realloc(ceditTrace.render, sizeof(long long) * ceditTrace.eventCapacity);
+      ceditTrace.keys = realloc(ceditTrace.keys, sizeof(int) * ceditTrace.eventCapacity);
+      if (!ceditTrace.process || !ceditTrace.render || !ceditTrace.keys)
+        terminateProgram("Memory Error!");
+    }
+
+    // Counted before the work, so a key that quits is reported too
+    int n = ceditTrace.eventNum++;
+    ceditTrace.keys[n] = -1;
+    ceditTrace.process[n] = ceditTrace.render[n] = 0;
+    ceditTrace.waited = 0;
+    long long start = ceditNanos();
+    ceditProcessKeypress();
+    long long processed = ceditNanos();
+    ceditTrace.process[n] = processed - start - ceditTrace.waited;
+    ceditRefreshTerminal();
+    ceditTrace.render[n] = ceditNanos() - processed;
+  }
+}
+
+int ceditTraceCompare(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+void ceditTraceSummary(char *name, long long *times, int count)
+{
+  long long total = 0;
+  int j;
+  for (j = 0; j < count; j++)
+    total += times[j];
+  qsort(times, count, sizeof(long long), ceditTraceCompare);
+  dprintf(ceditTrace.report, "  %-8s avg %8.3f  p50 %8.3f  p99 %8.3f  max %8.3f ms\n", name,
+          total / 1e6 / count, times[count / 2] / 1e6, times[count * 99 / 100] / 1e6,
+          times[count - 1] / 1e6);
+}
+
+void ceditTraceReport()
+{
+  int count = ceditTrace.eventNum;
+  dprintf(ceditTrace.report, "replay: %d events in %.3f s, startup %.3f ms\n", count,
+          (ceditNanos() - ceditTrace.start) / 1e9, ceditTrace.startup / 1e6);
+  if (count == 0)
+    return;
+
+  int slowest = 0, j;
+  for (j = 1; j < count; j++)
+    if (ceditTrace.process[j] + ceditTrace.render[j] >
+        ceditTrace.process[slowest] + ceditTrace.render[slowest])
+      slowest = j;
+  dprintf(ceditTrace.report, "  slowest  event %d (key %d), %.3f ms handling, %.3f ms drawing\n",
+          slowest + 1, ceditTrace.keys[slowest], ceditTrace.process[slowest] / 1e6,
+          ceditTrace.render[slowest] / 1e6);
+  ceditTraceSummary("handling", ceditTrace.process, count);
+  ceditTraceSummary("drawing", ceditTrace.render, count);
+  long long plainBytes = Cedit.output.bytes + Cedit.output.saved;
+  dprintf(ceditTrace.report, "  output   %lld bytes in %lld frames, %lld per frame (%lld drawing whole lines)\n",
+          Cedit.output.bytes, Cedit.frame.frames, Cedit.frame.frames ? Cedit.output.bytes / Cedit.frame.frames : 0,
+          Cedit.frame.frames ? plainBytes / Cedit.frame.frames : 0);
+}
+
+/*** BUFFER LIST ***/
+
+/*
+  Each file named on the command line, or opened with ctrl+W, is a buffer
+  with a document of its own. Only the first is loaded at startup; the
+  others are no more than a name until they are first shown, so opening
+  many files is as quick as opening one and memory grows with the files
+  actually visited. A buffer keeps its rows, cursor, search results and
+  folds while another is shown, and switching back costs nothing but a
+  redraw.
+
+  The screen belongs to the terminal rather than to a document, so what
+  describes it (its size, the cells last sent and their hashes, the frame
+  timings) is handed to the document being shown.
+*/
+
+void ceditInheritOptions(struct ceditConfig *from)
+{
+  Cedit.saveSync = from->saveSync;
+  Cedit.cold.budget = from->cold.budget;
+  Cedit.indexCache = from->indexCache;
+  Cedit.intern.enabled = from->intern.enabled;
+  Cedit.frame.interval = from->frame.interval;
+}
+
+int ceditBufferAdd(char *fileName)
+{
+  struct ceditBuffer *buffers = realloc(ceditBuffers.buffers,
+                                        sizeof(struct ceditBuffer) * (ceditBuffers.bufferNum + 1));
+  if (buffers == NULL)
+    terminateProgram("Memory Error!");
+  ceditBuffers.buffers = buffers;
+
+  int k = ceditBuffers.bufferNum++;
+  ceditBuffers.buffers[k].fileName = fileName ? strdup(fileName) : NULL;
+  ceditBuffers.buffers[k].document = NULL;
+  return k;
+}
+
+char *ceditBufferName(int k)
+{
+  struct ceditBuffer *buffer = &ceditBuffers.buffers[k];
+  // A loaded buffer may since have been saved under another name
+  return buffer->document ? buffer->document->fileName : buffer->fileName;
+}
+
+int ceditBufferFind(char *name)
+{
+  int k, found = -1, matches = 0;
+  for (k = 0; k < ceditBuffers.bufferNum; k++)
+  {
+    char *fileName = ceditBufferName(k);
+    if (fileName && !strcmp(fileName, name))
+      return k;
+  }
+  // Otherwise any part of a name will do, as long as only one buffer has it
+  for (k = 0; k < ceditBuffers.bufferNum; k++)
+  {
+    char *fileName = ceditBufferName(k);
+    if (fileName && strstr(fileName, name))
+    {
+      found = k;
+      matches++;
+    }
+  }
+  return matches == 1 ? found : matches > 1 ? -2 : -1;
+}
+
+void ceditBufferHandOver(struct ceditConfig *from, struct ceditConfig *to)
+{
+  to->terminalRows = from->terminalRows;
+  to->terminalColumns = from->terminalColumns;
+  to->terminalDefault = from->terminalDefault;
+  to->screenHash = from->screenHash;
+  to->output = from->output;
+  to->frame = from->frame;
+  from->screenHash = NULL;
+  from->output.cells = NULL;
+  from->output.scratch = NULL;
+
+  // Nothing on screen is from this document, so there is nothing to scroll
+  to->screenRowOff = to->rowOff;
+  to->screenColumnOff = to->columnOff;
+}
+
+int ceditBufferShow(int k)
+{
+  struct ceditBuffer *buffer = &ceditBuffers.buffers[k];
+  struct ceditConfig *from = ceditContext;
+  if (k == ceditBuffers.current)
+    return 0;
+
+  // Checked first, since ceditOpen gives up on the whole editor
+  int missing = 0;
+  const char *problem = NULL;
+  struct stat st;
+  if (buffer->document == NULL && buffer->fileName)
+  {
+    if (stat(buffer->fileName, &st) == -1)
+    {
+      missing = errno == ENOENT;
+      if (!missing)
+        problem = strerror(errno);
+    }
+    else if (!S_ISREG(st.st_mode))
+      problem = "Not a regular file";
+    else if (access(buffer->fileName, R_OK) == -1)
+      problem = strerror(errno);
+  }
+  if (problem)
+  {
+    ceditSetStatusMessage("Can't open %s: %s", buffer->fileName, problem);
+    return -1;
+  }
+
+  // A save reports back through this document's watches, which stop being
+  // polled once it is hidden
+  ceditSaveWait();
+
+  int fresh = buffer->document == NULL;
+  if (fresh)
+  {
+    buffer->document = calloc(1, sizeof(struct ceditConfig));
+    if (buffer->document == NULL)
+      terminateProgram("Memory Error!");
+    ceditContext = buffer->document;
+    ceditInitDocument();
+    ceditInheritOptions(from);
+  }
+  ceditBufferHandOver(from, buffer->document);
+  ceditContext = buffer->document;
+  ceditBuffers.previous = ceditBuffers.current;
+  ceditBuffers.current = k;
+
+  if (fresh && missing)
+  {
+    // A new file, written on the first save
+    Cedit.fileName = strdup(buffer->fileName);
+    ceditHighlightSyntax();
+  }
+  else if (fresh && buffer->fileName)
+    ceditOpen(buffer->fileName);
+  ceditSetStatusMessage("%s (%d/%d)%s", Cedit.fileName ? Cedit.fileName : "[No Name]", k + 1,
+                        ceditBuffers.bufferNum, fresh && missing ? " [new file]" : "");
+  return 0;
 }
 
-void ceditMoveCursor(int key)
+int ceditBufferModified()
 {
-  editorRow *row = (Cedit.cursorY >= Cedit.rowNum) ? NULL : &Cedit.row[Cedit.cursorY];
+  struct ceditConfig *self = ceditContext;
+  int k, count = 0;
+  for (k = 0; k < ceditBuffers.bufferNum; k++)
+  {
+    if (ceditBuffers.buffers[k].document == NULL || ceditBuffers.buffers[k].document == self)
+      continue;
+    ceditContext = ceditBuffers.buffers[k].document;
+    count += ceditModified();
+  }
+  ceditContext = self;
+  return count;
+}
 
-  switch (key)
+void ceditBufferPrompt()
+{
+  // The buffers are listed in the prompt itself, most of them as their base name
+  char prompt[sizeof(Cedit.statusMessage)];
+  int length = snprintf(prompt, sizeof(prompt), "Buffer");
+  int k;
+  for (k = 0; k < ceditBuffers.bufferNum; k++)
   {
-  case ARROW_LEFT:
-    if (Cedit.cursorX != 0)
-    {
-      Cedit.cursorX--;
-    }
-    else if (Cedit.cursorY > 0)
-    {
-      Cedit.cursorY--;
-      Cedit.cursorX = Cedit.row[Cedit.cursorY].size;
-    }
-    break;
-  case ARROW_RIGHT:
-    if (row && Cedit.cursorX < row->size)
+    char *fileName = ceditBufferName(k);
+    char *base = fileName ? strrchr(fileName, '/') : NULL;
+    base = base ? base + 1 : fileName ? fileName : "[No Name]";
+
+    int modified = 0;
+    if (ceditBuffers.buffers[k].document)
     {
-      Cedit.cursorX++;
+      struct ceditConfig *self = ceditContext;
+      ceditContext = ceditBuffers.buffers[k].document;
+      modified = ceditModified();
+      ceditContext = self;
     }
-    else if (row && Cedit.cursorX == row->size)
+
+    char entry[48];
+    int entryLength = snprintf(entry, sizeof(entry), " %s%d:%.30s%s", k == ceditBuffers.current ? "*" : "",
+                               k + 1, base, modified ? "+" : "");
+    if (entryLength >= (int)sizeof(entry))
+      entryLength = sizeof(entry) - 1;
+    // Room is kept for what is typed, and a % in a name must not reach the format
+    int percents = 0, j;
+    for (j = 0; j < entryLength; j++)
+      percents += entry[j] == '%';
+    if (length + entryLength + percents + 40 >= (int)sizeof(prompt))
     {
-      Cedit.cursorY++;
-      Cedit.cursorX = 0;
+      length += snprintf(prompt + length, sizeof(prompt) - length, " ...");
+      break;
     }
-    break;
-  case ARROW_UP:
-    if (Cedit.cursorY != 0)
+    for (j = 0; j < entryLength; j++)
     {
-      Cedit.cursorY--;
+      if (entry[j] == '%')
+        prompt[length++] = '%';
+      prompt[length++] = entry[j];
     }
-    break;
-  case ARROW_DOWN:
-    if (Cedit.cursorY < Cedit.rowNum)
+    prompt[length] = '\0';
+  }
+  snprintf(prompt + length, sizeof(prompt) - length, " | number, name, - (last): %%s");
+
+  char *answer = ceditPrompt(prompt, NULL);
+  if (answer == NULL)
+    return;
+
+  int target = -1;
+  char *end;
+  long number = strtol(answer, &end, 10);
+  if (!strcmp(answer, "-"))
+    target = ceditBuffers.previous;
+  else if (*end == '\0')
+  {
+    if (number < 1 || number > ceditBuffers.bufferNum)
+      ceditSetStatusMessage("No buffer %s", answer);
+    else
+      target = number - 1;
+  }
+  else
+  {
+    target = ceditBufferFind(answer);
+    if (target == -2)
+      ceditSetStatusMessage("More than one buffer matches %s", answer);
+    else if (target == -1)
     {
-      Cedit.cursorY++;
+      // Not open yet: it becomes a buffer, unless it cannot be opened
+      target = ceditBufferAdd(answer);
+      if (ceditBufferShow(target) == -1)
+      {
+        free(ceditBuffers.buffers[target].fileName);
+        ceditBuffers.bufferNum--;
+      }
+      target = -1;
     }
-    break;
   }
+  if (target >= 0)
+    ceditBufferShow(target);
+  free(answer);
+}
 
-  row = (Cedit.cursorY >= Cedit.rowNum) ? NULL : &Cedit.row[Cedit.cursorY];
-  int rowLength = row ? row->size : 0;
-  if (Cedit.cursorX > rowLength)
+/*** SERVER MODE ***/
+
+/*
+  --server keeps the files opened through it loaded, highlighted and with
+  their bracket index built, and waits on a Unix domain socket for
+  --client. The client sends its directory, the file name and TERM along
+  with its terminal (SCM_RIGHTS), then sleeps until the socket closes.
+
+  Each client gets a child of the server, which takes over the terminal and
+  edits a copy-on-write image of the warm document: opening costs a fork
+  instead of a load. Edits stay in the child and are saved to disk as
+  usual; a file that no longer matches what was loaded is loaded again the
+  next time a client asks for it. The CEDIT_SERVER_DOCUMENTS files used
+  most recently are kept.
+*/
+
+int ceditServerAddress(struct sockaddr_un *address)
+{
+  char *runtime = getenv("XDG_RUNTIME_DIR");
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (runtime && runtime[0])
   {
-    Cedit.cursorX = rowLength;
+    snprintf(address->sun_path, sizeof(address->sun_path), "%s/cedit.sock", runtime);
+    return 0;
+  }
+
+  // Anyone can create names in /tmp, so the socket goes in a directory
+  // that must be ours and closed to everyone else
+  char directory[32];
+  struct stat st;
+  snprintf(directory, sizeof(directory), "/tmp/cedit-%d", (int)getuid());
+  snprintf(address->sun_path, sizeof(address->sun_path), "%s/cedit.sock", directory);
+  if (mkdir(directory, 0700) == -1 && errno != EEXIST)
+    return -1;
+  if (lstat(directory, &st) == -1)
+    return -1;
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077))
+  {
+    errno = EACCES;
+    return -1;
   }
+  return 0;
 }
 
-void ceditProcessKeypress()
+int ceditClient(char *fileName, int follow)
 {
-  static int quitCount = CEDIT_QUIT_COUNT;
+  // Without a terminal to hand over, or a server to take it, edit here
+  if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) || (fileName && !strcmp(fileName, "-")))
+    return -1;
 
-  int character = ceditReadCharacter();
+  struct ceditServerRequest request;
+  memset(&request, 0, sizeof(request));
+  char *term = getenv("TERM");
+  if ((fileName && strlen(fileName) >= sizeof(request.fileName)) ||
+      getcwd(request.directory, sizeof(request.directory)) == NULL)
+    return -1;
+  if (fileName)
+    strcpy(request.fileName, fileName);
+  if (term)
+    snprintf(request.term, sizeof(request.term), "%s", term);
+  request.follow = follow;
+
+  struct sockaddr_un address;
+  if (ceditServerAddress(&address) == -1)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+  {
+    close(fd);
+    return -1;
+  }
 
-  switch (character)
+  // The terminal, and all that is typed into it, only goes to our own server
+  struct ucred peer;
+  socklen_t peerLength = sizeof(peer);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == -1 || peer.uid != getuid())
   {
-  case '\r':
-    ceditInsertNewline();
-    break;
+    close(fd);
+    return -1;
+  }
 
-  case ctrl('q'):
-    if (Cedit.modified && quitCount > 0)
-    {
-      ceditSetStatusMessage("Warning! File has unsaved changes. "
-                            "Press ctrl+Q %d more times to quit.",
-                            quitCount);
-      quitCount--;
-      return;
-    }
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
-    break;
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec vector = {&request, sizeof(request)};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(header), fds, sizeof(fds));
+  if (sendmsg(fd, &message, 0) != sizeof(request))
+  {
+    close(fd);
+    return -1;
+  }
 
-  case ctrl('s'):
-    ceditSave();
-    break;
+  // The server's child has the terminal until it exits and the socket closes
+  char byte;
+  while (read(fd, &byte, 1) == -1 && errno == EINTR)
+    ;
+  close(fd);
+  return 0;
+}
 
-  case HOME_KEY:
-    Cedit.cursorX = 0;
-    break;
+int ceditServerListen()
+{
+  if (ceditServerAddress(&ceditServer.address) == -1)
+    return -1;
+  ceditServer.listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (ceditServer.listenFd == -1)
+    return -1;
 
-  case END_KEY:
-    if (Cedit.cursorY < Cedit.rowNum)
-      Cedit.cursorX = Cedit.row[Cedit.cursorY].size;
-    break;
+  // A socket nobody answers on is left over from a server that is gone
+  if (connect(ceditServer.listenFd, (struct sockaddr *)&ceditServer.address, sizeof(ceditServer.address)) == 0)
+  {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  close(ceditServer.listenFd);
+  ceditServer.listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  unlink(ceditServer.address.sun_path);
+
+  // Whoever connects gets to edit files as us, so only we may
+  mode_t mask = umask(077);
+  int bound = bind(ceditServer.listenFd, (struct sockaddr *)&ceditServer.address, sizeof(ceditServer.address));
+  umask(mask);
+  if (bound == -1 || listen(ceditServer.listenFd, 16) == -1)
+    return -1;
+  return 0;
+}
 
-  case ctrl('f'):
-    ceditFind();
-    break;
+int ceditServerReceive(int connection, struct ceditServerRequest *request, int *fds)
+{
+  struct ucred peer;
+  socklen_t length = sizeof(peer);
+  if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1 || peer.uid != getuid())
+    return -1;
 
-  case BACKSPACE:
-  case ctrl('h'):
-  case DEL_KEY:
-    if (character == DEL_KEY)
-      ceditMoveCursor(ARROW_RIGHT);
-    ceditDeleteCharacter();
-    break;
+  char control[CMSG_SPACE(sizeof(int) * 3)];
+  struct iovec vector = {request, sizeof(*request)};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t got = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fdNum = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * (fdNum < 3 ? fdNum : 3));
+  if (got != sizeof(*request) || fdNum != 3 || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+  {
+    int j;
+    for (j = 0; j < fdNum && j < 3; j++)
+      close(fds[j]);
+    return -1;
+  }
 
-  case PAGE_UP:
-  case PAGE_DOWN:
+  request->directory[sizeof(request->directory) - 1] = '\0';
+  request->fileName[sizeof(request->fileName) - 1] = '\0';
+  request->term[sizeof(request->term) - 1] = '\0';
+  return 0;
+}
+
+void ceditServerDrop(int k)
+{
+  ceditContext = ceditServer.documents[k];
+  ceditCloseDocument();
+  ceditContext = &ceditMain;
+  free(ceditServer.documents[k]);
+
+  ceditServer.documentNum--;
+  memmove(&ceditServer.documents[k], &ceditServer.documents[k + 1],
+          sizeof(struct ceditConfig *) * (ceditServer.documentNum - k));
+  memmove(&ceditServer.used[k], &ceditServer.used[k + 1], sizeof(long long) * (ceditServer.documentNum - k));
+}
+
+struct ceditConfig *ceditServerDocument(char *path)
+{
+  struct stat st;
+  int found = stat(path, &st) == 0;
+  int k;
+  for (k = 0; k < ceditServer.documentNum; k++)
+    if (!strcmp(ceditServer.documents[k]->fileName, path))
+      break;
+  if (k < ceditServer.documentNum)
   {
-    if (character == PAGE_UP)
+    ceditContext = ceditServer.documents[k];
+    int stale = !found || ceditDiskStatChanged(&st);
+    ceditContext = &ceditMain;
+    if (!stale)
     {
-      Cedit.cursorY = Cedit.rowOff;
-    }
-    else if (character == PAGE_DOWN)
-    {
-      Cedit.cursorY = Cedit.rowOff + Cedit.terminalRows - 1;
-      if (Cedit.cursorY > Cedit.rowNum)
-        Cedit.cursorY = Cedit.rowNum;
+      ceditServer.used[k] = ++ceditServer.clock;
+      return ceditServer.documents[k];
     }
+    ceditServerDrop(k);
+  }
 
-    int times = Cedit.terminalRows;
-    while (times--)
-      ceditMoveCursor(character == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+  // Anything ceditOpen would fail on is left to the child, to fail there
+  if (!found || !S_ISREG(st.st_mode) || access(path, R_OK) == -1)
+    return NULL;
+  if (ceditServer.documentNum == CEDIT_SERVER_DOCUMENTS)
+  {
+    int oldest = 0;
+    for (k = 1; k < ceditServer.documentNum; k++)
+      if (ceditServer.used[k] < ceditServer.used[oldest])
+        oldest = k;
+    ceditServerDrop(oldest);
   }
-  break;
 
-  case ARROW_UP:
-  case ARROW_DOWN:
-  case ARROW_LEFT:
-  case ARROW_RIGHT:
-    ceditMoveCursor(character);
-    break;
+  struct ceditConfig *document = calloc(1, sizeof(struct ceditConfig));
+  ceditContext = document;
+  ceditInitDocument();
+  ceditInheritOptions(&ceditMain);
+
+  // Opened as the editor would, so it is highlighted and kept within the
+  // budget while it loads; each child watches the file for itself
+  ceditHeadless = 0;
+  ceditOpen(path);
+  ceditHeadless = 1;
+  if (Cedit.inotifyFd != -1)
+  {
+    ceditUnwatchFd(Cedit.inotifyFd);
+    close(Cedit.inotifyFd);
+    Cedit.inotifyFd = Cedit.inotifyWatch = -1;
+  }
+  ceditBracketBuild();
+  ceditColdCompact();
+  ceditContext = &ceditMain;
+
+  k = ceditServer.documentNum++;
+  ceditServer.documents[k] = document;
+  ceditServer.used[k] = ++ceditServer.clock;
+  return document;
+}
 
-  case ctrl('l'):
-  case '\x1b':
-    break;
+void ceditServerHangup(int fd)
+{
+  // The client was killed, so the terminal is its shell's again
+  (void)fd;
+  ceditSaveWait();
+  exit(1);
+}
 
-  default:
-    ceditInsertCharacter(character);
-    break;
+void ceditServerSession(int connection, struct ceditConfig *document, struct ceditServerRequest *request, int *fds)
+{
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  close(ceditServer.listenFd);
+  int j;
+  for (j = 0; j < 3; j++)
+  {
+    if (dup2(fds[j], j) == -1)
+      exit(1);
+    if (fds[j] > STDERR_FILENO)
+      close(fds[j]);
   }
+  if (chdir(request->directory) == -1)
+    terminateProgram("Directory Error!");
+  if (request->term[0])
+    setenv("TERM", request->term, 1);
+  else
+    unsetenv("TERM");
 
-  quitCount = CEDIT_QUIT_COUNT;
+  // From here on this is an editor like any other, on the client's terminal
+  ceditHeadless = 0;
+  if (document)
+  {
+    ceditContext = document;
+    free(Cedit.fileName);
+    Cedit.fileName = strdup(request->fileName);
+  }
+  rawModeOn();
+  ceditStartTerminal();
+  ceditOutputDetect(ceditServer.rep);
+  ceditWatchFd(connection, ceditServerHangup);
+  if (document)
+    ceditWatchFile();
+  else if (request->fileName[0])
+    ceditOpen(request->fileName);
+  if (request->follow && Cedit.fileName)
+    ceditToggleFollow();
+  ceditBufferAdd(request->fileName[0] ? request->fileName : NULL);
+  ceditBuffers.buffers[0].document = ceditContext;
+
+  ceditSetStatusMessage("Use: ctrl+S = Save | ctrl+Q = Quit | ctrl+F = Find | ctrl+W = Buffers");
+  ceditEditLoop();
+}
+
+void ceditServerStart(int connection, struct ceditServerRequest *request, int *fds)
+{
+  struct ceditConfig *document = NULL;
+  if (request->fileName[0])
+  {
+    char path[PATH_MAX * 2];
+    if (request->fileName[0] == '/')
+      snprintf(path, sizeof(path), "%s", request->fileName);
+    else
+      snprintf(path, sizeof(path), "%s/%s", request->directory, request->fileName);
+    char *resolved = realpath(path, NULL);
+    if (resolved)
+      document = ceditServerDocument(resolved);
+    free(resolved);
+  }
+
+  pid_t pid = fork();
+  if (pid == 0)
+    ceditServerSession(connection, document, request, fds);
+  if (pid == -1)
+    perror("Fork Error!");
+  int j;
+  for (j = 0; j < 3; j++)
+    close(fds[j]);
+}
+
+void ceditServerStop(int signalNumber)
+{
+  unlink(ceditServer.address.sun_path);
+  signal(signalNumber, SIG_DFL);
+  raise(signalNumber);
+}
+
+int ceditServerRun()
+{
+  if (ceditServerListen() == -1)
+  {
+    fprintf(stderr, "%s: %s\n", ceditServer.address.sun_path, strerror(errno));
+    return 1;
+  }
+  // Clients only wait for their socket to close; nobody waits for children
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGINT, ceditServerStop);
+  signal(SIGTERM, ceditServerStop);
+  signal(SIGHUP, ceditServerStop);
+
+  while (1)
+  {
+    int connection = accept4(ceditServer.listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (connection == -1)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror("Accept Error!");
+      unlink(ceditServer.address.sun_path);
+      return 1;
+    }
+
+    // The child inherits the connection and holds it open until it exits
+    struct ceditServerRequest request;
+    int fds[3];
+    if (ceditServerReceive(connection, &request, fds) == 0)
+      ceditServerStart(connection, &request, fds);
+    close(connection);
+  }
 }
 
 /*** INITIALIZATION ***/
 
-void startCedit()
+void ceditInitDocument()
 {
   Cedit.cursorX = 0;
   Cedit.cursorY = 0;
@@ -1355,38 +9601,275 @@ void startCedit()
   Cedit.columnOff = 0;
   Cedit.rowNum = 0;
   Cedit.row = NULL;
+  Cedit.rowCapacity = 0;
   Cedit.modified = 0;
   Cedit.fileName = NULL;
   Cedit.statusMessage[0] = '\0';
   Cedit.statusMessageTime = 0;
   Cedit.syntax = NULL;
+  Cedit.bracketNodes = NULL;
+  Cedit.bracketNodeNum = Cedit.bracketNodeCapacity = 0;
+  Cedit.bracketFree = Cedit.bracketRoot = -1;
+  Cedit.bracketSeed = 2463534242u;
+  Cedit.bracketTreeDirty = 1;
+  Cedit.bracketRow = Cedit.bracketMatchRow = -1;
+  Cedit.matchRow = -1;
+  Cedit.watchNum = 0;
+  Cedit.saving = 0;
+  Cedit.saveSync = SYNC_NONE;
+  Cedit.inotifyFd = -1;
+  Cedit.inotifyWatch = -1;
+  Cedit.diskChanged = 0;
+  Cedit.syntaxDeferred = 0;
+  Cedit.syntaxPending = NULL;
+  Cedit.syntaxPendingNum = 0;
+  Cedit.streamFd = -1;
+  Cedit.chunkScratch = NULL;
+  Cedit.chunkScratchCapacity = 0;
+  Cedit.lastRowOpen = 0;
+  Cedit.pendingReturn = 0;
+  Cedit.follow = 0;
+  Cedit.fileOffset = 0;
+  memset(&Cedit.cold, 0, sizeof(Cedit.cold));
+  Cedit.cold.budget = CEDIT_DEFAULT_MEMORY_BUDGET;
+  Cedit.cold.clock = 1;
+  Cedit.indexCache = 0;
+  memset(&Cedit.intern, 0, sizeof(Cedit.intern));
+  memset(&Cedit.project, 0, sizeof(Cedit.project));
+  memset(&Cedit.disk, 0, sizeof(Cedit.disk));
+  memset(&Cedit.frame, 0, sizeof(Cedit.frame));
+  memset(&Cedit.fold, 0, sizeof(Cedit.fold));
+  memset(&Cedit.output, 0, sizeof(Cedit.output));
+  Cedit.markRow = -1;
+  Cedit.markColumn = 0;
+  memset(&Cedit.hex, 0, sizeof(Cedit.hex));
+  Cedit.project.notify[0] = Cedit.project.notify[1] = -1;
+  pthread_mutex_init(&Cedit.project.lock, NULL);
+  pthread_cond_init(&Cedit.project.work, NULL);
+}
+
+void ceditClearRows()
+{
+  int j;
+  for (j = 0; j < Cedit.rowNum; j++)
+  {
+    ceditRowWarm(&Cedit.row[j]);
+    ceditFreeRow(&Cedit.row[j]);
+  }
+  Cedit.rowNum = 0;
+  Cedit.cursorX = Cedit.cursorY = 0;
+  Cedit.rowOff = Cedit.columnOff = 0;
+  Cedit.bracketTreeDirty = 1;
+  Cedit.bracketRow = Cedit.bracketMatchRow = -1;
+  Cedit.syntaxPendingNum = 0;
+  Cedit.lastRowOpen = 0;
+  Cedit.pendingReturn = 0;
+  Cedit.disk.cleanRows = 0;
+  Cedit.fold.foldNum = 0;
+  Cedit.fold.dirty = 1;
+  Cedit.markRow = -1;
+}
+
+void ceditCloseDocument()
+{
+  ceditClearRows();
+  ceditHexClose();
+  free(Cedit.row);
+  free(Cedit.bracketNodes);
+  free(Cedit.syntaxPending);
+  free(Cedit.cold.tick);
+  free(Cedit.cold.scratch);
+  free(Cedit.chunkScratch);
+  free(Cedit.intern.buckets);
+  free(Cedit.disk.hashes);
+  free(Cedit.disk.sizes);
+  free(Cedit.fold.folds);
+  free(Cedit.fold.runs);
+  free(Cedit.screenHash);
+  free(Cedit.output.cells);
+  free(Cedit.output.scratch);
+  free(Cedit.fileName);
+  if (Cedit.inotifyFd != -1)
+    close(Cedit.inotifyFd);
+  pthread_mutex_destroy(&Cedit.project.lock);
+  pthread_cond_destroy(&Cedit.project.work);
+}
+
+void startCedit()
+{
+  ceditInitDocument();
+  ceditStartTerminal();
+}
 
-  if (getTerminalSize(&Cedit.terminalRows, &Cedit.terminalColumns) == -1)
+void ceditStartTerminal()
+{
+  // A replay draws at the size the session was recorded at
+  if (ceditTrace.replaying)
+  {
+    Cedit.terminalRows = ceditTrace.rows;
+    Cedit.terminalColumns = ceditTrace.columns;
+  }
+  else if (getTerminalSize(&Cedit.terminalRows, &Cedit.terminalColumns) == -1)
     terminateProgram("Window Size Error!");
   Cedit.terminalRows -= 2;
+
+  ceditOutputReset();
+  Cedit.screenRowOff = 0;
+  Cedit.screenColumnOff = 0;
+}
+
+void ceditEditLoop()
+{
+  while (1)
+  {
+    ceditRefreshTerminal();
+    ceditProcessKeypress();
+    ceditDrainInput();
+  }
 }
 
 /*** MAIN FUNCTION ***/
 int main(int argc, char *argv[])
 {
-  rawModeOn();
-  startCedit();
-  if (argc == 2)
+  char *fileName = NULL;
+  char *script = NULL;
+  char **files = malloc(sizeof(char *) * argc);
+  int fileNum = 0;
+  int jobs = 0;
+  int saveSync = SYNC_NONE;
+  int follow = 0;
+  long long memoryBudget = CEDIT_DEFAULT_MEMORY_BUDGET;
+  int indexCache = 0;
+  int intern = 0;
+  int fps = CEDIT_DEFAULT_FPS;
+  char *record = NULL;
+  char *replay = NULL;
+  int replayFast = 0;
+  int rep = 0;
+  int server = 0;
+  int client = 0;
+  int j;
+  for (j = 1; j < argc; j++)
   {
-    ceditOpen(argv[1]);
+    if (!strcmp(argv[j], "--sync=none"))
+      saveSync = SYNC_NONE;
+    else if (!strcmp(argv[j], "--sync=fdatasync"))
+      saveSync = SYNC_DATA;
+    else if (!strcmp(argv[j], "--sync=fsync"))
+      saveSync = SYNC_FULL;
+    else if (!strcmp(argv[j], "--follow"))
+      follow = 1;
+    else if (!strncmp(argv[j], "--memory-budget=", 16))
+      memoryBudget = atoll(argv[j] + 16) << 20;
+    else if (!strcmp(argv[j], "--index-cache"))
+      indexCache = 1;
+    else if (!strcmp(argv[j], "--intern"))
+      intern = 1;
+    else if (!strncmp(argv[j], "--fps=", 6) && atoi(argv[j] + 6) >= 0)
+      fps = atoi(argv[j] + 6);
+    else if (!strncmp(argv[j], "--record=", 9) && argv[j][9] != '\0')
+      record = argv[j] + 9;
+    else if (!strncmp(argv[j], "--replay=", 9) && argv[j][9] != '\0')
+      replay = argv[j] + 9;
+    else if (!strcmp(argv[j], "--replay-speed=original"))
+      replayFast = 0;
+    else if (!strcmp(argv[j], "--replay-speed=fast"))
+      replayFast = 1;
+    else if (!strcmp(argv[j], "--rep"))
+      rep = 1;
+    else if (!strcmp(argv[j], "--server"))
+      server = 1;
+    else if (!strcmp(argv[j], "--client"))
+      client = 1;
+    else if (!strcmp(argv[j], "--batch") && j + 1 < argc && script == NULL)
+      script = argv[++j];
+    else if (!strncmp(argv[j], "--jobs=", 7) && atoi(argv[j] + 7) > 0)
+      jobs = atoi(argv[j] + 7);
+    else if (argv[j][0] == '-' && argv[j][1] != '\0')
+      usageProgram();
+    else
+      files[fileNum++] = argv[j];
   }
-  else if (argc != 1 && argc != 2)
+
+  if (script && fileNum > 0)
   {
+    int status = ceditBatchRun(script, files, fileNum, jobs);
+    free(files);
+    return status;
+  }
+  if (script || (record && replay))
+    usageProgram();
+  if ((server || client) && (record || replay || fileNum > 1 || (server && (client || fileNum))))
     usageProgram();
+  if (fileNum)
+    fileName = files[0];
+  // A pipe can only be read into the one buffer
+  for (j = 0; fileNum > 1 && j < fileNum; j++)
+    if (!strcmp(files[j], "-"))
+      usageProgram();
+
+  // Only if no server answers does the client start an editor of its own
+  if (client && ceditClient(fileName, follow) == 0)
+  {
+    free(files);
+    return 0;
   }
 
-  ceditSetStatusMessage("Use: ctrl+S = Save | ctrl+Q = Quit | ctrl+F = Find");
+  if (replay && ceditTraceReplay(replay, replayFast) == -1)
+  {
+    fprintf(stderr, "%s: %s\n", replay, strerror(errno));
+    return 1;
+  }
 
-  while (1)
+  // With the document coming from stdin, keys are read from the terminal
+  int streamFd = -1;
+  if ((fileName && !strcmp(fileName, "-")) || (!fileName && !replay && !server && !isatty(STDIN_FILENO)))
+    streamFd = ceditRedirectInput();
+
+  // The server's own document never shows; it only holds the options
+  if (server)
   {
-    ceditRefreshTerminal();
-    ceditProcessKeypress();
+    ceditHeadless = 1;
+    ceditInitDocument();
+  }
+  else
+  {
+    if (!replay)
+      rawModeOn();
+    startCedit();
+  }
+  if (record && ceditTraceRecord(record) == -1)
+    terminateProgram("Trace Open Error!");
+  Cedit.saveSync = saveSync;
+  Cedit.cold.budget = memoryBudget;
+  Cedit.indexCache = indexCache;
+  Cedit.intern.enabled = intern;
+  Cedit.frame.interval = fps ? 1000000000LL / fps : 0;
+  ceditOutputDetect(rep);
+  if (server)
+  {
+    free(files);
+    ceditServer.rep = rep;
+    return ceditServerRun();
   }
 
+  // Every file named gets a buffer, but only the first is loaded now
+  for (j = 0; j < fileNum || j == 0; j++)
+    ceditBufferAdd(fileNum ? files[j] : NULL);
+  ceditBuffers.buffers[0].document = &ceditMain;
+  free(files);
+
+  if (streamFd != -1)
+    ceditStreamOpen(streamFd);
+  else if (fileName)
+    ceditOpen(fileName);
+  if (follow && Cedit.fileName)
+    ceditToggleFollow();
+
+  ceditSetStatusMessage("Use: ctrl+S = Save | ctrl+Q = Quit | ctrl+F = Find | ctrl+W = Buffers");
+  if (replay)
+    ceditReplay();
+  ceditEditLoop();
+
   return 0;
 }
\ No newline at end of file